@@ -6,9 +6,12 @@
 #include <QDir>
 #include <QDebug>
 #include <map>
+#include <unordered_map>
 #include <sstream>
 #include <string>
 #include "utils.h"
+#include "meshprocessing.h"
+#include "streaming.h"
 
 // 定义全局AssetManager实例
 AssetManager assetManager;
@@ -99,7 +102,7 @@ GameObject *AssetManager::loadOBJ(const QString& objPath, bool isStatic)
 
     Mesh currentMesh;
     currentMesh.materialID = -1;
-    std::map<std::pair<uint, uint>, uint> vertexMap;
+    std::unordered_map<uint64_t, uint> vertexMap;   // (posIdx << 32 | uvIdx) -> 顶点下标
 
     QString objBaseDir = QFileInfo(objPath).absolutePath();
     QTextStream in(&objFile);
@@ -128,6 +131,10 @@ GameObject *AssetManager::loadOBJ(const QString& objPath, bool isStatic)
             QString mtlName = QString::fromStdString(parts[1]);
             if (!currentMesh.triangles.empty()) {
                 currentMesh.meshID = m_meshes.size();
+                cleanMesh(currentMesh);
+                generateLODs(currentMesh);
+                buildMeshlets(currentMesh);
+                currentMesh.computeBounds();
                 m_meshes.push_back(currentMesh);
                 // raytestManager.appendMesh(currentMesh);
                 subObjects.push_back(new MeshActor(currentMesh.meshID, isStatic));
@@ -158,15 +165,15 @@ GameObject *AssetManager::loadOBJ(const QString& objPath, bool isStatic)
                 if (posIdx >= tempPos.size()) { faceValid = false; break; }
 
                 // 使用 Map 复用顶点，减少冗余
-                std::pair<uint, uint> key = {posIdx, uvIdx};
-                if (vertexMap.find(key) == vertexMap.end()) {
+                uint64_t key = (uint64_t(posIdx) << 32) | uvIdx;
+                auto [it, inserted] = vertexMap.try_emplace(key, (uint)currentMesh.vertices.size());
+                if (inserted) {
                     Vertex v;
                     v.pos = tempPos[posIdx];
                     v.uv = (uvIdx < tempUV.size()) ? tempUV[uvIdx] : Vec3(0, 0, 0);
-                    vertexMap[key] = (uint)currentMesh.vertices.size();
                     currentMesh.vertices.push_back(v);
                 }
-                faceVertexIndices.push_back(vertexMap[key]);
+                faceVertexIndices.push_back(it->second);
             }
 
             if (!faceValid || faceVertexIndices.size() < 3) continue;
@@ -193,6 +200,10 @@ GameObject *AssetManager::loadOBJ(const QString& objPath, bool isStatic)
     if (!currentMesh.triangles.empty()) {
         // raytestManager.appendMesh(currentMesh);
         currentMesh.meshID = m_meshes.size();
+        cleanMesh(currentMesh);
+        generateLODs(currentMesh);
+        buildMeshlets(currentMesh);
+        currentMesh.computeBounds();
         m_meshes.push_back(currentMesh);
         subObjects.push_back(new MeshActor(currentMesh.meshID, isStatic));
     }
@@ -256,3 +267,267 @@ TextureMap::TextureMap(const QImage &img){
         }
     }
 }
+
+const CompactMesh &AssetManager::getCompactMesh(uint meshID){
+    std::lock_guard<std::mutex> lock(m_compactMutex);
+    const Mesh &mesh = m_meshes.at(meshID);
+    if(m_compactMeshes.size() < m_meshes.size()) m_compactMeshes.resize(m_meshes.size());
+    CompactMesh &ret = m_compactMeshes[meshID];
+    if(ret.empty() && !mesh.triangles.empty()) ret = compressMesh(mesh);
+    return ret;
+}
+
+const CompactMesh &AssetManager::compactMesh(uint meshID) const{
+    std::lock_guard<std::mutex> lock(m_compactMutex);
+    return m_compactMeshes.at(meshID);
+}
+
+uint AssetManager::addMesh(Mesh &&mesh){
+    uint meshID;
+    if(m_freeMeshIDs.size()){
+        meshID = m_freeMeshIDs.back();
+        m_freeMeshIDs.pop_back();
+    }else{
+        meshID = m_meshes.size();
+        m_meshes.push_back({});
+    }
+    mesh.meshID = meshID;
+    m_meshes[meshID] = std::move(mesh);
+    // 旧的紧凑编码是上一个占用者的
+    if(meshID < m_compactMeshes.size()) m_compactMeshes[meshID] = CompactMesh();
+    return meshID;
+}
+
+void AssetManager::releaseMesh(uint meshID){
+    m_meshes.at(meshID) = Mesh();
+    if(meshID < m_compactMeshes.size()) m_compactMeshes[meshID] = CompactMesh();
+    m_freeMeshIDs.push_back(meshID);
+}
+
+uint AssetManager::addMaterial(){
+    m_materials.push_back({});
+    return m_materials.size() - 1;
+}
+
+void AssetManager::setMaterial(uint materialID, Material &&material){
+    m_materials.at(materialID) = std::move(material);
+    m_materialVersion++;
+}
+
+void AssetManager::releaseMaterial(uint materialID){
+    m_materials.at(materialID) = Material();
+    m_materialVersion++;
+}
+
+// 只读 MTL 里的材质名和贴图路径，不解码贴图
+static std::map<QString, QString> readMTLTextures(const QString& mtlPath, const QString& baseDir)
+{
+    std::map<QString, QString> ret;
+    QFile mtlFile(mtlPath);
+    if (!mtlFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "[MTL] Failed to open:" << mtlPath;
+        return ret;
+    }
+    QTextStream in(&mtlFile);
+    QString currentMtlName;
+    while (!in.atEnd()) {
+        QString line = in.readLine().simplified();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+        std::vector<std::string> parts = splitString(line.toStdString());
+        if (parts[0] == "newmtl") {
+            currentMtlName = (parts.size() > 1) ? QString::fromStdString(parts[1]) : "default";
+            ret[currentMtlName] = "";
+        }
+        else if (parts[0] == "map_Kd" && parts.size() > 1) {
+            ret[currentMtlName] = QDir(baseDir).absoluteFilePath(QString::fromStdString(parts[1]));
+        }
+    }
+    return ret;
+}
+
+bool AssetManager::buildStreamingPack(const QString &objPath, const QString &packPath, float cellSize)
+{
+    QFile objFile(objPath);
+    if (!objFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "[OBJ] Failed to open:" << objPath;
+        return false;
+    }
+    qInfo() << "[OBJ] Building streaming pack:" << objPath << "->" << packPath;
+
+    // 面只记下标，格子划分要等所有顶点读完才知道
+    struct PackFace{
+        uint pos[3], uv[3];
+        ushort material;
+        uint cell;
+    };
+    std::vector<Vec3> tempPos;
+    std::vector<Vec3> tempUV;
+    std::vector<PackFace> faces;
+    std::vector<QString> texturePaths;
+    std::map<QString, ushort> mtlNameToIndex;
+    ushort currentMaterial = -1;
+
+    QString objBaseDir = QFileInfo(objPath).absolutePath();
+    QTextStream in(&objFile);
+    while (!in.atEnd()) {
+        QString line = in.readLine().simplified();
+        if (line.isEmpty() || line.startsWith('#')) continue;
+        std::vector<std::string> parts = splitString(line.toStdString());
+        if (parts.empty()) continue;
+        std::string cmd = parts[0];
+
+        if (cmd == "v") {
+            tempPos.emplace_back(std::stof(parts[1]), std::stof(parts[2]), std::stof(parts[3]));
+        }
+        else if (cmd == "vt") {
+            tempUV.emplace_back(std::stof(parts[1]), 1.0f - std::stof(parts[2]), 0.0f);
+        }
+        else if (cmd == "mtllib") {
+            QString mtlAbsPath = QDir(objBaseDir).absoluteFilePath(QString::fromStdString(parts[1]));
+            for (auto &[name, path]: readMTLTextures(mtlAbsPath, objBaseDir)) {
+                if (mtlNameToIndex.count(name)) continue;
+                mtlNameToIndex[name] = texturePaths.size();
+                texturePaths.push_back(path);
+            }
+        }
+        else if (cmd == "usemtl") {
+            QString mtlName = QString::fromStdString(parts[1]);
+            currentMaterial = mtlNameToIndex.count(mtlName) ? mtlNameToIndex[mtlName] : ushort(-1);
+        }
+        else if (cmd == "f") {
+            if (parts.size() < 4) continue;
+            std::vector<std::pair<uint, uint>> corners;
+            bool faceValid = true;
+            for (size_t i = 1; i < parts.size(); ++i) {
+                std::vector<std::string> vParts = splitString(parts[i], '/');
+                if (vParts.empty()) { faceValid = false; break; }
+                uint posIdx = std::stoull(vParts[0]) - 1;
+                uint uvIdx = (vParts.size() > 1 && !vParts[1].empty()) ? (std::stoull(vParts[1]) - 1) : 0;
+                if (posIdx >= tempPos.size()) { faceValid = false; break; }
+                corners.push_back({posIdx, uvIdx});
+            }
+            if (!faceValid || corners.size() < 3) continue;
+            for (size_t i = 1; i < corners.size() - 1; ++i) {
+                PackFace face;
+                for (int k = 0; k < 3; k++) {
+                    auto [p, t] = corners[k == 0 ? 0 : i + k - 1];
+                    face.pos[k] = p;
+                    face.uv[k] = t;
+                }
+                face.material = currentMaterial;
+                faces.push_back(face);
+            }
+        }
+    }
+    objFile.close();
+    if (faces.empty()) return false;
+
+    BBox3D box(tempPos);
+    Vec3 origin = {box.x1, box.y1, box.z1};
+    int dims[3] = {
+        std::max(1, (int)std::ceil((box.x2 - box.x1) / cellSize)),
+        std::max(1, (int)std::ceil((box.y2 - box.y1) / cellSize)),
+        std::max(1, (int)std::ceil((box.z2 - box.z1) / cellSize)),
+    };
+    // 按三角形重心分格子，同一个格子里再按材质排在一起
+    for (PackFace &face: faces) {
+        Vec3 c = (tempPos[face.pos[0]] + tempPos[face.pos[1]] + tempPos[face.pos[2]]) / 3;
+        int x = std::clamp((int)std::floor((c.x - origin.x) / cellSize), 0, dims[0] - 1);
+        int y = std::clamp((int)std::floor((c.y - origin.y) / cellSize), 0, dims[1] - 1);
+        int z = std::clamp((int)std::floor((c.z - origin.z) / cellSize), 0, dims[2] - 1);
+        face.cell = (z * dims[1] + y) * dims[0] + x;
+    }
+    std::sort(faces.begin(), faces.end(), [](const PackFace &a, const PackFace &b){
+        return a.cell < b.cell || (a.cell == b.cell && a.material < b.material);
+    });
+
+    QFile packFile(packPath);
+    if (!packFile.open(QIODevice::WriteOnly)) {
+        qWarning() << "[Streaming] Failed to write:" << packPath;
+        return false;
+    }
+    StreamingPackHeader header = {streamingPackMagic, streamingPackVersion, {origin.x, origin.y, origin.z}, cellSize,
+                                  {dims[0], dims[1], dims[2]}, 0, (uint32_t)texturePaths.size(), 0};
+    packFile.write((const char*)&header, sizeof(header));
+    uint64_t offset = sizeof(header);
+
+    std::vector<StreamingCellRecord> records;
+    std::vector<ushort> cellMaterials;
+    for (size_t begin = 0; begin < faces.size(); ) {
+        uint cell = faces[begin].cell;
+        StreamingCellRecord record = {};
+        record.coord[0] = cell % dims[0];
+        record.coord[1] = cell / dims[0] % dims[1];
+        record.coord[2] = cell / dims[0] / dims[1];
+        record.offset = offset;
+        record.materialBegin = cellMaterials.size();
+        BBox3D cellBox;
+        size_t end = begin;
+        while (end < faces.size() && faces[end].cell == cell) {
+            ushort material = faces[end].material;
+            Mesh mesh;
+            mesh.materialID = material;
+            std::unordered_map<uint64_t, uint> vertexMap;
+            for (; end < faces.size() && faces[end].cell == cell && faces[end].material == material; end++) {
+                Triangle tri;
+                for (int k = 0; k < 3; k++) {
+                    uint64_t key = (uint64_t(faces[end].pos[k]) << 32) | faces[end].uv[k];
+                    auto [it, inserted] = vertexMap.try_emplace(key, (uint)mesh.vertices.size());
+                    if (inserted) {
+                        Vertex v;
+                        v.pos = tempPos[faces[end].pos[k]];
+                        v.uv = (faces[end].uv[k] < tempUV.size()) ? tempUV[faces[end].uv[k]] : Vec3(0, 0, 0);
+                        mesh.vertices.push_back(v);
+                    }
+                    tri.vid[k] = it->second;
+                }
+                Vec3 v0 = mesh.vertices[tri.vid[0]].pos;
+                Vec3 v1 = mesh.vertices[tri.vid[1]].pos;
+                Vec3 v2 = mesh.vertices[tri.vid[2]].pos;
+                tri.hardNormal = (v1 - v0).cross(v2 - v0);
+                tri.hardNormal.normalize();
+                mesh.triangles.push_back(tri);
+            }
+            cleanMesh(mesh);
+            if (mesh.triangles.empty()) continue;
+            uint32_t vertexCount = mesh.vertices.size(), triangleCount = mesh.triangles.size();
+            packFile.write((const char*)&material, sizeof(material));
+            packFile.write((const char*)&vertexCount, sizeof(vertexCount));
+            packFile.write((const char*)&triangleCount, sizeof(triangleCount));
+            packFile.write((const char*)mesh.vertices.data(), vertexCount * sizeof(Vertex));
+            for (const Triangle &t: mesh.triangles) packFile.write((const char*)t.vid, sizeof(t.vid));
+            offset += sizeof(material) + sizeof(vertexCount) + sizeof(triangleCount)
+                    + vertexCount * sizeof(Vertex) + triangleCount * sizeof(Triangle::vid);
+            for (const Vertex &v: mesh.vertices) cellBox = cellBox.merge(BBox3D({v.pos}));
+            record.vertexCount += vertexCount;
+            record.triangleCount += triangleCount;
+            record.meshCount++;
+            if (material != ushort(-1)) cellMaterials.push_back(material);
+        }
+        begin = end;
+        if (record.meshCount == 0) continue;
+        record.size = offset - record.offset;
+        record.lo[0] = cellBox.x1, record.lo[1] = cellBox.y1, record.lo[2] = cellBox.z1;
+        record.hi[0] = cellBox.x2, record.hi[1] = cellBox.y2, record.hi[2] = cellBox.z2;
+        record.materialCount = cellMaterials.size() - record.materialBegin;
+        records.push_back(record);
+    }
+
+    header.cellCount = records.size();
+    header.indexOffset = offset;
+    for (const QString &path: texturePaths) {
+        std::string utf8 = path.toStdString();
+        uint32_t len = utf8.size();
+        packFile.write((const char*)&len, sizeof(len));
+        packFile.write(utf8.data(), len);
+    }
+    packFile.write((const char*)records.data(), records.size() * sizeof(StreamingCellRecord));
+    uint32_t materialListSize = cellMaterials.size();
+    packFile.write((const char*)&materialListSize, sizeof(materialListSize));
+    packFile.write((const char*)cellMaterials.data(), cellMaterials.size() * sizeof(ushort));
+    packFile.seek(0);
+    packFile.write((const char*)&header, sizeof(header));
+    packFile.close();
+    qInfo() << "[OBJ] Streaming pack written:" << records.size() << "cells," << faces.size() << "triangles";
+    return true;
+}
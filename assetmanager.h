@@ -4,6 +4,8 @@
 #include "structures.h"
 #include "gameobject.h"
 #include <map>
+#include <deque>
+#include <mutex>
 
 
 const int textureTileSize = 64;
@@ -49,6 +51,24 @@ public:
     // 公共获取接口（只读，避免外部修改内部数据）
     std::vector<Mesh>& getMeshes() { return m_meshes; }
     std::vector<Material>& getMaterials() { return m_materials; }
+    // 网格的紧凑编码，第一次用到时生成（目前只有实例化在每帧读网格数据）。
+    // 几个 Renderer 可以同时调用；渲染线程用 compactMesh 读已经生成好的，生成好的编码地址不变
+    const CompactMesh &getCompactMesh(uint meshID);
+    const CompactMesh &compactMesh(uint meshID) const;
+
+    // 流式加载用：网格和材质按槽位分配，释放之后槽位可以复用，ID 在占用期间不变。
+    // 都只能在两帧之间调用
+    uint addMesh(Mesh &&mesh);
+    void releaseMesh(uint meshID);
+    uint addMaterial();         // 先占一个没有贴图的位置
+    void setMaterial(uint materialID, Material &&material);
+    void releaseMaterial(uint materialID);
+    // 已有材质的内容每变一次加一，增量渲染靠它判断缓存的颜色是否过期
+    uint materialVersion() const { return m_materialVersion; }
+
+    // 把 OBJ 按 cellSize 的格子切开，每个格子按材质分成若干网格写进流式包（格式见 streaming.h）。
+    // 只保留顶点坐标和面的下标，一次处理一个格子，不会把整张地图的网格同时放在内存里
+    bool buildStreamingPack(const QString &objPath, const QString &packPath, float cellSize);
 
 private:
     // 辅助方法：加载MTL材质文件（解析漫反射贴图map_Kd）
@@ -58,6 +78,10 @@ private:
     // 成员变量：存储所有加载的网格和材质
     std::vector<Mesh> m_meshes;
     std::vector<Material> m_materials;
+    std::deque<CompactMesh> m_compactMeshes;
+    mutable std::mutex m_compactMutex;
+    std::vector<uint> m_freeMeshIDs;
+    uint m_materialVersion = 0;
 };
 
 class SceneManager{
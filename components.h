@@ -0,0 +1,81 @@
+#ifndef COMPONENTS_H
+#define COMPONENTS_H
+
+#include <vector>
+#include <cassert>
+#include <utility>
+
+// 没有定义 Columns 的组件类型用它，什么都不存
+struct NoComponentColumns{
+    template<typename F> void forEach(F &&){}
+};
+template<typename T> struct ComponentColumnsOf{ using type = NoComponentColumns; };
+template<typename T> requires requires{ typename T::Columns; }
+struct ComponentColumnsOf<T>{ using type = typename T::Columns; };
+
+// 按类型分开存放的组件表。每种组件一个紧凑的指针数组，增删都是 O(1)（删除时和末尾交换），
+// 遍历某一类组件就是扫一遍连续内存，不用在对象树上逐个 dynamic_cast。
+// 组件类型可以定义 Columns：扫描时要查的字段拆成一列一列的数组，和指针数组一样按 componentIndex 排，
+// 增删时跟着一起交换。Columns 要提供 forEach(f)，对每一列 std::vector 调一次 f。
+// 注意删除会打乱顺序，需要稳定顺序的地方自己排序
+template<typename T>
+class ComponentStore{
+public:
+    using Columns = typename ComponentColumnsOf<T>::type;
+
+    void add(T *c){
+        c->m_componentIndex = items.size();
+        items.push_back(c);
+        m_columns.forEach([](auto &column){ column.emplace_back(); });
+        m_version++;
+    }
+    void remove(T *c){
+        uint index = c->m_componentIndex;
+        assert(index < items.size() && items[index] == c);
+        items[index] = items.back();
+        items[index]->m_componentIndex = index;
+        items.pop_back();
+        m_columns.forEach([index](auto &column){
+            column[index] = std::move(column.back());
+            column.pop_back();
+        });
+        m_version++;
+    }
+    uint size() const{ return items.size(); }
+    // 每次增删加一，缓存了组件列表的地方用它判断要不要重建
+    uint version() const{ return m_version; }
+    T *operator[](uint i) const{ return items[i]; }
+    typename std::vector<T*>::const_iterator begin() const{ return items.begin(); }
+    typename std::vector<T*>::const_iterator end() const{ return items.end(); }
+    // 只应该由组件自己改
+    Columns &columns(){ return m_columns; }
+    const Columns &columns() const{ return m_columns; }
+
+private:
+    std::vector<T*> items;
+    Columns m_columns;
+    uint m_version = 0;
+};
+
+template<typename T>
+ComponentStore<T> &components(){
+    static ComponentStore<T> store;
+    return store;
+}
+
+// 继承它的类在构造时登记到 components<T>()，析构时移除
+template<typename T>
+class Component{
+public:
+    uint componentIndex() const{ return m_componentIndex; }
+protected:
+    Component(){ components<T>().add(static_cast<T*>(this)); }
+    ~Component(){ components<T>().remove(static_cast<T*>(this)); }
+    Component(const Component &) = delete;
+    Component &operator =(const Component &) = delete;
+private:
+    uint m_componentIndex;
+    friend class ComponentStore<T>;
+};
+
+#endif // COMPONENTS_H
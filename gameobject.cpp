@@ -1,53 +1,93 @@
 #include "gameobject.h"
 #include "assetmanager.h"
 #include "render.h"
+#include "utils.h"
+#include "meshprocessing.h"
 #include <QDebug>
+#include <QChildEvent>
+
+// Handle -> GameObject，给按层级顺序遍历的地方用
+static std::vector<GameObject*> objectsByHandle;
 
 GameObject::GameObject(QObject *parent)
-    : QObject{parent}, transform()
-{}
+    : QObject{parent}
+{
+    GameObject *p = dynamic_cast<GameObject*>(parent);
+    m_transformHandle = transformHierarchy.create(p ? p->m_transformHandle : TransformHierarchy::invalidHandle);
+    if(objectsByHandle.size() <= m_transformHandle) objectsByHandle.resize(m_transformHandle + 1);
+    objectsByHandle[m_transformHandle] = this;
+}
+
+GameObject::~GameObject(){
+    objectsByHandle[m_transformHandle] = nullptr;
+    transformHierarchy.destroy(m_transformHandle);
+}
+
+// 构造时传进来的父对象在构造函数里处理，这里管之后的 setParent。
+// 被移除时子对象可能已经析构到只剩 QObject，cast 不出来就不用管了
+void GameObject::childEvent(QChildEvent *event){
+    GameObject *child = dynamic_cast<GameObject*>(event->child());
+    if(child == nullptr) return;
+    if(event->added()) transformHierarchy.setParent(child->m_transformHandle, m_transformHandle);
+    else if(event->removed() && transformHierarchy.parent(child->m_transformHandle) == m_transformHandle)
+        transformHierarchy.setParent(child->m_transformHandle, TransformHierarchy::invalidHandle);
+}
+
+TransformHierarchy::Handle GameObject::transformHandle() const{
+    return m_transformHandle;
+}
+
+bool GameObject::isUnder(const GameObject *ancestor) const{
+    TransformHierarchy::Handle target = ancestor->m_transformHandle;
+    // 大部分查询的 ancestor 是某棵树的根，这时一次比较就够了
+    if(transformHierarchy.root(m_transformHandle) == target) return true;
+    for(TransformHierarchy::Handle h = m_transformHandle; h != TransformHierarchy::invalidHandle; h = transformHierarchy.parent(h))
+        if(h == target) return true;
+    return false;
+}
+
+GameObject *GameObject::fromTransformHandle(TransformHierarchy::Handle h){
+    return objectsByHandle.at(h);
+}
 
 void MeshActor::setScale(float s){
-    modified = true;
     this->scale = s;
+    transformHierarchy.markDirty(m_transformHandle);
 }
 
 void GameObject::updatePosition(const Transform &t){}
 
-void GameObject::submitForRender(){}
+void GameObject::submitForRender(const CameraInfo &camera){}
 
 void GameObject::translate(const Vec3 &v){
-    modified = true;
-    transform = transform * Transform::translate(v);
+    setTransform(getTransform() * Transform::translate(v));
 }
 
 void GameObject::localTranslate(const Vec3 &v){
-    modified = true;
-    transform = Transform::translate(v) * transform;
+    setTransform(Transform::translate(v) * getTransform());
 }
 
 void GameObject::moveToLocalPos(const Vec3 &v){
-    modified = true;
-    transform.translation = v;
+    Transform t = getTransform();
+    t.translation = v;
+    setTransform(t);
 }
 void GameObject::setTransform(const Transform &t){
-    modified = true;
-    transform = t;
+    transformHierarchy.setLocal(m_transformHandle, t);
 }
 const Transform &GameObject::getTransform()const{
-    return transform;
+    return transformHierarchy.local(m_transformHandle);
 }
 
 void GameObject::rotateAroundAxis(const Vec3 &v, float rad){
-    modified = true;
-    Vec3 tmp = transform.translation;
-    transform = transform * Transform::rotateAroundAxis(v, rad);
-    transform.translation = tmp;
+    Transform t = getTransform();
+    Vec3 tmp = t.translation;
+    t = t * Transform::rotateAroundAxis(v, rad);
+    t.translation = tmp;
+    setTransform(t);
 }
 Transform GameObject::getGlobalTransform()const{
-    GameObject *f = parent();
-    if(f == nullptr) return Transform();
-    return transform * f->getGlobalTransform();
+    return transformHierarchy.world(m_transformHandle);
 }
 
 GameObject *GameObject::parent() const{
@@ -63,20 +103,172 @@ QList<GameObject*> GameObject::children() const{
     return ret;
 }
 
+// 资源里的一级网格缩放、变换到世界坐标写进 dst。只拷渲染和射线检测要用的部分，简化链留在资源里
+static void placeMesh(const Mesh &src, float scale, const Transform &t, Mesh &dst){
+    dst.vertices = src.vertices;
+    dst.triangles = src.triangles;
+    dst.meshlets = src.meshlets;
+    dst.bounds = src.bounds;
+    dst.materialID = src.materialID;
+    dst.shaderConfig = src.shaderConfig;
+    dst.meshID = src.meshID;
+    dst.lodError = src.lodError;
+    dst.scale(scale);
+    dst.applyTransform(t);
+}
+
 MeshActor::MeshActor(uint _meshID, bool _isStatic, QObject *_parent)
-    : GameObject(_parent), meshID(_meshID){
-    isStatic = _isStatic;
-    mesh = assetManager.getMeshes().at(meshID);
+    : GameObject(_parent), meshID(_meshID), isStatic(_isStatic), renderObject(invalidRenderObject){
+    placeMesh(assetManager.getMeshes().at(meshID), 1.0f, Transform(), mesh);
+    Columns &columns = components<MeshActor>().columns();
+    columns.bounds[componentIndex()] = mesh.bounds;
+    columns.meshID[componentIndex()] = meshID;
+    columns.flags[componentIndex()] = (isStatic ? Static : 0) | Visible;
+    columns.transform[componentIndex()] = m_transformHandle;
+}
+
+void MeshActor::setFlag(Flag flag, bool on){
+    uint8_t &flags = components<MeshActor>().columns().flags[componentIndex()];
+    flags = on ? flags | flag : flags & ~flag;
+}
+
+MeshActor::~MeshActor(){
+    if(renderObject != invalidRenderObject) destroyRenderObject(renderObject);
 }
 
 void MeshActor::updatePosition(const Transform &t){
-    mesh = assetManager.getMeshes().at(meshID);
-    mesh.scale(this->scale);
-    mesh.applyTransform(t);
+    globalTransform = t;
+    placeMesh(assetManager.getMeshes().at(meshID), this->scale, t, mesh);
+    components<MeshActor>().columns().bounds[componentIndex()] = mesh.bounds;
+    uploadLevel();
+    uploadOccluder();
+}
+
+void MeshActor::uploadLevel(){
+    if(batched) return;
+    const Mesh *level = &mesh;
+    Mesh simplified;
+    if(lodLevel > 0){
+        placeMesh(assetManager.getMeshes().at(meshID).lods.at(lodLevel - 1), this->scale, globalTransform, simplified);
+        level = &simplified;
+    }
+    if(renderObject == invalidRenderObject){
+        renderObject = createRenderObject(*level);
+        setRenderObjectVisible(renderObject, visible);
+        setRenderObjectCulled(renderObject, culled);
+    }
+    else updateRenderObject(renderObject, *level);
+}
+
+// 变换没变时常驻数据不动，只有按屏幕大小选出来的级别变了才重新上传
+void MeshActor::submitForRender(const CameraInfo &camera){
+    if(batched || culled) return;
+    int level = selectLOD(assetManager.getMeshes().at(meshID), scale, mesh.bounds, camera, lodLevel);
+    if(level == lodLevel) return;
+    lodLevel = level;
+    uploadLevel();
+}
+
+bool MeshActor::isVisible() const{
+    return visible;
+}
+
+bool MeshActor::isOccluder() const{
+    return occluder;
+}
+
+void MeshActor::setOccluder(bool _occluder, const Mesh *proxy){
+    occluder = _occluder;
+    hasOccluderProxy = proxy != nullptr;
+    occluderProxy = hasOccluderProxy ? *proxy : Mesh();
+    uploadOccluder();
+}
+
+void MeshActor::uploadOccluder(){
+    if(renderObject == invalidRenderObject) return;
+    if(!occluder || !hasOccluderProxy){
+        setRenderObjectOccluder(renderObject, occluder);
+        return;
+    }
+    Mesh proxy = occluderProxy;
+    proxy.scale(this->scale);
+    proxy.applyTransform(globalTransform);
+    setRenderObjectOccluder(renderObject, true, &proxy);
+}
+
+void MeshActor::setBatched(bool _batched){
+    if(batched == _batched) return;
+    batched = _batched;
+    setFlag(Batched, batched);
+    if(batched){
+        if(renderObject != invalidRenderObject) destroyRenderObject(renderObject);
+        renderObject = invalidRenderObject;
+        return;
+    }
+    uploadLevel();
+    uploadOccluder();
+}
+
+bool MeshActor::isBatched() const{
+    return batched;
+}
+
+int MeshActor::currentLOD() const{
+    return lodLevel;
+}
+
+void MeshActor::setVisible(bool _visible){
+    visible = _visible;
+    setFlag(Visible, visible);
+    if(renderObject != invalidRenderObject) setRenderObjectVisible(renderObject, visible);
+}
+
+void MeshActor::setCulled(bool _culled){
+    if(culled == _culled) return;
+    culled = _culled;
+    if(renderObject != invalidRenderObject) setRenderObjectCulled(renderObject, culled);
 }
 
-void MeshActor::submitForRender(){
-    submitMesh(mesh);
+bool MeshActor::isCulled() const{
+    return culled;
+}
+
+InstancedMeshActor::InstancedMeshActor(uint _meshID, QObject *_parent)
+    : GameObject(_parent), meshID(_meshID){}
+
+uint InstancedMeshActor::addInstance(const Transform &t, float scale, ushort materialID){
+    localInstances.push_back({t, scale, materialID});
+    instancesDirty = true;
+    return localInstances.size() - 1;
+}
+
+void InstancedMeshActor::setInstance(uint index, const Transform &t, float scale, ushort materialID){
+    localInstances.at(index) = {t, scale, materialID};
+    instancesDirty = true;
+}
+
+void InstancedMeshActor::clearInstances(){
+    localInstances.clear();
+    instancesDirty = true;
+}
+
+uint InstancedMeshActor::instanceCount() const{
+    return localInstances.size();
+}
+
+void InstancedMeshActor::updatePosition(const Transform &t){
+    globalTransform = t;
+    instancesDirty = true;
+}
+
+void InstancedMeshActor::submitForRender(const CameraInfo &camera){
+    if(instancesDirty){
+        worldInstances.resize(localInstances.size());
+        for(auto [i, inst]: enumerate(localInstances))
+            worldInstances[i] = {inst.transform * globalTransform, inst.scale, inst.materialID};
+        instancesDirty = false;
+    }
+    submitInstances(meshID, worldInstances);
 }
 
 Camera::Camera(const CameraInfo &info, QObject *parent): GameObject(parent), camInfo(info){}
@@ -4,6 +4,8 @@
 #include <QObject>
 #include "transform.h"
 #include "structures.h"
+#include "render.h"
+#include "components.h"
 
 
 class GameObject : public QObject
@@ -15,6 +17,7 @@ private:
 public:
 
     explicit GameObject(QObject *parent = nullptr);
+    ~GameObject();
 
     // 相对于自身的变换
     void localTranslate(const Vec3 &v);
@@ -26,9 +29,14 @@ public:
 
     void setTransform(const Transform &t);
     const Transform &getTransform()const;
+    // 平时是上一次 updateFrame 缓存下来的值，之后改过变换的话沿父链现算
     Transform getGlobalTransform() const;
+    TransformHierarchy::Handle transformHandle() const;
+    // 是否在 ancestor 的子树里（包括自己）。沿层级的根比较，不走 QObject 树
+    bool isUnder(const GameObject *ancestor) const;
+    static GameObject *fromTransformHandle(TransformHierarchy::Handle h);
     virtual void updatePosition(const Transform &t);
-    virtual void submitForRender();
+    virtual void submitForRender(const CameraInfo &camera);
 
     GameObject *parent() const;
     QList<GameObject*> children() const;
@@ -67,8 +75,9 @@ public:
 
 
 protected:
-    bool modified;
-    Transform transform;
+    // 局部/世界变换都放在 transformHierarchy 里，父子关系跟着 QObject 的父子关系走
+    TransformHierarchy::Handle m_transformHandle;
+    void childEvent(QChildEvent *event) override;
 
     template<typename ObjectType, typename SelfType, typename FuncType, typename ...Args> requires
         requires(FuncType &&func, ObjectType *rt, Args ...args){
@@ -102,21 +111,81 @@ protected:
 signals:
 };
 
-class MeshActor : public GameObject{
+// 网格常驻在渲染器里，只在自身或父对象的变换改变、或者 LOD 级别切换时更新那一段
+class MeshActor : public GameObject, public Component<MeshActor>{
     Q_OBJECT
 public:
-    uint meshID;
-    Mesh mesh;
-    bool isStatic;
+    enum Flag : uint8_t{
+        Static = 1,
+        Visible = 2,
+        Batched = 4,
+    };
+    // 场景扫描（BVH、射线检测、合批、PVS）要查的字段，在 components<MeshActor>() 里按 componentIndex 成列存放，
+    // 扫描时只读这几列，不用逐个去碰对象。由 MeshActor 自己维护
+    struct Columns{
+        std::vector<BoundingSphere> bounds;     // 世界坐标，就是 mesh.bounds
+        std::vector<uint> meshID;
+        std::vector<uint8_t> flags;             // Flag 的组合
+        std::vector<TransformHierarchy::Handle> transform;
+        template<typename F> void forEach(F &&f){ f(bounds); f(meshID); f(flags); f(transform); }
+    };
+    const uint meshID;
+    Mesh mesh;      // 世界坐标下的完整精度网格，射线检测和静态 BVH 用它，和当前 LOD 无关
+    const bool isStatic;
     explicit MeshActor(uint _meshID, bool isStatic = false, QObject *parent = nullptr);
+    ~MeshActor();
     void updatePosition(const Transform &t) override;
-    void submitForRender() override;
+    void submitForRender(const CameraInfo &camera) override;
     void setScale(float s);
+    void setVisible(bool visible);
+    bool isVisible() const;
+    // 场景 BVH 判断在视锥外时设置，和 setVisible 是分开的两个开关
+    void setCulled(bool culled);
+    bool isCulled() const;
+    // 作为遮挡体参与遮挡剔除。proxy 是局部坐标下的简化遮挡网格，要整个落在原网格内部，不给就用正在画的网格
+    void setOccluder(bool occluder, const Mesh *proxy = nullptr);
+    bool isOccluder() const;
+    // 被合进静态批次之后自己不再占用常驻对象，只保留 mesh 给射线检测用
+    void setBatched(bool batched);
+    bool isBatched() const;
+    int currentLOD() const;
 protected:
     float scale = 1.0f;
+    uint renderObject;
+    bool visible = true;
+    bool culled = false;
+    bool occluder = false;
+    bool batched = false;
+    bool hasOccluderProxy = false;
+    Mesh occluderProxy;
+    Transform globalTransform;
+    int lodLevel = 0;
+    void uploadLevel();
+    void uploadOccluder();
+    void setFlag(Flag flag, bool on);
+};
+
+// 同一个网格的很多份拷贝（箱子、油桶之类），每份只存相对本对象的变换，
+// 网格数据在渲染时按实例变换，不会每份复制一遍
+class InstancedMeshActor : public GameObject, public Component<InstancedMeshActor>{
+    Q_OBJECT
+public:
+    uint meshID;
+    explicit InstancedMeshActor(uint _meshID, QObject *parent = nullptr);
+    uint addInstance(const Transform &t, float scale = 1.0f, ushort materialID = 0xffff);
+    void setInstance(uint index, const Transform &t, float scale = 1.0f, ushort materialID = 0xffff);
+    void clearInstances();
+    uint instanceCount() const;
+    void updatePosition(const Transform &t) override;
+    void submitForRender(const CameraInfo &camera) override;
+protected:
+    std::vector<InstanceData> localInstances;
+    std::vector<InstanceData> worldInstances;
+    Transform globalTransform;
+    bool instancesDirty = true;
 };
 
-class Camera : public GameObject{
+class Camera : public GameObject, public Component<Camera>{
     Q_OBJECT
 public:
     CameraInfo camInfo;
@@ -125,7 +194,7 @@ public:
     Ray pixelToRay(int w, int h)const;
 };
 
-class ParallelLight: public GameObject{
+class ParallelLight: public GameObject, public Component<ParallelLight>{
     Q_OBJECT
 public:
     CameraInfo lightInfo;
@@ -7,6 +7,8 @@
 
 using namespace std;
 
+const float charaHeight = 500;
+
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
@@ -22,10 +24,15 @@ MainWindow::MainWindow(QWidget *parent)
     // assetManager.loadOBJ("D:\\project\\qt_c++\\pig3\\assets\\wuqie.obj");
     // GameObject *ttfa = assetManager.loadOBJ("..\\..\\assets\\dust2\\de_dust2.obj");
 
-    GameObject *ttfa = stage->loadObj("..\\..\\assets\\dust3\\part10.obj", true);
-    ttfa->forEach<MeshActor>([](MeshActor *curr){curr->setScale(0.5f);});
-
-    ttfa->setParent(stage->root);
+    // 改成 true 走流式加载：只有相机附近的格子常驻，启动时不用等整张地图读完
+    const bool streamMap = false;
+    const QString mapPath = "..\\..\\assets\\dust3\\part10.obj";
+    GameObject *ttfa = nullptr;
+    if(!streamMap){
+        ttfa = stage->loadObj(mapPath, true);
+        ttfa->forEach<MeshActor>([](MeshActor *curr){curr->setScale(0.5f);});
+        ttfa->setParent(stage->root);
+    }
 
 
 
@@ -59,21 +66,35 @@ MainWindow::MainWindow(QWidget *parent)
 
 
     Transform rot = Transform::rotateAroundAxis({1, 0, 0}, -1.57) * Transform::translate({0, 0, -400});
-    ttfa->setTransform(rot);
+    if(streamMap){
+        StreamingSettings settings;
+        settings.scale = 0.5f;
+        settings.transform = rot;
+        stage->openStreamingMap(mapPath, settings);
+    }else ttfa->setTransform(rot);
     // for(Mesh &m:assetManager.getMeshes()){
     //     // m.applyTransform(rot);
     //     m.shaderConfig |= ShaderConfig::DisableLightModel;
     // }
-    stage->buildStaticBVH();
+    if(!streamMap){
+        stage->buildStaticBVH();
+        stage->buildStaticBatches();
+        stage->buildPVS("..\\..\\assets\\dust3\\part10.pvs", 32, charaHeight);
+    }
     fpsLabel = new QLabel();
     fpsLabel->setFont(QFont("Times New Roman", 15));
     fpsLabel->setText("114514");
     ui->statusbar->insertWidget(0, fpsLabel);
 
-    memset(wasdFlags, 0, 4u);
+    for(auto &flag: wasdFlags) flag = false;
+    dragFlag = false;
     startPoint = {0,0};
     xacc = yacc = 0;
     jumpFlag = false;
+    // 渲染分辨率跟着帧时间走，尽量稳在 60 fps
+    stage->setDynamicResolution(true, 1000.0 / 60);
+    // 模拟按 60Hz 固定步长跑，渲染能多快就多快，互不拖累
+    stage->startSimulation(1.0 / 60, [this](double dt){simulate(dt);});
 }
 
 Vec3 getNormal(const Mesh &mesh, uint triangleID){
@@ -83,7 +104,6 @@ Vec3 getNormal(const Mesh &mesh, uint triangleID){
     return (v1-v0).cross(v2-v0).normalized();
 }
 const float movSpeed = 40;
-const float charaHeight = 500;
 const float liftThreshold = 162;
 
 BBox3D charaBox(const Vec3 &pos, bool extraY=false){
@@ -122,24 +142,29 @@ Vec3 posIterate(Stage3D *stage, Vec3 pos, Vec3 mov){
 bool falling;
 float ySpeed;
 
+// GUI 线程上的定时器现在只刷新状态栏，输入在事件里记下来，由模拟线程取走
 void MainWindow::updateFrame(){
+    fpsLabel->setText(QString::asprintf("%.1f fps (render %.0f us, total %.0f us, scale %.0f%%)", 1e6 / stage->avgFrameTime.load(), stage->avgRenderTime.load(), stage->avgFrameTime.load(), stage->renderScale.load() * 100));
+}
+
+// 在模拟线程上按固定步长调用。camInfo 要等交给渲染时才更新，这里直接读层级里的世界变换
+void MainWindow::simulate(double dt){
+    int dx = xacc.exchange(0), dy = yacc.exchange(0);
     if(dragFlag){
-        camera->rotateAroundAxis({0,1,0}, -0.01*xacc);
+        camera->rotateAroundAxis({0,1,0}, -0.01*dx);
         Transform temp = camera->getTransform();
-        camera->rotateAroundAxis(camera->getTransform().rotation.row(0), 0.01*yacc);
+        camera->rotateAroundAxis(camera->getTransform().rotation.row(0), 0.01*dy);
         if(camera->getGlobalTransform().rotation.row(1).y <= 0) camera->setTransform(temp);
-        xacc = yacc = 0;
     }
 
-    Vec3 vx = camera->camInfo.frame.axisX;
-    Vec3 vy = camera->camInfo.frame.axisY;
-    Vec3 vz = camera->camInfo.frame.axisZ;
+    Transform camWorld = camera->getGlobalTransform();
+    Vec3 vz = camWorld.rotation.row(2);
 
     Vec3 front = (vz - Vec3({0, 1, 0}) * Vec3({0, 1, 0}).dot(vz)).normalized();
     // Vec3 front = vz;
     Vec3 left = front.cross({0, 1, 0});
     Vec3 mov = {0, 0, 0};
-    Vec3 pos = camera->camInfo.pos;
+    Vec3 pos = camWorld.translation;
 
     if(wasdFlags[0]){
         // qDebug()<<front.to_string();
@@ -173,9 +198,8 @@ void MainWindow::updateFrame(){
         if(wallflag) mov *= 0.0f;
         pos += mov;
     }
-    if(jumpFlag && !falling){
+    if(!falling && jumpFlag.exchange(false)){
         falling = true;
-        jumpFlag = false;
         ySpeed = -55;
     }
 
@@ -210,9 +234,6 @@ void MainWindow::updateFrame(){
         camera->translate({0, ySpeed, 0});
     }
     }
-    fpsLabel->setText(QString::asprintf("%.1f fps (render %.0f us, total %.0f us)", 1e6 / stage->avgFrameTime, stage->avgRenderTime, stage->avgFrameTime));
-
-    stage->updateFrame();
     // auto hit = stage->raytest({{0, 0, 0}, {1, 0, 0}});
     // qDebug()<<hit.actor;
     return;
@@ -221,6 +242,7 @@ void MainWindow::updateFrame(){
 
 MainWindow::~MainWindow()
 {
+    stage->stopSimulation();
     delete ui;
 }
 
@@ -260,7 +282,8 @@ void MainWindow::keyReleaseEvent(QKeyEvent *evt){
 void MainWindow::mousePressEvent(QMouseEvent *evt){
     dragFlag = true;
     startPoint = evt->pos();
-    xacc = yacc = 0;
+    xacc = 0;
+    yacc = 0;
     // Ray ttfa = stage->pixelToRay(evt->pos().x(), evt->pos().y());
     // Raytest::intersectCallCnt = 0;
     // SceneRayHit hit = stage->raytest(ttfa);
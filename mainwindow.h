@@ -6,6 +6,7 @@
 #include <QImage>
 #include <QTimer>
 #include "stage3d.h"
+#include <atomic>
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -21,6 +22,7 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
     void updateFrame();
+    void simulate(double dt);
 
 protected:
     void keyPressEvent(QKeyEvent *evt) override;
@@ -38,12 +40,12 @@ private:
     Stage3D *stage;
     Camera *camera;
 
-    // 迫真 wasd 实现
+    // 迫真 wasd 实现。GUI 线程的事件里写，模拟线程读
     Transform camTrans;
-    bool wasdFlags[4];
-    bool dragFlag;
-    bool jumpFlag;
+    std::atomic<bool> wasdFlags[4];
+    std::atomic<bool> dragFlag;
+    std::atomic<bool> jumpFlag;
     QPoint startPoint;
-    int xacc, yacc;
+    std::atomic<int> xacc, yacc;
 };
 #endif // MAINWINDOW_H
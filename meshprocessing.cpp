@@ -0,0 +1,569 @@
+#include "meshprocessing.h"
+#include "utils.h"
+#include <algorithm>
+#include <array>
+#include <map>
+#include <queue>
+#include <unordered_map>
+#include <cstring>
+
+using namespace std;
+
+// 把 10 位整数的每一位之间插两个 0
+static uint expandBits(uint v){
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static uint mortonCode(const Vec3 &p, const Vec3 &lo, const Vec3 &extent){
+    auto quantize = [](float v, float l, float e){
+        if(e <= 0.0f) return 0u;
+        return uint(std::clamp((v - l) / e, 0.0f, 1.0f) * 1023.0f);
+    };
+    return (expandBits(quantize(p.x, lo.x, extent.x)) << 2)
+         | (expandBits(quantize(p.y, lo.y, extent.y)) << 1)
+         |  expandBits(quantize(p.z, lo.z, extent.z));
+}
+
+static Vec3 triangleNormal(const Mesh &mesh, const Triangle &t){
+    const Vec3 &v0 = mesh.vertices[t.vid[0]].pos;
+    const Vec3 &v1 = mesh.vertices[t.vid[1]].pos;
+    const Vec3 &v2 = mesh.vertices[t.vid[2]].pos;
+    // 和 getFragments 里 hardNormal 的方向一致
+    return (v2 - v0).cross(v1 - v0);
+}
+
+static void computeMeshletBounds(const Mesh &mesh, Meshlet &m){
+    Vec3 lo = {1e30f, 1e30f, 1e30f}, hi = {-1e30f, -1e30f, -1e30f};
+    Vec3 axis;
+    bool doubleSided = false;
+    for(uint i = m.triangleBegin; i < m.triangleBegin + m.triangleCount; i++){
+        const Triangle &t = mesh.triangles[i];
+        for(uint vid: t.vid){
+            const Vec3 &p = mesh.vertices[vid].pos;
+            lo = {min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+            hi = {max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+        }
+        axis += triangleNormal(mesh, t).normalized();
+        if(t.shaderConfig & ShaderConfig::DisableBackCulling) doubleSided = true;
+    }
+    m.bounds.center = (lo + hi) / 2;
+    m.bounds.radius = 0.0f;
+    for(uint i = m.triangleBegin; i < m.triangleBegin + m.triangleCount; i++)
+        for(uint vid: mesh.triangles[i].vid)
+            m.bounds.radius = max(m.bounds.radius, (mesh.vertices[vid].pos - m.bounds.center).len());
+
+    m.coneValid = false;
+    if(doubleSided || axis.len() < 1e-5f) return;
+    axis.normalize();
+    float minDot = 1.0f;
+    for(uint i = m.triangleBegin; i < m.triangleBegin + m.triangleCount; i++){
+        Vec3 n = triangleNormal(mesh, mesh.triangles[i]);
+        if(n.len() < 1e-12f) continue;  // 退化三角形不会被画出来
+        minDot = min(minDot, n.normalized().dot(axis));
+    }
+    // 锥角超过 90 度就没法整体剔除了
+    if(minDot <= 0.0f) return;
+    m.coneAxis = axis;
+    m.coneSin = sqrt(max(0.0f, 1.0f - minDot * minDot));
+    m.coneValid = true;
+}
+
+void buildMeshlets(Mesh &mesh, uint maxTriangles){
+    mesh.meshlets.clear();
+    if(mesh.triangles.empty()) return;
+
+    Vec3 lo = {1e30f, 1e30f, 1e30f}, hi = {-1e30f, -1e30f, -1e30f};
+    for(const Vertex &v: mesh.vertices){
+        lo = {min(lo.x, v.pos.x), min(lo.y, v.pos.y), min(lo.z, v.pos.z)};
+        hi = {max(hi.x, v.pos.x), max(hi.y, v.pos.y), max(hi.z, v.pos.z)};
+    }
+    Vec3 extent = hi - lo;
+
+    vector<pair<uint, uint>> order;
+    order.reserve(mesh.triangles.size());
+    for(auto [id, t]: enumerate(mesh.triangles)){
+        Vec3 centroid = (mesh.vertices[t.vid[0]].pos + mesh.vertices[t.vid[1]].pos + mesh.vertices[t.vid[2]].pos) / 3;
+        order.push_back({mortonCode(centroid, lo, extent), id});
+    }
+    stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b){return a.first < b.first;});
+
+    vector<Triangle> sorted;
+    sorted.reserve(mesh.triangles.size());
+    for(auto [_, id]: order) sorted.push_back(mesh.triangles[id]);
+    mesh.triangles = std::move(sorted);
+
+    for(uint begin = 0; begin < mesh.triangles.size(); begin += maxTriangles){
+        Meshlet m;
+        m.triangleBegin = begin;
+        m.triangleCount = min<uint>(maxTriangles, mesh.triangles.size() - begin);
+        optimizeTriangleOrder(mesh, m.triangleBegin, m.triangleBegin + m.triangleCount);
+        computeMeshletBounds(mesh, m);
+        mesh.meshlets.push_back(m);
+    }
+    optimizeVertexOrder(mesh);
+}
+
+struct VertexKey{
+    uint bits[6];
+    bool operator ==(const VertexKey &other) const{
+        return equal(bits, bits + 6, other.bits);
+    }
+};
+struct VertexKeyHash{
+    size_t operator ()(const VertexKey &key) const{
+        size_t h = 1469598103934665603ull;
+        for(uint b: key.bits) h = (h ^ b) * 1099511628211ull;
+        return h;
+    }
+};
+
+void cleanMesh(Mesh &mesh){
+    // 按位比较，-0 和 0 当作不同的值也没关系，只是少焊一些
+    unordered_map<VertexKey, uint, VertexKeyHash> unique;
+    unique.reserve(mesh.vertices.size());
+    vector<uint> remap(mesh.vertices.size());
+    vector<Vertex> welded;
+    welded.reserve(mesh.vertices.size());
+    for(auto [id, v]: enumerate(mesh.vertices)){
+        VertexKey key;
+        float values[6] = {v.pos.x, v.pos.y, v.pos.z, v.uv.x, v.uv.y, v.uv.z};
+        memcpy(key.bits, values, sizeof(values));
+        auto [it, inserted] = unique.try_emplace(key, (uint)welded.size());
+        if(inserted) welded.push_back(v);
+        remap[id] = it->second;
+    }
+    mesh.vertices = std::move(welded);
+
+    for(Triangle &t: mesh.triangles)
+        for(uint &vid: t.vid) vid = remap[vid];
+    erase_if(mesh.triangles, [&](const Triangle &t){
+        if(t.vid[0] == t.vid[1] || t.vid[1] == t.vid[2] || t.vid[0] == t.vid[2]) return true;
+        Vec3 e1 = mesh.vertices[t.vid[1]].pos - mesh.vertices[t.vid[0]].pos;
+        Vec3 e2 = mesh.vertices[t.vid[2]].pos - mesh.vertices[t.vid[0]].pos;
+        // 面积相对边长可以忽略就算退化，光栅化时也画不出像素
+        return e1.cross(e2).len() <= 1e-7f * (e1.dot(e1) + e2.dot(e2));
+    });
+    optimizeVertexOrder(mesh);
+}
+
+// Forsyth, "Linear-Speed Vertex Cache Optimisation"，参数用原文的
+static const int forsythCacheSize = 32;
+
+static float forsythVertexScore(int cachePos, int valence){
+    if(valence == 0) return -1.0f;
+    float score = 0.0f;
+    if(cachePos >= 0){
+        if(cachePos < 3) score = 0.75f;
+        else score = pow(1.0f - float(cachePos - 3) / (forsythCacheSize - 3), 1.5f);
+    }
+    return score + 2.0f / sqrt(float(valence));
+}
+
+void optimizeTriangleOrder(Mesh &mesh, uint begin, uint end){
+    uint tcnt = end - begin;
+    if(tcnt < 3) return;
+
+    // 区间里的顶点重新编号，meshlet 只有一百来个三角形，不值得开整个网格那么大的数组
+    unordered_map<uint, uint> local;
+    vector<array<uint, 3>> tris(tcnt);
+    for(uint i = 0; i < tcnt; i++)
+        for(int k = 0; k < 3; k++)
+            tris[i][k] = local.try_emplace(mesh.triangles[begin + i].vid[k], (uint)local.size()).first->second;
+    uint vcnt = local.size();
+
+    vector<int> valence(vcnt, 0), cachePos(vcnt, -1);
+    for(const auto &t: tris) for(uint v: t) valence[v]++;
+    vector<uint> adjacencyBegin(vcnt + 1, 0), adjacency(tcnt * 3);
+    for(uint v = 0; v < vcnt; v++) adjacencyBegin[v + 1] = adjacencyBegin[v] + valence[v];
+    {
+        vector<uint> fill = adjacencyBegin;
+        for(uint i = 0; i < tcnt; i++) for(uint v: tris[i]) adjacency[fill[v]++] = i;
+    }
+    vector<float> vertexScore(vcnt), triScore(tcnt);
+    vector<bool> emitted(tcnt, false);
+    for(uint v = 0; v < vcnt; v++) vertexScore[v] = forsythVertexScore(-1, valence[v]);
+    for(uint i = 0; i < tcnt; i++) triScore[i] = vertexScore[tris[i][0]] + vertexScore[tris[i][1]] + vertexScore[tris[i][2]];
+
+    vector<uint> cache, order;
+    order.reserve(tcnt);
+    int best = -1;
+    uint scanFrom = 0;
+    while(order.size() < tcnt){
+        if(best < 0){
+            // 缓存里的顶点都用完了，从头找一个分最高的
+            float bestScore = -1e30f;
+            while(scanFrom < tcnt && emitted[scanFrom]) scanFrom++;
+            for(uint i = scanFrom; i < tcnt; i++)
+                if(!emitted[i] && triScore[i] > bestScore){ bestScore = triScore[i]; best = i; }
+        }
+        emitted[best] = true;
+        order.push_back(best);
+
+        // 用到的三个顶点提到缓存最前面
+        vector<uint> next(tris[best].begin(), tris[best].end());
+        for(uint v: tris[best]) valence[v]--;
+        for(uint v: cache) if(find(next.begin(), next.end(), v) == next.end()) next.push_back(v);
+        for(uint i = forsythCacheSize; i < next.size(); i++) cachePos[next[i]] = -1;
+        if(next.size() > (size_t)forsythCacheSize) next.resize(forsythCacheSize);
+
+        vector<uint> touched = cache;
+        cache = std::move(next);
+        for(auto [i, v]: enumerate(cache)) cachePos[v] = i;
+        touched.insert(touched.end(), tris[best].begin(), tris[best].end());
+        for(uint v: touched) vertexScore[v] = forsythVertexScore(cachePos[v], valence[v]);
+
+        best = -1;
+        float bestScore = -1e30f;
+        for(uint v: cache)
+            for(uint j = adjacencyBegin[v]; j < adjacencyBegin[v + 1]; j++){
+                uint t = adjacency[j];
+                if(emitted[t]) continue;
+                triScore[t] = vertexScore[tris[t][0]] + vertexScore[tris[t][1]] + vertexScore[tris[t][2]];
+                if(triScore[t] > bestScore){ bestScore = triScore[t]; best = t; }
+            }
+    }
+
+    vector<Triangle> sorted;
+    sorted.reserve(tcnt);
+    for(uint id: order) sorted.push_back(mesh.triangles[begin + id]);
+    copy(sorted.begin(), sorted.end(), mesh.triangles.begin() + begin);
+}
+
+void optimizeVertexOrder(Mesh &mesh){
+    vector<uint> remap(mesh.vertices.size(), -1u);
+    vector<Vertex> ordered;
+    ordered.reserve(mesh.vertices.size());
+    for(Triangle &t: mesh.triangles)
+        for(uint &vid: t.vid){
+            if(remap[vid] == -1u){
+                remap[vid] = ordered.size();
+                ordered.push_back(mesh.vertices[vid]);
+            }
+            vid = remap[vid];
+        }
+    mesh.vertices = std::move(ordered);
+}
+
+// 平面二次型 Kp = pp^T 的上三角部分，用 double 累加避免大坐标下精度不够。
+// weight 是累加进来的权重之和，evaluate 除以它就是到这些平面距离平方的加权平均
+struct Quadric{
+    double a[10] = {};
+    double weight = 0.0;
+
+    void addPlane(const Vec3 &n, float d, float weight){
+        double nx = n.x, ny = n.y, nz = n.z, dd = d;
+        double p[4] = {nx, ny, nz, dd};
+        int k = 0;
+        for(int i = 0; i < 4; i++)
+            for(int j = i; j < 4; j++)
+                a[k++] += weight * p[i] * p[j];
+        this->weight += weight;
+    }
+    Quadric &operator +=(const Quadric &other){
+        for(int i = 0; i < 10; i++) a[i] += other.a[i];
+        weight += other.weight;
+        return *this;
+    }
+    double evaluate(const Vec3 &v) const{
+        double x = v.x, y = v.y, z = v.z;
+        return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+             + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+             + a[7]*z*z + 2*a[8]*z
+             + a[9];
+    }
+};
+
+struct Collapse{
+    double cost;
+    uint from, to;
+    uint fromStamp, toStamp;
+    bool operator <(const Collapse &other) const{
+        return cost > other.cost;   // priority_queue 是大根堆，反过来取最小代价
+    }
+};
+
+// 把 src 简化到大约 targetTriangles 个三角形，返回实际达到的最大几何误差
+static float simplifyMesh(const Mesh &src, uint targetTriangles, Mesh &dst){
+    uint vcnt = src.vertices.size();
+    vector<array<uint, 3>> tris;
+    tris.reserve(src.triangles.size());
+    for(const Triangle &t: src.triangles) tris.push_back({t.vid[0], t.vid[1], t.vid[2]});
+    vector<bool> triAlive(tris.size(), true);
+    uint aliveCount = tris.size();
+
+    vector<vector<uint>> adjacency(vcnt);
+    for(auto [id, t]: enumerate(tris))
+        for(uint vid: t) adjacency[vid].push_back(id);
+
+    // 同一位置有多个顶点就是 UV 接缝，只被一个三角形用到的边是开放边界，
+    // 周围三角形材质不一样的是材质边界，这三种顶点都锁住
+    vector<bool> locked(vcnt, false);
+    {
+        map<tuple<float, float, float>, uint> positionCount;
+        for(const Vertex &v: src.vertices) positionCount[{v.pos.x, v.pos.y, v.pos.z}]++;
+        for(uint i = 0; i < vcnt; i++){
+            const Vec3 &p = src.vertices[i].pos;
+            if(positionCount[{p.x, p.y, p.z}] > 1) locked[i] = true;
+        }
+        map<pair<uint, uint>, uint> edgeCount;
+        for(const auto &t: tris)
+            for(int k = 0; k < 3; k++){
+                uint a = t[k], b = t[(k + 1) % 3];
+                edgeCount[{min(a, b), max(a, b)}]++;
+            }
+        for(auto [edge, cnt]: edgeCount)
+            if(cnt == 1) locked[edge.first] = locked[edge.second] = true;
+        for(uint i = 0; i < vcnt; i++)
+            for(uint tid: adjacency[i])
+                if(src.triangles[tid].materialID != src.triangles[adjacency[i][0]].materialID
+                   || src.triangles[tid].shaderConfig != src.triangles[adjacency[i][0]].shaderConfig)
+                    locked[i] = true;
+    }
+
+    vector<Quadric> quadrics(vcnt);
+    for(const auto &t: tris){
+        const Vec3 &p0 = src.vertices[t[0]].pos, &p1 = src.vertices[t[1]].pos, &p2 = src.vertices[t[2]].pos;
+        Vec3 n = (p1 - p0).cross(p2 - p0);
+        float area = n.len();
+        if(area < 1e-12f) continue;
+        n /= area;
+        Quadric q;
+        q.addPlane(n, -n.dot(p0), area);
+        for(uint vid: t) quadrics[vid] += q;
+    }
+
+    vector<uint> stamp(vcnt, 0);
+    vector<bool> removed(vcnt, false);
+    priority_queue<Collapse> heap;
+    auto pushEdge = [&](uint from, uint to){
+        if(locked[from]) return;
+        Quadric q = quadrics[from];
+        q += quadrics[to];
+        heap.push({max(0.0, q.evaluate(src.vertices[to].pos)), from, to, stamp[from], stamp[to]});
+    };
+    for(const auto &t: tris)
+        for(int k = 0; k < 3; k++){
+            pushEdge(t[k], t[(k + 1) % 3]);
+            pushEdge(t[(k + 1) % 3], t[k]);
+        }
+
+    auto faceNormal = [&](const array<uint, 3> &t){
+        return (src.vertices[t[1]].pos - src.vertices[t[0]].pos).cross(src.vertices[t[2]].pos - src.vertices[t[0]].pos);
+    };
+
+    // 折叠的先后按面积加权的代价排，大面上的误差更显眼；报出去的误差要按权重归一成长度，和网格的尺度、面的疏密无关
+    double maxError = 0.0;
+    while(aliveCount > targetTriangles && !heap.empty()){
+        Collapse c = heap.top();
+        heap.pop();
+        if(removed[c.from] || removed[c.to]) continue;
+        if(c.fromStamp != stamp[c.from] || c.toStamp != stamp[c.to]) continue;
+
+        // 折叠后不能有三角形翻面或者退化
+        bool shared = false, valid = true;
+        for(uint tid: adjacency[c.from]){
+            if(!triAlive[tid]) continue;
+            array<uint, 3> t = tris[tid];
+            if(t[0] == c.to || t[1] == c.to || t[2] == c.to){
+                shared = true;
+                continue;
+            }
+            Vec3 before = faceNormal(t);
+            for(uint &vid: t) if(vid == c.from) vid = c.to;
+            Vec3 after = faceNormal(t);
+            if(after.len() < 1e-12f || before.dot(after) <= 0.0f){
+                valid = false;
+                break;
+            }
+        }
+        if(!shared || !valid) continue;
+
+        Quadric merged = quadrics[c.from];
+        merged += quadrics[c.to];
+        if(merged.weight > 0.0)
+            maxError = max(maxError, merged.evaluate(src.vertices[c.to].pos) / merged.weight);
+
+        for(uint tid: adjacency[c.from]){
+            if(!triAlive[tid]) continue;
+            array<uint, 3> &t = tris[tid];
+            if(t[0] == c.to || t[1] == c.to || t[2] == c.to){
+                triAlive[tid] = false;
+                aliveCount--;
+                continue;
+            }
+            for(uint &vid: t) if(vid == c.from) vid = c.to;
+            adjacency[c.to].push_back(tid);
+        }
+        adjacency[c.from].clear();
+        removed[c.from] = true;
+        quadrics[c.to] = merged;
+        stamp[c.to]++;
+
+        erase_if(adjacency[c.to], [&](uint tid){return !triAlive[tid];});
+        for(uint tid: adjacency[c.to])
+            for(uint vid: tris[tid]){
+                if(vid == c.to) continue;
+                pushEdge(vid, c.to);
+                pushEdge(c.to, vid);
+            }
+    }
+
+    dst.materialID = src.materialID;
+    dst.shaderConfig = src.shaderConfig;
+    dst.meshID = src.meshID;
+    dst.vertices.clear();
+    dst.triangles.clear();
+    vector<uint> remap(vcnt, -1u);
+    for(auto [id, t]: enumerate(tris)){
+        if(!triAlive[id]) continue;
+        Triangle tri = src.triangles[id];
+        for(int k = 0; k < 3; k++){
+            if(remap[t[k]] == -1u){
+                remap[t[k]] = dst.vertices.size();
+                dst.vertices.push_back(src.vertices[t[k]]);
+            }
+            tri.vid[k] = remap[t[k]];
+        }
+        // 加载时的 hardNormal 是 (v1-v0)x(v2-v0)
+        tri.hardNormal = faceNormal(t).normalized();
+        dst.triangles.push_back(tri);
+    }
+    // 归一化后的二次型是到原来各平面距离平方的平均（按面积加权），开方就是局部坐标下的长度
+    return sqrt(max(0.0, maxError));
+}
+
+void generateLODs(Mesh &mesh, uint maxLevels, float ratio, uint minTriangles){
+    mesh.lods.clear();
+    const Mesh *prev = &mesh;
+    float error = 0.0f;
+    for(uint level = 0; level < maxLevels; level++){
+        uint target = prev->triangles.size() * ratio;
+        if(target < minTriangles) break;
+        Mesh next;
+        float levelError = simplifyMesh(*prev, target, next);
+        // 锁住的顶点太多、几乎简化不动了就停
+        if(next.triangles.empty() || next.triangles.size() > prev->triangles.size() * 0.9f) break;
+        error += levelError;
+        next.lodError = error;
+        buildMeshlets(next);
+        next.computeBounds();
+        mesh.lods.push_back(std::move(next));
+        prev = &mesh.lods.back();
+    }
+}
+
+int selectLOD(const Mesh &mesh, float scale, const BoundingSphere &worldBounds, const CameraInfo &camera,
+              int current, float pixelError, float hysteresis){
+    int levels = mesh.lods.size();
+    if(levels == 0) return 0;
+    // 离相机最近的点的距离，保守地按最近处估计投影大小
+    float dist = max((worldBounds.center - camera.pos).len() - worldBounds.radius, camera.focalLength);
+    float pixelsPerUnit = camera.focalLength / dist * camera.pixelWidth() / camera.screenSize.x;
+    auto screenError = [&](int level){
+        return level == 0 ? 0.0f : mesh.lods[level - 1].lodError * std::abs(scale) * pixelsPerUnit;
+    };
+    int level = std::clamp(current, 0, levels);
+    while(level > 0 && screenError(level) > pixelError) level--;
+    while(level < levels && screenError(level + 1) < pixelError * hysteresis) level++;
+    return level;
+}
+
+// 把 src 里 [begin, end) 的三角形连同用到的顶点拷成一个独立的网格
+static Mesh extractTriangles(const Mesh &src, uint begin, uint end){
+    Mesh ret;
+    ret.materialID = src.materialID;
+    ret.shaderConfig = src.shaderConfig;
+    vector<uint> remap(src.vertices.size(), -1u);
+    for(uint i = begin; i < end; i++){
+        Triangle t = src.triangles[i];
+        for(uint &vid: t.vid){
+            if(remap[vid] == -1u){
+                remap[vid] = ret.vertices.size();
+                ret.vertices.push_back(src.vertices[vid]);
+            }
+            vid = remap[vid];
+        }
+        ret.triangles.push_back(t);
+    }
+    return ret;
+}
+
+vector<Mesh> buildStaticBatches(const vector<const Mesh*> &meshes, uint maxTriangles){
+    map<ushort, Mesh> merged;
+    for(const Mesh *mesh: meshes){
+        Mesh &dst = merged[mesh->materialID];
+        dst.materialID = mesh->materialID;
+        uint n = dst.vertices.size();
+        dst.vertices.insert(dst.vertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+        for(Triangle t: mesh->triangles){
+            t.materialID = mesh->materialID;
+            for(uint &vid: t.vid) vid += n;
+            dst.triangles.push_back(t);
+        }
+    }
+
+    vector<Mesh> ret;
+    for(auto &[materialID, mesh]: merged){
+        // 借 meshlet 的 Morton 排序让每一批在空间上紧凑，切开之后包围球才有剔除意义
+        buildMeshlets(mesh);
+        for(uint begin = 0; begin < mesh.triangles.size(); begin += maxTriangles){
+            uint end = min<uint>(mesh.triangles.size(), begin + maxTriangles);
+            Mesh batch = extractTriangles(mesh, begin, end);
+            buildMeshlets(batch);
+            batch.computeBounds();
+            ret.push_back(std::move(batch));
+        }
+    }
+    return ret;
+}
+
+static ushort quantize16(float v, float origin, float step){
+    if(step <= 0.0f) return 0;
+    return (ushort)std::clamp(lround((v - origin) / step), 0l, 65535l);
+}
+
+VertexQuantization quantizeVertices(const vector<Vertex> &vertices, CompactVertex *out){
+    VertexQuantization ret;
+    if(vertices.empty()) return ret;
+
+    Vec3 lo = vertices[0].pos, hi = lo;
+    float uvLo[2] = {vertices[0].uv.x, vertices[0].uv.y}, uvHi[2] = {uvLo[0], uvLo[1]};
+    for(const Vertex &v: vertices){
+        lo = {min(lo.x, v.pos.x), min(lo.y, v.pos.y), min(lo.z, v.pos.z)};
+        hi = {max(hi.x, v.pos.x), max(hi.y, v.pos.y), max(hi.z, v.pos.z)};
+        uvLo[0] = min(uvLo[0], v.uv.x), uvHi[0] = max(uvHi[0], v.uv.x);
+        uvLo[1] = min(uvLo[1], v.uv.y), uvHi[1] = max(uvHi[1], v.uv.y);
+    }
+    ret.posOrigin = lo;
+    ret.posStep = (hi - lo) / 65535.0f;
+    for(int k = 0; k < 2; k++){
+        ret.uvOrigin[k] = uvLo[k];
+        ret.uvStep[k] = (uvHi[k] - uvLo[k]) / 65535.0f;
+    }
+
+    for(auto [i, v]: enumerate(vertices)){
+        CompactVertex &c = out[i];
+        c.pos[0] = quantize16(v.pos.x, lo.x, ret.posStep.x);
+        c.pos[1] = quantize16(v.pos.y, lo.y, ret.posStep.y);
+        c.pos[2] = quantize16(v.pos.z, lo.z, ret.posStep.z);
+        c.uv[0] = quantize16(v.uv.x, uvLo[0], ret.uvStep[0]);
+        c.uv[1] = quantize16(v.uv.y, uvLo[1], ret.uvStep[1]);
+    }
+    return ret;
+}
+
+CompactMesh compressMesh(const Mesh &mesh){
+    CompactMesh ret;
+    ret.materialID = mesh.materialID;
+    if(mesh.vertices.empty()) return ret;
+    ret.vertices.resize(mesh.vertices.size());
+    static_cast<VertexQuantization&>(ret) = quantizeVertices(mesh.vertices, ret.vertices.data());
+    ret.triangles.reserve(mesh.triangles.size());
+    for(const Triangle &t: mesh.triangles)
+        ret.triangles.push_back({{t.vid[0], t.vid[1], t.vid[2]}, t.shaderConfig});
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef MESHPROCESSING_H
+#define MESHPROCESSING_H
+
+#include "structures.h"
+
+// 加载之后对网格做的一次性处理
+
+// 焊接位置和 UV 完全相同的顶点，去掉退化（重复顶点或零面积）的三角形和没人用的顶点
+void cleanMesh(Mesh &mesh);
+
+// Forsyth 的顶点缓存优化：重排 [begin, end) 里的三角形，让相邻三角形尽量复用刚用过的顶点
+void optimizeTriangleOrder(Mesh &mesh, uint begin, uint end);
+// 按三角形里第一次出现的顺序重排顶点，顺便丢掉没用到的
+void optimizeVertexOrder(Mesh &mesh);
+
+// 按三角形重心的 Morton 序重排 triangles，每 maxTriangles 个切成一个 meshlet，
+// 并算出每个 meshlet 的包围球和法线锥。之后每个 meshlet 内部再做一遍三角形和顶点的访存优化
+void buildMeshlets(Mesh &mesh, uint maxTriangles = 128);
+
+// 用二次误差度量做半边折叠，生成最多 maxLevels 级简化网格放进 mesh.lods，
+// 每级三角形数大约是上一级的 ratio 倍。UV 接缝、材质边界和开放边界上的顶点不动，
+// 所以贴图坐标不会被拉扯，网格边缘也不会裂开。每一级都会建好 meshlet 和包围球
+void generateLODs(Mesh &mesh, uint maxLevels = 4, float ratio = 0.5f, uint minTriangles = 64);
+
+// 按投影到屏幕上的误差挑 LOD 级别：选误差小于 pixelError 像素的最粗一级。
+// 变粗要求误差低于 pixelError * hysteresis，变细在超过 pixelError 时立刻发生，中间区间保持 current 不变，
+// 相机在阈值附近来回时不会反复跳级。scale 是网格的缩放，worldBounds 是世界坐标下的包围球
+int selectLOD(const Mesh &mesh, float scale, const BoundingSphere &worldBounds, const CameraInfo &camera,
+              int current, float pixelError = 1.0f, float hysteresis = 0.7f);
+
+// 静态合批：把已经变换到世界坐标的网格按材质合并，按 Morton 序切成不超过 maxTriangles 的若干批。
+// 每批的顶点按首次使用的顺序连续排列，meshlet 和包围球都算好，可以直接作为一个常驻对象
+std::vector<Mesh> buildStaticBatches(const std::vector<const Mesh*> &meshes, uint maxTriangles = 65536);
+
+// 编码成 CompactMesh
+CompactMesh compressMesh(const Mesh &mesh);
+// 按这组顶点自己的包围盒和 UV 范围量化，写到 out[0, vertices.size())，返回解码用的参数
+VertexQuantization quantizeVertices(const std::vector<Vertex> &vertices, CompactVertex *out);
+
+#endif // MESHPROCESSING_H
@@ -0,0 +1,186 @@
+#include "occlusion.h"
+#include "parallel_render.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+Vec3 OcclusionBuffer::toCamera(const Vec3 &p) const{
+    Vec3 ray = p - camera.pos;
+    return {ray.dot(camera.frame.axisX), ray.dot(camera.frame.axisY), ray.dot(camera.frame.axisZ)};
+}
+
+void OcclusionBuffer::begin(const CameraInfo &_camera){
+    camera = _camera;
+    width = camera.width * tileSize / cellSize;
+    height = camera.height * tileSize / cellSize;
+    depth.assign(width * height, 0.0f);
+    hasOccluders = false;
+}
+
+bool OcclusionBuffer::empty() const{
+    return !hasOccluders;
+}
+
+static bool samePoint(const Vec3 &a, const Vec3 &b){
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// 四个点按顺序组成的四边形在屏幕上是不是严格凸的
+static bool convexQuad(const Vec3 *v){
+    int positive = 0, negative = 0;
+    for(int k = 0; k < 4; k++){
+        const Vec3 &p0 = v[k], &p1 = v[(k + 1) % 4], &p2 = v[(k + 2) % 4];
+        float cross = (p1.x - p0.x) * (p2.y - p1.y) - (p1.y - p0.y) * (p2.x - p1.x);
+        if(cross > 1e-6f) positive++;
+        else if(cross < -1e-6f) negative++;
+    }
+    return positive == 4 || negative == 4;
+}
+
+void OcclusionBuffer::rasterize(const vector<Vec3> &triangles){
+    uint count = triangles.size() / 3;
+    if(count == 0) return;
+    projected.resize(count);
+    float scaleX = camera.focalLength / camera.screenSize.x * width;
+    float scaleY = camera.focalLength / camera.screenSize.y * height;
+    taskDispatcher.parallelFor(count, 1024, [&](int begin, int end){
+        for(int i = begin; i < end; i++){
+            Projected &curr = projected[i];
+            curr.valid = true;
+            curr.count = 3;
+            for(int k = 0; k < 3; k++){
+                Vec3 c = toCamera(triangles[i * 3 + k]);
+                if(c.z < camera.focalLength){
+                    curr.valid = false;
+                    break;
+                }
+                curr.v[k] = {c.x / c.z * scaleX + width / 2.0f, c.y / c.z * scaleY + height / 2.0f, 1024.0f / c.z};
+            }
+        }
+    });
+
+    // 只写整个被盖住的格子时，单个三角形沿着公共边的那一排格子谁都盖不满。
+    // 相邻两个三角形共一条边、拼起来是凸四边形（墙面、盒子的一个面）时合成一个多边形来测覆盖
+    for(uint i = 0; i + 1 < count; i++){
+        Projected &first = projected[i], &second = projected[i + 1];
+        if(!first.valid || !second.valid) continue;
+        const Vec3 *t0 = &triangles[i * 3], *t1 = &triangles[i * 3 + 3];
+        for(int e = 0; e < 3; e++){
+            // first 的边 e -> e+1 反过来出现在 second 里
+            int f = -1;
+            for(int k = 0; k < 3; k++)
+                if(samePoint(t1[k], t0[(e + 1) % 3]) && samePoint(t1[(k + 1) % 3], t0[e])) f = k;
+            if(f < 0) continue;
+            // 四边形 u x v w：first 是 (u, v, w)，second 是 (v, u, x)
+            Vec3 quad[4] = {first.v[e], second.v[(f + 2) % 3], first.v[(e + 1) % 3], first.v[(e + 2) % 3]};
+            if(!convexQuad(quad)) break;
+            for(int k = 0; k < 4; k++) first.v[k] = quad[k];
+            first.count = 4;
+            second.valid = false;
+            i++;
+            break;
+        }
+    }
+    hasOccluders = true;
+    // 每个任务只写自己那几行，不需要同步
+    taskDispatcher.parallelFor(height, 4, [&](int rowBegin, int rowEnd){
+        rasterizeRows(rowBegin, rowEnd);
+    });
+}
+
+void OcclusionBuffer::rasterizeRows(int rowBegin, int rowEnd){
+    for(const Projected &poly: projected){
+        if(!poly.valid) continue;
+        const Vec3 *v = poly.v;
+        int n = poly.count;
+
+        // zInv 在屏幕上是线性的：zInv = a*x + b*y + c。四边形的两个三角形各有一个平面，
+        // 格子里最远的一点取两个平面在四个角上的最小值，但不会比多边形最远的顶点还远
+        float planes[2][4];
+        int planeCount = 0;
+        for(int t = 0; t < n - 2; t++){
+            const Vec3 &v0 = v[0], &v1 = v[t + 1], &v2 = v[t + 2];
+            float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+            if(std::abs(area) < 1e-6f) continue;
+            float a = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+            float b = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+            float *plane = planes[planeCount++];
+            plane[0] = a;
+            plane[1] = b;
+            plane[2] = v0.z - a * v0.x - b * v0.y;
+            plane[3] = 0.5f * (std::abs(a) + std::abs(b));
+        }
+        // 凸四边形的另一半退化时它也退化成了三角形，没有面积的直接跳过
+        if(planeCount < n - 2) continue;
+
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        float sign = area > 0 ? 1.0f : -1.0f;
+        // 边方程在格子角上比中心最多小 inset，中心的值都不小于它才说明四个角都在多边形里
+        float inset[4];
+        float farthest = v[0].z;
+        float xlo = v[0].x, xhi = v[0].x, ylo = v[0].y, yhi = v[0].y;
+        for(int k = 0; k < n; k++){
+            const Vec3 &p0 = v[k], &p1 = v[(k + 1) % n];
+            inset[k] = 0.5f * (std::abs(p1.x - p0.x) + std::abs(p1.y - p0.y));
+            farthest = min(farthest, p0.z);
+            xlo = min(xlo, p0.x);
+            xhi = max(xhi, p0.x);
+            ylo = min(ylo, p0.y);
+            yhi = max(yhi, p0.y);
+        }
+
+        int ymin = max(rowBegin, int(floor(ylo)));
+        int ymax = min(rowEnd - 1, int(ceil(yhi)));
+        int xmin = max(0, int(floor(xlo)));
+        int xmax = min(width - 1, int(ceil(xhi)));
+        if(ymin > ymax || xmin > xmax) continue;
+
+        for(int y = ymin; y <= ymax; y++){
+            float py = y + 0.5f;
+            for(int x = xmin; x <= xmax; x++){
+                float px = x + 0.5f;
+                // 只写被多边形整个盖住的格子，部分覆盖的格子透过没盖住的地方还能看到后面的东西
+                bool covered = true;
+                for(int k = 0; k < n && covered; k++){
+                    const Vec3 &p0 = v[k], &p1 = v[(k + 1) % n];
+                    float w = ((p1.x - p0.x) * (py - p0.y) - (p1.y - p0.y) * (px - p0.x)) * sign;
+                    covered = w >= inset[k];
+                }
+                if(!covered) continue;
+                float z = planes[0][0] * px + planes[0][1] * py + planes[0][2] - planes[0][3];
+                if(planeCount > 1) z = min(z, planes[1][0] * px + planes[1][1] * py + planes[1][2] - planes[1][3]);
+                z = max(farthest, z);
+                float &d = depth[y * width + x];
+                d = max(d, z);
+            }
+        }
+    }
+}
+
+bool OcclusionBuffer::sphereOccluded(const Vec3 &center, float radius) const{
+    if(!hasOccluders) return false;
+    Vec3 c = toCamera(center);
+    float nearZ = c.z - radius;
+    if(nearZ < camera.focalLength) return false;
+    float nearest = 1024.0f / nearZ;
+
+    // 球在屏幕上的投影范围，分子取球的边、分母取最近和最远两种情况，保守地包住
+    float scaleX = camera.focalLength / camera.screenSize.x * width;
+    float scaleY = camera.focalLength / camera.screenSize.y * height;
+    float farZ = c.z + radius;
+    float x0 = min((c.x - radius) / nearZ, (c.x - radius) / farZ) * scaleX + width / 2.0f;
+    float x1 = max((c.x + radius) / nearZ, (c.x + radius) / farZ) * scaleX + width / 2.0f;
+    float y0 = min((c.y - radius) / nearZ, (c.y - radius) / farZ) * scaleY + height / 2.0f;
+    float y1 = max((c.y + radius) / nearZ, (c.y + radius) / farZ) * scaleY + height / 2.0f;
+
+    int xmin = max(0, int(floor(x0))), xmax = min(width - 1, int(ceil(x1)));
+    int ymin = max(0, int(floor(y0))), ymax = min(height - 1, int(ceil(y1)));
+    // 完全在屏幕外的交给视锥剔除
+    if(xmin > xmax || ymin > ymax) return false;
+
+    for(int y = ymin; y <= ymax; y++)
+        for(int x = xmin; x <= xmax; x++)
+            if(depth[y * width + x] <= nearest) return false;
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "structures.h"
+#include <vector>
+
+// 软件遮挡剔除用的低分辨率深度缓冲。
+// 每帧把少量大遮挡体（墙、楼之类）光栅化进去，再拿物体/meshlet 的包围球去测。
+// 每个格子存遮挡体在格子里最远处的 zInv（和 vertexProject 一样是 1024/z，越大越近），只有整个格子都被某个三角形盖住时才写，
+// 包围球最近的点都比所有覆盖到的格子远，才算被挡住
+class OcclusionBuffer{
+public:
+    static const int cellSize = 8;      // 一个格子对应 8x8 个屏幕像素
+
+    void begin(const CameraInfo &camera);
+    // 世界坐标的三角形，每 3 个点一个。跨过近平面的三角形直接跳过，只会让剔除变少。
+    // 按行带分给渲染线程池并行光栅化
+    void rasterize(const std::vector<Vec3> &triangles);
+    bool empty() const;
+    bool sphereOccluded(const Vec3 &center, float radius) const;
+
+private:
+    // 一个三角形，或者两个共边三角形拼成的凸四边形
+    struct Projected{
+        Vec3 v[4];      // (格子坐标 x, y, zInv)
+        int count;
+        bool valid;
+    };
+    CameraInfo camera;
+    int width = 0, height = 0;
+    bool hasOccluders = false;
+    std::vector<float> depth;
+    std::vector<Projected> projected;
+
+    Vec3 toCamera(const Vec3 &p) const;
+    void rasterizeRows(int rowBegin, int rowEnd);
+};
+
+#endif // OCCLUSION_H
@@ -7,17 +7,14 @@
 
 using namespace std;
 
-Tile tiles[tileBufferH][tileBufferW];
-RenderTaskDispatcher taskDispatcher(threadCount);
+RenderTaskDispatcher taskDispatcher(defaultThreadCount());
 
-using namespace ShaderInternal;
-
-int tileLevelIterate(const Fragment &frag, int tileXlt, int tileYlt){
+int tileLevelIterate(const Fragment &frag, int tileXlt, int tileYlt, int size){
     int flags[4][3], innerFlag = true;
     for(int i=0;i<2;i++){
         for(int j=0;j<2;j++){
             EdgeIterator it = frag.edgeIterator;
-            it.batchIterate(tileXlt + i*(tileSize-1), tileYlt + j*(tileSize-1));
+            it.batchIterate(tileXlt + i*(size-1), tileYlt + j*(size-1));
             for(int k=0;k<3;k++){
                 flags[i*2+j][k] = (it.e[k].val >= 0);
             }
@@ -41,148 +38,471 @@ int tileLevelIterate(const Fragment &frag, int tileXlt, int tileYlt){
 
 std::atomic<int> tmp1 = 0, tmp2=0, tmp3=0;
 
+static void sortByDepth(const RenderContext &ctx, std::vector<const Fragment*> &fragments){
+    const std::vector<float> &maxZInv = ctx.maxZInv;
+    sort(fragments.begin(), fragments.end(), [&](const Fragment *a, const Fragment *b){
+        return maxZInv[a->triangleID] > maxZInv[b->triangleID];
+    });
+}
+
+// 相邻像素的 uv 差分。只取本区域 [x0, x1] x [y0, y1] 内的邻居，别的子任务可能还在写
+static inline float pixelDerivative(const Tile &tile, int x, int y, int x0, int x1, int y0, int y1){
+    float u = tile.u_z[y][x];
+    float v = tile.v_z[y][x];
+    float ux = 0.0f, vx = 0.0f, uy = 0.0f, vy = 0.0f;
+    if(x+1 <= x1){
+        ux = tile.u_z[y][x+1] - u;
+        vx = tile.v_z[y][x+1] - v;
+    }else if(x > x0){
+        ux = tile.u_z[y][x-1] - u;
+        vx = tile.v_z[y][x-1] - v;
+    }
+    if(y+1 <= y1){
+        uy = tile.u_z[y+1][x] - u;
+        vy = tile.v_z[y+1][x] - v;
+    }else if(y > y0){
+        uy = tile.u_z[y-1][x] - u;
+        vy = tile.v_z[y-1][x] - v;
+    }
+    return sqrt(max(ux*ux+vx*vx, uy*uy+vy*vy));
+}
+
+static inline uint shadePixel(const RenderContext &ctx, const Tile &tile, int x, int y, float d){
+    uint triangleID = tile.triangleID[y][x];
+    uint shaderConfig = ctx.triangles[triangleID].shaderConfig;
+    if(shaderConfig & ShaderConfig::DisableMipmap) d = 0.0f;
+    if(shaderConfig & ShaderConfig::WireframeOnly)
+        return colorDetermination<WireframeShader>(ctx, tile.u_z[y][x], tile.v_z[y][x], triangleID, {1,0,0}, d);
+    return colorDetermination<BaseShader>(ctx, tile.u_z[y][x], tile.v_z[y][x], triangleID, {1,0,0}, d);
+}
+
+// 8x8 块的着色速率：画面边缘、纹理放大和距离三条里取最粗的
+static int blockShadingRate(const RenderContext &ctx, const Tile &tile, int bx0, int bx1, int by0, int by1){
+    const ShadingRatePolicy &policy = ctx.shadingRate;
+    float halfW = ctx.pixelW * 0.5f, halfH = ctx.pixelH * 0.5f;
+    float cx = (tile.tileX * tileSize + (bx0 + bx1 + 1) * 0.5f - halfW) / halfW;
+    float cy = (tile.tileY * tileSize + (by0 + by1 + 1) * 0.5f - halfH) / halfH;
+    float r = sqrt((cx*cx + cy*cy) * 0.5f);
+    int rate = r > policy.periphery4 ? 4 : r > policy.periphery2 ? 2 : 1;
+    if(rate == 4) return rate;
+
+    // zInv 是 1024/z
+    float farZInv = policy.farDistance > 0.0f ? 1024.0f / policy.farDistance : 0.0f;
+    float maxSpan = 0.0f;
+    bool covered = false, distant = farZInv > 0.0f;
+    for(int y=by0;y<=by1;y++){
+        for(int x=bx0;x<=bx1;x++){
+            uint triangleID = tile.triangleID[y][x];
+            if(triangleID >= 0x80000000u) continue;
+            covered = true;
+            // 线框按三角形编号上色，整个三角形一个颜色
+            if(!(ctx.triangles[triangleID].shaderConfig & ShaderConfig::WireframeOnly))
+                maxSpan = max(maxSpan, BaseShader::texelSpan(ctx, triangleID, tile.derivative[y][x]));
+            if(tile.zInv[y][x] >= farZInv) distant = false;
+        }
+    }
+    if(!covered) return 4;
+    if(maxSpan <= policy.texelSpan4) return 4;
+    if(maxSpan <= policy.texelSpan2 || distant) return 2;
+    return rate;
+}
+
+// 可变速率着色：每个 rate x rate 的格子只着色一次，优先取格子中间的像素，没有的话取第一个有三角形的像素。
+// 颜色给格子里同一个三角形的像素，别的三角形的像素单独着色，三角形的边不会被糊掉
+static void shadeVariableRate(const RenderContext &ctx, Tile &tile, int x0, int x1, int y0, int y1, WorkerCounters &stat){
+    for(int y=y0;y<=y1;y++)
+        for(int x=x0;x<=x1;x++)
+            if(tile.triangleID[y][x] < 0x80000000u)
+                tile.derivative[y][x] = pixelDerivative(tile, x, y, x0, x1, y0, y1);
+
+    for(int by0=y0;by0<=y1;by0+=8){
+        for(int bx0=x0;bx0<=x1;bx0+=8){
+            int bx1 = min(bx0 + 7, x1), by1 = min(by0 + 7, y1);
+            int rate = blockShadingRate(ctx, tile, bx0, bx1, by0, by1);
+            for(int cy0=by0;cy0<=by1;cy0+=rate){
+                for(int cx0=bx0;cx0<=bx1;cx0+=rate){
+                    int cx1 = min(cx0 + rate - 1, bx1), cy1 = min(cy0 + rate - 1, by1);
+                    int ax = min(cx0 + rate / 2, cx1), ay = min(cy0 + rate / 2, cy1);
+                    uint anchor = tile.triangleID[ay][ax];
+                    uint color = 0xff000000;
+                    if(anchor < 0x80000000u){
+                        color = shadePixel(ctx, tile, ax, ay, tile.derivative[ay][ax]);
+                        stat.pixelShaded ++;
+                    }
+                    for(int y=cy0;y<=cy1;y++){
+                        for(int x=cx0;x<=cx1;x++){
+                            uint triangleID = tile.triangleID[y][x];
+                            if(triangleID >= 0x80000000u){
+                                tile.color[y][x] = 0xff000000;
+                                continue;
+                            }
+                            if(anchor >= 0x80000000u){
+                                anchor = triangleID;
+                                color = shadePixel(ctx, tile, x, y, tile.derivative[y][x]);
+                                stat.pixelShaded ++;
+                            }else if(triangleID != anchor){
+                                tile.color[y][x] = shadePixel(ctx, tile, x, y, tile.derivative[y][x]);
+                                stat.pixelShaded ++;
+                                continue;
+                            }
+                            tile.color[y][x] = color;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
 void RenderTask::operator()(){
-    tile->zInvMin = 1e9f;
-    tile->cpCount = 0;
+    const RenderContext &ctx = scheduler->ctx();
+    if(ctx.cancelled()) return;
+    auto start = chrono::steady_clock::now();
+    WorkerCounters &stat = scheduler->counters[TaskDispatcher<PoolTask>::currentWorker()];
+    stat.tilesProcessed ++;
+
+    int tileXlt = tile->tileX * tileSize;
+    int tileYlt = tile->tileY * tileSize;
 
-    for(int y=0;y<tileSize;y++)
-        for(int x=0;x<tileSize;x++){
+    // 被拆开的 tile 里，每个子任务只碰自己那块区域，几个子任务可以同时写同一个 Tile
+    TileRegion region;
+    region.xmin = tileXlt + subX;
+    region.ymin = tileYlt + subY;
+    region.xmax = region.xmin + subSize - 1;
+    region.ymax = region.ymin + subSize - 1;
+    region.zInvMin = 1e9f;
+    region.cpCount = 0;
+
+    int x0 = subX, x1 = subX + subSize - 1;
+    int y0 = subY, y1 = subY + subSize - 1;
+
+    for(int y=y0;y<=y1;y++){
+        for(int x=x0;x<=x1;x++){
             tile->triangleID[y][x] = 0x80000000;
         }
-    memset(tile->zInv, 0, sizeof(tile->zInv));
-    memset(tile->vis, 0, sizeof(tile->vis));
-
+        memset(&tile->zInv[y][x0], 0, sizeof(float) * subSize);
+        memset(&tile->vis[y][x0], 0, sizeof(bool) * subSize);
+    }
 
-    sort(fragments.begin(), fragments.end(), [](const Fragment *a, const Fragment *b){
-        return maxZInv[a->triangleID] > maxZInv[b->triangleID];
-    });
+    // 拆开的 tile 在派发前已经排好序了
+    if(sharedBins == nullptr) sortByDepth(ctx, fragments);
+    const std::vector<const Fragment*> &bins = sharedBins ? *sharedBins : fragments;
 
-    for(const Fragment *ptr:fragments){
+    for(const Fragment *ptr:bins){
         int tileLevelResult = TileLevelResult::UNKNOWN;
 
-        if(ptr->xlt <= tile->tileX*tileSize
-            && ptr->ylt <= tile->tileY*tileSize
-            && ptr->xrb > (tile->tileX+1)*tileSize
-            && ptr->yrb > (tile->tileY+1)*tileSize)
-            tileLevelResult = tileLevelIterate(*ptr, tile->tileX*tileSize, tile->tileY*tileSize);
+        if(ptr->xlt <= region.xmin
+            && ptr->ylt <= region.ymin
+            && ptr->xrb > region.xmax + 1
+            && ptr->yrb > region.ymax + 1)
+            tileLevelResult = tileLevelIterate(*ptr, region.xmin, region.ymin, subSize);
 
-        uint shaderConfig = ShaderInternal::triangles[ptr->triangleID].shaderConfig;
+        uint shaderConfig = ctx.triangles[ptr->triangleID].shaderConfig;
 
         if(shaderConfig & ShaderConfig::WireframeOnly)
-            tileRasterization<WireframeShader>(*ptr, *tile, tileLevelResult);
+            tileRasterization<WireframeShader>(ctx, *ptr, *tile, region, tileLevelResult, stat);
         else
-            tileRasterization<BaseShader>(*ptr, *tile, tileLevelResult);
+            tileRasterization<BaseShader>(ctx, *ptr, *tile, region, tileLevelResult, stat);
 
     }
 
-    int tileXlt = tile->tileX * tileSize;
-    int tileYlt = tile->tileY * tileSize;
+    // 渲染分辨率不是 tile 的整数倍时，最后一列/行 tile 超出画面的部分不着色、不写回
+    x1 = min(x1, (int)ctx.pixelW - 1 - tileXlt);
+    y1 = min(y1, (int)ctx.pixelH - 1 - tileYlt);
 
-    for(int y=0;y<tileSize;y++){
-        for(int x=0;x<tileSize;x++){
+    for(int y=y0;y<=y1;y++){
+        for(int x=x0;x<=x1;x++){
             if(tile->triangleID[y][x] < 0x80000000u){
                 tile->u_z[y][x] /= tile->zInv[y][x];
                 tile->v_z[y][x] /= tile->zInv[y][x];
             }
         }
     }
-    for(int y=0;y<tileSize;y++){
-        int globalY = tileYlt+y;
-        int bufferBase = globalY * ShaderInternal::pixelW;
-        for(int x=0;x<tileSize;x++){
-            uint colorRef = 0xff000000;
-            if(tile->triangleID[y][x] < 0x80000000u){
+    if(ctx.shadingRate.enabled && x0 <= x1){
+        shadeVariableRate(ctx, *tile, x0, x1, y0, y1, stat);
+        for(int y=y0;y<=y1;y++)
+            ctx.resolveSpan(tileYlt + y, tileXlt + x0, tileXlt + x1, &tile->color[y][x0]);
+    }else{
+        for(int y=y0;y<=y1 && x0<=x1;y++){
+            uint *colors = &tile->color[y][x0];
+            for(int x=x0;x<=x1;x++){
+                uint colorRef = 0xff000000;
+                uint triangleID = tile->triangleID[y][x];
+                if(triangleID < 0x80000000u){
+                    uint shaderConfig = ctx.triangles[triangleID].shaderConfig;
+                    float d = shaderConfig & ShaderConfig::DisableMipmap ? 0.0f : pixelDerivative(*tile, x, y, x0, x1, y0, y1);
+                    colorRef = shadePixel(ctx, *tile, x, y, d);
+                    stat.pixelShaded ++;
+                }
 
-                float u = tile->u_z[y][x];
-                float v = tile->v_z[y][x];
+                // if((tileXlt+x)%64==0 || (tileYlt+y)%64==0) colorRef = 0xffff0000;
+                colors[x - x0] = colorRef;
+            }
+            // 一行先写进 tile 的颜色缓存再整体写回，输出表面比渲染分辨率大时在这里顺带放大
+            ctx.resolveSpan(tileYlt + y, tileXlt + x0, tileXlt + x1, colors);
+        }
+    }
+    tile->lastTime.fetch_add(chrono::duration<float, nano>(chrono::steady_clock::now() - start).count());
+}
 
-                uint shaderConfig = ShaderInternal::triangles[tile->triangleID[y][x]].shaderConfig;
+float TileCostModel::work(const RenderTask &task) const{
+    // 空 tile 也要清缓冲、写回颜色
+    return tileSize*tileSize*0.25f + task.coveredArea + fragmentWeight * task.fragments.size();
+}
 
-                float d = 0.0f;
-                if(!(shaderConfig & ShaderConfig::DisableMipmap)){
-                    float ux = 0.0f, vx = 0.0f, uy = 0.0f, vy = 0.0f;
-                    if(x+1 < tileSize){
-                        ux = tile->u_z[y][x+1] - u;
-                        vx = tile->v_z[y][x+1] - v;
-                    }else if(x > 0){
-                        ux = tile->u_z[y][x-1] - u;
-                        vx = tile->v_z[y][x-1] - v;
-                    }
-                    if(y+1 < tileSize){
-                        uy = tile->u_z[y+1][x] - u;
-                        vy = tile->v_z[y+1][x] - v;
-                    }else if(y > 0){
-                        uy = tile->u_z[y-1][x] - u;
-                        vy = tile->v_z[y-1][x] - v;
-                    }
-                    d = sqrt(max(ux*ux+vx*vx, uy*uy+vy*vy));
-                    // tile->derivative[y][x] = d;
+float TileCostModel::estimate(const RenderTask &task) const{
+    float w = work(task);
+    float predicted = nsPerWork * w;
+    const Tile *tile = task.tile;
+    if(tile->lastTime.load() <= 0.0f || tile->lastWork <= 0.0f) return predicted;
+    // 按工作量的变化缩放上一帧的实测值，跟模型预测混合
+    float measured = tile->lastTime * (w / tile->lastWork);
+    return historyWeight * measured + (1.0f - historyWeight) * predicted;
+}
 
-                }
+void TileCostModel::update(const std::vector<Tile*> &tiles){
+    double time = 0, work = 0;
+    for(const Tile *tile: tiles){
+        time += tile->lastTime;
+        work += tile->lastWork;
+    }
+    if(work <= 0.0 || time <= 0.0) return;
+    nsPerWork = 0.8f * nsPerWork + 0.2f * float(time / work);
+}
 
-                if(shaderConfig & ShaderConfig::WireframeOnly)
-                    colorRef = colorDetermination<WireframeShader>(u, v, tile->triangleID[y][x], {1,0,0}, d);
-                else
-                    colorRef = colorDetermination<BaseShader>(u, v, tile->triangleID[y][x], {1,0,0}, d);
+// (x, y) 在 2^order 边长的 Hilbert 曲线上的序号
+static uint hilbertIndex(uint x, uint y, int order){
+    uint d = 0;
+    for(uint s = 1u << (order-1); s > 0; s >>= 1){
+        uint rx = (x & s) > 0;
+        uint ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if(ry == 0){
+            if(rx == 1){
+                x = s-1 - x;
+                y = s-1 - y;
             }
-            int globalX = tileXlt+x;
-
-
-            // if(globalX%64==0 || globalY%64==0) colorRef = 0xffff0000;
-            ShaderInternal::buffer[bufferBase + globalX] = colorRef;
+            swap(x, y);
         }
     }
+    return d;
 }
 
-void RenderTaskDispatcher::init(){
-    tileH = camera.height;
-    tileW = camera.width;
+void TileScheduler::init(){
+    // 最后一列/行 tile 可能只有一部分在画面里；像素尺寸变了缓存的颜色就对不上了
+    int w = (context.pixelW + tileSize - 1) / tileSize;
+    int h = (context.pixelH + tileSize - 1) / tileSize;
+    if(pixelW != context.pixelW || pixelH != context.pixelH){
+        invalidateTiles();
+        size_t count = (size_t)w * h;
+        if(count > tileCapacity){
+            tiles.reset(new Tile[count]);
+            tileCapacity = count;
+        }
+    }
+    pixelW = context.pixelW;
+    pixelH = context.pixelH;
+    tileH = h;
+    tileW = w;
+    counters.assign(taskDispatcher.threadCount(), WorkerCounters());
+    taskBuffer.resize(tileH * tileW);
 
     for(int i=0;i<tileH;i++){
         for(int j=0;j<tileW;j++){
-            tiles[i][j].tileX = j;
-            tiles[i][j].tileY = i;
-            taskBuffer[i][j].tile = &tiles[i][j];
-            taskBuffer[i][j].fragments.clear();
+            Tile &tile = tiles[i * tileW + j];
+            RenderTask &task = taskBuffer[i * tileW + j];
+            tile.tileX = j;
+            tile.tileY = i;
+            task.scheduler = this;
+            task.tile = &tile;
+            task.fragments.clear();
+            task.coveredArea = 0;
+            task.signature = 0;
+            task.clean = false;
         }
     }
 }
 
-void RenderTaskDispatcher::submitFragment(const Fragment &frag, int tileX, int tileY){
-    RenderTask &task = taskBuffer[tileY][tileX];
+int TileScheduler::classifyTiles(){
+    int dirty = 0;
+    for(RenderTask &task: taskBuffer){
+        task.clean = incremental && task.tile->cached && task.tile->signature == task.signature;
+        if(!task.clean) dirty++;
+    }
+    return dirty;
+}
+
+void TileScheduler::invalidateTiles(){
+    for(size_t i=0;i<tileCapacity;i++)
+        tiles[i].cached = false;
+}
+
+// 干净的 tile 只把缓存的颜色写回输出表面
+static void resolveTile(const RenderContext &ctx, const Tile *tile){
+    int tileXlt = tile->tileX * tileSize;
+    int tileYlt = tile->tileY * tileSize;
+    int x1 = min(tileXlt + tileSize, (int)ctx.pixelW) - 1;
+    int y1 = min(tileYlt + tileSize, (int)ctx.pixelH) - 1;
+    for(int y=tileYlt;y<=y1;y++)
+        ctx.resolveSpan(y, tileXlt, x1, tile->color[y - tileYlt]);
+}
+
+void TileScheduler::collectStats(FrameStat &stat) const{
+    stat.pixelIterated = stat.pixelWritten = stat.pixelShaded = stat.depthRejected = stat.tilesProcessed = 0;
+    stat.steals = steals;
+    for(const WorkerCounters &c: counters){
+        stat.pixelIterated  += c.pixelIterated;
+        stat.pixelWritten   += c.pixelWritten;
+        stat.pixelShaded    += c.pixelShaded;
+        stat.depthRejected  += c.depthRejected;
+        stat.tilesProcessed += c.tilesProcessed;
+    }
+}
+
+void TileScheduler::submitFragment(const Fragment &frag, uint64_t signature, int tileX, int tileY){
+    RenderTask &task = taskBuffer[tileY * tileW + tileX];
     task.fragments.push_back(&frag);
+    task.signature = task.signature * 0x9e3779b97f4a7c15ull + signature;
+
+    int w = min(frag.xrb, tileX*tileSize + tileSize-1) - max(frag.xlt, tileX*tileSize) + 1;
+    int h = min(frag.yrb, tileY*tileSize + tileSize-1) - max(frag.ylt, tileY*tileSize) + 1;
+    task.coveredArea += max(0, w) * max(0, h);
 }
 
 
 
-void RenderTaskDispatcher::finish(){
+void TileScheduler::finish(){
 
-    static vector<RenderTask> dogTasks;
     dogTasks.clear();
 
     tmp1=0;
-    for(int y=0;y<tileH;y++){
-        for(int x=0;x<tileW;x++){
-            RenderTask &task = taskBuffer[y][x];
-            dogTasks.push_back(std::move(task));
-            // task.fragments.clear();
+    int order = 1;
+    while((1 << order) < max(tileW, tileH)) order++;
+
+    // 先按 Hilbert 序排，相邻的 tile 尽量落在同一个 worker 上、也尽量挨着执行
+    curve.clear();
+    for(int y=0;y<tileH;y++)
+        for(int x=0;x<tileW;x++)
+            curve.push_back({hilbertIndex(x, y, order), &taskBuffer[y * tileW + x]});
+    sort(curve.begin(), curve.end(), [](const auto &a, const auto &b){return a.first < b.first;});
+
+    int threadCount = taskDispatcher.threadCount();
+    float totalCost = 0.0f;
+    cleanTiles.clear();
+    for(auto &[_, task]: curve){
+        if(task->clean){
+            cleanTiles.push_back(task->tile);
+            continue;
+        }
+        // 画到一半被取消的话 color 就不完整了，画完再标回来
+        task->tile->signature = task->signature;
+        task->tile->cached = false;
+        task->cost = costModel.estimate(*task);
+        task->tile->lastWork = costModel.work(*task);
+        task->tile->lastTime = 0.0f;
+        task->sharedBins = nullptr;
+        task->subX = task->subY = 0;
+        task->subSize = tileSize;
+        totalCost += task->cost;
+    }
+
+    // 单个 tile 太重时拆成子块，每个子块是独立的任务，共用同一份 bin
+    float costThreshold = splitCostRatio * totalCost / threadCount;
+    sharedBins.resize(tileH * tileW);
+    for(auto &[_, task]: curve){
+        if(task->clean) continue;
+        bool overloaded = task->fragments.size() > size_t(splitBinThreshold)
+                          || (threadCount > 1 && task->cost > costThreshold);
+        if(!overloaded){
+            dogTasks.push_back(std::move(*task));
+            continue;
+        }
+        int subSize = task->cost > 4 * costThreshold ? tileSize / 4 : tileSize / 2;
+        int parts = (tileSize / subSize) * (tileSize / subSize);
+
+        std::vector<const Fragment*> &bins = sharedBins[task->tile->tileY * tileW + task->tile->tileX];
+        bins = std::move(task->fragments);
+        sortByDepth(context, bins);
+        for(int y = 0; y < tileSize; y += subSize){
+            for(int x = 0; x < tileSize; x += subSize){
+                RenderTask sub;
+                sub.scheduler = this;
+                sub.tile = task->tile;
+                sub.sharedBins = &bins;
+                sub.subX = x;
+                sub.subY = y;
+                sub.subSize = subSize;
+                sub.cost = task->cost / parts;
+                dogTasks.push_back(std::move(sub));
+            }
         }
     }
 
-    static vector<vector<RenderTask>> threadTasks(threadCount);
+    threadTasks.resize(threadCount);
     for(int i=0;i<threadCount;i++)
         threadTasks[i].clear();
 
-    // 排个序随便分一下
-    // sort(dogTasks.begin(), dogTasks.end(), [](const pair<int, RenderTask> &a, const pair<int, RenderTask> &b){return a.first > b.first;});
-
-    int ttfa = (dogTasks.size()-1) / threadCount+1;
-    for(auto [id, task]:enumerate(dogTasks)){
-        threadTasks[id%threadCount].push_back(std::move(task));
-        // loads[id%threadCount] += pair.first;
+    frameTiles.clear();
+    for(auto &[_, task]: curve)
+        if(!task->clean) frameTiles.push_back(task->tile);
+
+    if(schedule == TileSchedule::CostLPT){
+        // LPT：最重的先分。代价只按数量级比较，同一档内保持 Hilbert 序
+        stable_sort(dogTasks.begin(), dogTasks.end(), [](const RenderTask &a, const RenderTask &b){
+            return ilogb(max(a.cost, 1.0f)) > ilogb(max(b.cost, 1.0f));
+        });
+        vector<float> loads(threadCount, 0.0f);
+        for(RenderTask &task: dogTasks){
+            int target = min_element(loads.begin(), loads.end()) - loads.begin();
+            loads[target] += task.cost;
+            threadTasks[target].push_back([task = std::move(task)]() mutable {task();});
+        }
+    }else{
+        for(auto [id, task]:enumerate(dogTasks)){
+            threadTasks[id%threadCount].push_back([task = std::move(task)]() mutable {task();});
+        }
     }
 
-    disp.runBatch(std::move(threadTasks));
+    // 写回缓存颜色的开销很小，轮流塞给各个 worker
+    for(auto [id, tile]: enumerate(cleanTiles))
+        threadTasks[id%threadCount].push_back([&ctx = context, t = tile]{ resolveTile(ctx, t); });
+
+    steals = taskDispatcher.runBatch(std::move(threadTasks));
+    if(!context.cancelled())
+        for(Tile *tile: frameTiles) tile->cached = true;
+    costModel.update(frameTiles);
     tmp1=tmp2=tmp3=0;
 }
 
+uint RenderTaskDispatcher::runBatch(std::vector<std::vector<PoolTask>> &&buckets){
+    lock_guard<mutex> lock(batchMutex);
+    disp.runBatch(std::move(buckets));
+    uint steals = 0;
+    for(int i = 0; i < disp.size(); i++) steals += disp.stealCount(i);
+    return steals;
+}
+
+void RenderTaskDispatcher::resize(int n){
+    lock_guard<mutex> lock(batchMutex);
+    disp.resize(n);
+}
+
+void RenderTaskDispatcher::setPinned(bool pinned){
+    lock_guard<mutex> lock(batchMutex);
+    disp.setPinned(pinned);
+}
+
+void RenderTaskDispatcher::parallelFor(int count, int grain, const std::function<void(int, int)> &body){
+    if(count <= 0) return;
+    int threadCount = disp.size();
+    if(count <= grain || threadCount == 1){
+        body(0, count);
+        return;
+    }
+    vector<vector<PoolTask>> buckets(threadCount);
+    for(int begin = 0, id = 0; begin < count; begin += grain, id++){
+        int end = min(count, begin + grain);
+        buckets[id % threadCount].push_back([&body, begin, end]{body(begin, end);});
+    }
+    runBatch(std::move(buckets));
+}
@@ -4,9 +4,11 @@
 #include <QObject>
 #include "structures.h"
 #include "utils.h"
+#include <functional>
+#include <mutex>
 
-const int threadCount = 4;
-const uint tileBufferH = 20, tileBufferW = 30;
+struct RenderContext;
+class TileScheduler;
 
 struct Tile{
     int tileX, tileY;
@@ -14,10 +16,33 @@ struct Tile{
     uint triangleID[tileSize][tileSize];
     uint color[tileSize][tileSize];
     float zInv[tileSize][tileSize], u_z[tileSize][tileSize], v_z[tileSize][tileSize];
-    float zInvMin;
     float derivative[tileSize][tileSize];
     bool vis[tileSize][tileSize];
+
+    // 上一帧这个 tile 的实测耗时（纳秒，被拆开时是各子块之和）和当时的工作量，给调度器的代价模型用
+    std::atomic<float> lastTime = 0.0f;
+    float lastWork = 0.0f;
+
+    // 增量渲染：color 里是签名为 signature 的那组 fragment 画出来的结果，cached 为 false 时不能用
+    uint64_t signature = 0;
+    bool cached = false;
+};
+
+// 一个渲染任务负责的像素区域（全局像素坐标，闭区间）和它自己的深度剔除状态
+struct TileRegion{
+    int xmin, ymin, xmax, ymax;
+    float zInvMin;
     int cpCount;
+    int area() const{ return (xmax-xmin+1) * (ymax-ymin+1); }
+};
+
+// 每个 worker 一块，按 cache line 对齐，热路径上只做普通的自增
+struct alignas(64) WorkerCounters{
+    uint pixelIterated = 0;
+    uint pixelWritten = 0;
+    uint pixelShaded = 0;
+    uint depthRejected = 0;
+    uint tilesProcessed = 0;
 };
 
 struct TiledFragment{
@@ -26,33 +51,139 @@ struct TiledFragment{
 };
 
 struct RenderTask{
+    TileScheduler *scheduler;
     Tile *tile;
     std::vector<const Fragment*> fragments;
+    int coveredArea = 0;    // 所有 fragment 的包围盒在 tile 内的面积之和
+    float cost = 0.0f;      // 调度器估出来的代价
+    uint64_t signature = 0; // 按提交顺序混合的 fragment 签名
+    bool clean = false;     // 和 tile 缓存的签名一致，不用重新光栅化
+
+    // 被拆开的 tile：子任务只处理 tile 内 (subX, subY) 起的 subSize 见方，fragment 读 sharedBins
+    const std::vector<const Fragment*> *sharedBins = nullptr;
+    int subX = 0, subY = 0, subSize = tileSize;
 
     RenderTask() = default;
     RenderTask(const RenderTask&) = default;
     RenderTask(RenderTask &&other) noexcept{
         if(&other == this)return;
+        scheduler = other.scheduler;
         tile = other.tile;
+        coveredArea = other.coveredArea;
+        cost = other.cost;
+        signature = other.signature;
+        clean = other.clean;
+        sharedBins = other.sharedBins;
+        subX = other.subX;
+        subY = other.subY;
+        subSize = other.subSize;
         swap(fragments, other.fragments);
     }
     RenderTask &operator=(const RenderTask&) = default;
+    // LPT 排序时任务在数组里挪来挪去，fragments 要交换而不是拷贝
+    RenderTask &operator=(RenderTask &&other) noexcept{
+        if(&other == this)return *this;
+        scheduler = other.scheduler;
+        tile = other.tile;
+        coveredArea = other.coveredArea;
+        cost = other.cost;
+        signature = other.signature;
+        clean = other.clean;
+        sharedBins = other.sharedBins;
+        subX = other.subX;
+        subY = other.subY;
+        subSize = other.subSize;
+        swap(fragments, other.fragments);
+        return *this;
+    }
     void operator()();
 };
 
+// 估计每个 tile 的耗时：fragment 数和覆盖面积折算成工作量，再和上一帧的实测耗时混合；
+// 每帧结束后用实测数据回调单位工作量的耗时
+class TileCostModel{
+public:
+    float fragmentWeight = 256.0f;  // 一个 fragment 的 setup/排序 开销折合多少像素
+    float historyWeight = 0.5f;     // 上一帧实测耗时在估计里的比重
+    float nsPerWork = 1.0f;
+
+    float work(const RenderTask &task) const;
+    float estimate(const RenderTask &task) const;
+    void update(const std::vector<Tile*> &tiles);
+};
+
+enum class TileSchedule{
+    RoundRobin,
+    CostLPT     // 按估计代价从大到小，每个 tile 分给当前负载最小的 worker
+};
+
+// 线程池里的任务是类型擦除的，tile 渲染和别的并行阶段（meshlet 剔除等）共用同一组 worker
+using PoolTask = std::function<void()>;
+
+// 所有 Renderer 实例共用的线程池。几个实例同时提交任务时，runBatch 一批一批排队执行
 class RenderTaskDispatcher{
 public:
-    int tileH, tileW;
-    RenderTask taskBuffer[tileBufferH][tileBufferW];
-    uint *globalColorBuffer;
-    TaskDispatcher<RenderTask> disp;
+    TaskDispatcher<PoolTask> disp;
 
     RenderTaskDispatcher(int _threadCount):disp(_threadCount){}
-    void init();
-    void submitFragment(const Fragment &frag, int tileX, int tileY);
-    void finish();
+    int threadCount() const{ return disp.size(); }
+
+    // 阻塞到这一批全部完成，返回这一批里 worker 之间偷到的任务数
+    uint runBatch(std::vector<std::vector<PoolTask>> &&buckets);
+    // 把 [0, count) 切成 grain 大小的块分给所有 worker，阻塞到全部完成
+    void parallelFor(int count, int grain, const std::function<void(int begin, int end)> &body);
+    // 只能在所有 Renderer 都不在画的时候调用
+    void resize(int n);
+    void setPinned(bool pinned);
+
+private:
+    std::mutex batchMutex;
 };
 
 extern RenderTaskDispatcher taskDispatcher;
 
-#endif // PARALLEL_RENDER_H
+// 一个 Renderer 的 tile 状态：fragment 分桶、代价模型和上一帧的颜色缓存。任务交给共用的线程池执行
+class TileScheduler{
+public:
+    TileSchedule schedule = TileSchedule::CostLPT;
+    TileCostModel costModel;
+
+    // bin 数或估计代价超过阈值的 tile 会被拆成 32x32 / 16x16 的子任务
+    int splitBinThreshold = 1024;
+    float splitCostRatio = 0.5f;    // 相对每个 worker 平均负载的比例
+    std::vector<std::vector<const Fragment*>> sharedBins;
+
+    int tileH = 0, tileW = 0;
+    std::vector<WorkerCounters> counters;
+    bool incremental = false;
+
+    explicit TileScheduler(RenderContext &_context):context(_context){}
+    RenderContext &ctx() const{ return context; }
+
+    void init();
+    void submitFragment(const Fragment &frag, uint64_t signature, int tileX, int tileY);
+    // 标出签名和缓存都对得上的 tile，返回需要重新光栅化的个数。不开增量渲染时全部都要画
+    int classifyTiles();
+    // 所有 tile 的颜色缓存作废
+    void invalidateTiles();
+    void finish();
+    void collectStats(FrameStat &stat) const;
+
+private:
+    RenderContext &context;
+    // tile 数组只增不减，换分辨率时按新的宽度重新排布，缓存一起作废。pixelW/pixelH 是缓存对应的渲染分辨率
+    std::unique_ptr<Tile[]> tiles;
+    size_t tileCapacity = 0;
+    uint pixelW = 0, pixelH = 0;
+    std::vector<RenderTask> taskBuffer;
+    uint steals = 0;
+
+    // finish 里每帧重复用的临时数组
+    std::vector<RenderTask> dogTasks;
+    std::vector<std::pair<uint, RenderTask*>> curve;
+    std::vector<const Tile*> cleanTiles;
+    std::vector<std::vector<PoolTask>> threadTasks;
+    std::vector<Tile*> frameTiles;
+};
+
+#endif // PARALLEL_RENDER_H
\ No newline at end of file
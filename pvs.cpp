@@ -0,0 +1,240 @@
+#include "pvs.h"
+#include "parallel_render.h"
+#include "utils.h"
+#include <QFile>
+#include <QDebug>
+#include <atomic>
+#include <algorithm>
+#include <tuple>
+using namespace std;
+
+static const uint32_t pvsMagic = 0x31535650;     // "PVS1"
+static const uint32_t pvsVersion = 3;
+
+struct PVSFileHeader{
+    uint32_t magic, version;
+    int32_t dims[3];
+    float origin[3], cellSize;
+    uint32_t targetCount;
+    uint64_t targetHash;
+};
+
+static uint hashStep(uint h){
+    h ^= h >> 16; h *= 0x7feb352du; h ^= h >> 15; h *= 0x846ca68bu; h ^= h >> 16;
+    return h;
+}
+
+// 目标表面上的采样点：顶点（太多时均匀挑 maxVertices 个），加上按面积分层撒在三角形里的点，
+// 大约每 spacing x spacing 的面积一个，最多 maxFaceSamples 个。点的位置是确定的，同一个场景每次都一样
+static vector<Vec3> sampleTarget(const PVSTarget &target, float spacing){
+    const uint maxVertices = 16, maxFaceSamples = 48;
+    const vector<Vec3> &tris = target.triangles;
+    vector<Vec3> ret;
+    if(tris.empty()){
+        ret.push_back(target.bounds.center);
+        return ret;
+    }
+
+    vector<Vec3> vertices = tris;
+    sort(vertices.begin(), vertices.end(), [](const Vec3 &a, const Vec3 &b){
+        return tie(a.x, a.y, a.z) < tie(b.x, b.y, b.z);
+    });
+    vertices.erase(unique(vertices.begin(), vertices.end(), [](const Vec3 &a, const Vec3 &b){
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }), vertices.end());
+    float step = max(1.0f, (float)vertices.size() / maxVertices);
+    for(float i = 0; i < vertices.size(); i += step) ret.push_back(vertices[(size_t)i]);
+
+    uint triCount = tris.size() / 3;
+    double totalArea = 0.0;
+    for(uint i = 0; i < triCount; i++)
+        totalArea += (tris[i*3+1] - tris[i*3]).cross(tris[i*3+2] - tris[i*3]).len() / 2;
+    uint faceSamples = clamp<double>(ceil(totalArea / (spacing * spacing)), 1.0, maxFaceSamples);
+    // 第 k 个点落在累计面积 (k + 0.5) / faceSamples 处的三角形里，三角形内的位置用哈希取
+    double area = 0.0, interval = totalArea / faceSamples;
+    uint k = 0;
+    for(uint i = 0; i < triCount && k < faceSamples; i++){
+        const Vec3 &p0 = tris[i*3], &p1 = tris[i*3+1], &p2 = tris[i*3+2];
+        area += (p1 - p0).cross(p2 - p0).len() / 2;
+        for(; k < faceSamples && (k + 0.5) * interval <= area; k++){
+            uint h = hashStep(i * 9781u + k * 6271u);
+            float r0 = sqrt((h & 0xffff) / 65536.0f), r1 = (h >> 16) / 65536.0f;
+            ret.push_back(p0 * (1 - r0) + p1 * (r0 * (1 - r1)) + p2 * (r0 * r1));
+        }
+    }
+    return ret;
+}
+
+void PotentiallyVisibleSet::setLayout(const BBox3D &volume, int resolution, const vector<PVSTarget> &targets, int cellSamples,
+                                      float eyeHeight){
+    // 边上留一点余量，贴着包围盒的相机也算在里面
+    float extent = max({volume.x2 - volume.x1, volume.y2 - volume.y1, volume.z2 - volume.z1});
+    cellSize = max(extent, 1e-3f) / max(resolution, 1);
+    origin = {volume.x1 - cellSize / 2, volume.y1 - cellSize / 2, volume.z1 - cellSize / 2};
+    float size[3] = {volume.x2 - volume.x1, volume.y2 - volume.y1, volume.z2 - volume.z1};
+    for(int i = 0; i < 3; i++)
+        dims[i] = max(1, (int)ceil(size[i] / cellSize) + 1);
+    targetCount = targets.size();
+    wordsPerCell = (targetCount + 63) / 64;
+    targetSamples.clear();
+    for(const PVSTarget &t: targets) targetSamples.push_back(sampleTarget(t, cellSize / 2));
+    // FNV-1a，场景或者采样方式改过之后旧文件就对不上了
+    targetHash = 0xcbf29ce484222325ull;
+    auto hashBytes = [&](const void *data, size_t size){
+        const uint8_t *bytes = (const uint8_t*)data;
+        for(size_t i = 0; i < size; i++)
+            targetHash = (targetHash ^ bytes[i]) * 0x100000001b3ull;
+    };
+    hashBytes(&cellSamples, sizeof(cellSamples));
+    hashBytes(&eyeHeight, sizeof(eyeHeight));
+    for(auto [i, t]: enumerate(targets)){
+        float v[4] = {t.bounds.center.x, t.bounds.center.y, t.bounds.center.z, t.bounds.radius};
+        hashBytes(v, sizeof(v));
+        for(const Vec3 &p: targetSamples[i]){
+            float q[3] = {p.x, p.y, p.z};
+            hashBytes(q, sizeof(q));
+        }
+    }
+}
+
+void PotentiallyVisibleSet::clear(){
+    bits.clear();
+    targetSamples.clear();
+    targetCount = wordsPerCell = 0;
+}
+
+int PotentiallyVisibleSet::cellIndex(const Vec3 &pos) const{
+    if(bits.empty()) return -1;
+    Vec3 d = (pos - origin) / cellSize;
+    int x = floor(d.x), y = floor(d.y), z = floor(d.z);
+    if(x < 0 || y < 0 || z < 0 || x >= dims[0] || y >= dims[1] || z >= dims[2]) return -1;
+    return (z * dims[1] + y) * dims[0] + x;
+}
+
+// 格子里固定的伪随机采样列（只取 x 和 z），第一列在中心
+static Vec3 cellColumn(const Vec3 &lo, float size, uint cell, int i){
+    if(i == 0) return lo + Vec3{size / 2, 0, size / 2};
+    uint h = cell * 9781u + i * 6271u;
+    float r[2];
+    for(float &v: r){
+        h = hashStep(h);
+        v = (h & 0xffff) / 65536.0f;
+    }
+    return lo + Vec3{r[0], 0, r[1]} * size;
+}
+
+// 从 from 到 to 中间有没有东西挡着。打到的面和 to 齐平也算没挡
+static bool segmentClear(const RaytestManager &raytest, const Vec3 &from, const Vec3 &to, float tolerance){
+    Vec3 dir = to - from;
+    float dist = dir.len();
+    if(dist < 1e-4f) return true;
+    auto hit = raytest.sceneIntersect({from, dir});
+    return !hit.hit || hit.dis + dist * 1e-3f + tolerance >= dist;
+}
+
+// 格子里相机真正可能待的位置。+y 朝下：每一列从格子顶上往下打到地面，站在地面上 eyeHeight 高的眼睛
+// 还落在这个格子里才要。格子的角（往里缩一点）和某个眼睛位置之间没挡着，说明在同一片空地里，也拿来采样。
+// 墙里、地板下面的点射线全被挡住，留着只会把看得到的目标烘成看不到
+static vector<Vec3> cellViewpoints(const RaytestManager &raytest, const Vec3 &lo, float size, uint cell,
+                                   int columns, float eyeHeight){
+    vector<Vec3> ret;
+    for(int i = 0; i < columns; i++){
+        Vec3 top = cellColumn(lo, size, cell, i);
+        auto hit = raytest.sceneIntersect({top, {0, 1, 0}});
+        // 太陡的面站不住，不算地面
+        if(!hit.hit || hit.dis < eyeHeight || hit.dis >= size + eyeHeight || abs(hit.leaf.plane.normal.y) < 0.7f)
+            continue;
+        ret.push_back(hit.pos - Vec3{0, eyeHeight, 0});
+    }
+    uint eyes = ret.size();
+    for(int c = 0; c < 8 && eyes; c++){
+        Vec3 corner = lo + Vec3{c & 1 ? 0.99f : 0.01f, c & 2 ? 0.99f : 0.01f, c & 4 ? 0.99f : 0.01f} * size;
+        for(uint i = 0; i < eyes; i++){
+            if(segmentClear(raytest, ret[i], corner, 0.0f)){
+                ret.push_back(corner);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+void PotentiallyVisibleSet::bake(const RaytestManager &raytest, const BBox3D &volume, int resolution,
+                                 const vector<PVSTarget> &targets, int cellSamples, float eyeHeight){
+    setLayout(volume, resolution, targets, cellSamples, eyeHeight);
+    if(eyeHeight <= 0.0f) eyeHeight = cellSize / 2;
+    int cellCount = dims[0] * dims[1] * dims[2];
+    bits.assign((size_t)cellCount * wordsPerCell, 0);
+    auto t0 = chrono::system_clock::now();
+    atomic<long long> rayCount = 0;
+    atomic<int> openCells = 0;
+
+    taskDispatcher.parallelFor(cellCount, 1, [&](int begin, int end){
+        long long rays = 0;
+        int open = 0;
+        for(int cell = begin; cell < end; cell++){
+            int x = cell % dims[0], y = cell / dims[0] % dims[1], z = cell / dims[0] / dims[1];
+            Vec3 lo = origin + Vec3{(float)x, (float)y, (float)z} * cellSize;
+            Vec3 center = lo + Vec3{cellSize, cellSize, cellSize} / 2;
+            vector<Vec3> points = cellViewpoints(raytest, lo, cellSize, cell, cellSamples, eyeHeight);
+            uint64_t *row = bits.data() + (size_t)cell * wordsPerCell;
+            // 找不到能站人的地方就没法判断，全部算可见
+            if(points.empty()){
+                for(uint t = 0; t < targets.size(); t++) row[t / 64] |= 1ull << (t % 64);
+                continue;
+            }
+            open++;
+            for(uint t = 0; t < targets.size(); t++){
+                const PVSTarget &target = targets[t];
+                // 离格子很近的目标采样不可靠，直接算可见
+                bool found = (target.bounds.center - center).len() < target.bounds.radius + cellSize * 1.5f;
+                for(uint i = 0; i < points.size() && !found; i++){
+                    for(const Vec3 &q: targetSamples[t]){
+                        rays++;
+                        // 打到的就是目标自己（或者和它齐平的面）也算看得到
+                        if(segmentClear(raytest, points[i], q, cellSize * 1e-2f)){ found = true; break; }
+                    }
+                }
+                if(found) row[t / 64] |= 1ull << (t % 64);
+            }
+        }
+        rayCount += rays;
+        openCells += open;
+    });
+
+    auto t1 = chrono::system_clock::now();
+    qDebug()<<"PVS baked:"<<dims[0]<<"x"<<dims[1]<<"x"<<dims[2]<<"cells ("<<openCells.load()<<"walkable),"
+            <<targetCount<<"targets,"<<rayCount.load()<<"rays in"<<chrono::duration_cast<chrono::milliseconds>(t1 - t0);
+}
+
+bool PotentiallyVisibleSet::save(const QString &path) const{
+    QFile file(path);
+    if(!file.open(QIODevice::WriteOnly)) return false;
+    PVSFileHeader header = {pvsMagic, pvsVersion, {dims[0], dims[1], dims[2]},
+                            {origin.x, origin.y, origin.z}, cellSize, targetCount, targetHash};
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)bits.data(), bits.size() * sizeof(uint64_t));
+    return true;
+}
+
+bool PotentiallyVisibleSet::load(const QString &path, const BBox3D &volume, int resolution, const vector<PVSTarget> &targets,
+                                 int cellSamples, float eyeHeight){
+    clear();
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly)) return false;
+    PVSFileHeader header;
+    if(file.read((char*)&header, sizeof(header)) != sizeof(header)) return false;
+    setLayout(volume, resolution, targets, cellSamples, eyeHeight);
+    if(header.magic != pvsMagic || header.version != pvsVersion || header.targetCount != targetCount
+       || header.targetHash != targetHash) return false;
+    for(int i = 0; i < 3; i++)
+        if(header.dims[i] != dims[i]) return false;
+    if(header.cellSize != cellSize || header.origin[0] != origin.x || header.origin[1] != origin.y || header.origin[2] != origin.z)
+        return false;
+    vector<uint64_t> data((size_t)dims[0] * dims[1] * dims[2] * wordsPerCell);
+    qint64 bytes = data.size() * sizeof(uint64_t);
+    if(file.read((char*)data.data(), bytes) != bytes) return false;
+    bits = std::move(data);
+    qDebug()<<"PVS loaded from"<<path;
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef PVS_H
+#define PVS_H
+
+#include "structures.h"
+#include "raytest.h"
+#include <QString>
+
+// 潜在可见集（PVS）：把静态场景的包围盒切成格子，离线从每个格子往每个目标打采样射线，
+// 记下从这个格子里可能看到哪些目标。运行时按相机所在的格子查一下位表就行。
+// 采样是近似的：格子里没有一个采样点能看到目标的任何采样点，才认为看不到。
+// 格子的采样点是相机能待的地方：地面上眼睛高度的位置，和跟它们连得通的格子角；
+// 格子里找不到地面（墙里、半空中）就全部算可见。
+// 目标的采样点取它的顶点，再按面积在三角形上撒点（大约每半个格子见方一个），大的目标采样点多
+struct PVSTarget{
+    BoundingSphere bounds;
+    std::vector<Vec3> triangles;    // 目标的三角形，世界坐标，每 3 个点一个
+};
+
+class PotentiallyVisibleSet{
+public:
+    // 最长的一边切成 resolution 格，格子是正方体。每个格子往下打 cellSamples 列找地面（+y 朝下），
+    // eyeHeight 是眼睛离地面的高度，<= 0 时取半个格子
+    void bake(const RaytestManager &raytest, const BBox3D &volume, int resolution,
+              const std::vector<PVSTarget> &targets, int cellSamples = 8, float eyeHeight = 0.0f);
+    // 文件里的格子划分、目标（按包围球和采样点比对）或者参数对不上时返回 false，需要重新烘焙
+    bool load(const QString &path, const BBox3D &volume, int resolution, const std::vector<PVSTarget> &targets,
+              int cellSamples = 8, float eyeHeight = 0.0f);
+    bool save(const QString &path) const;
+    void clear();
+    bool empty() const{ return bits.empty(); }
+
+    // 在体积外面返回 -1，这时所有目标都当成可见
+    int cellIndex(const Vec3 &pos) const;
+    bool visible(int cell, uint target) const{
+        if(cell < 0) return true;
+        return bits[(size_t)cell * wordsPerCell + target / 64] >> (target % 64) & 1;
+    }
+
+private:
+    Vec3 origin;
+    float cellSize = 0.0f;
+    int dims[3] = {};
+    uint targetCount = 0, wordsPerCell = 0;
+    uint64_t targetHash = 0;
+    std::vector<uint64_t> bits;
+    std::vector<std::vector<Vec3>> targetSamples;
+
+    void setLayout(const BBox3D &volume, int resolution, const std::vector<PVSTarget> &targets, int cellSamples,
+                   float eyeHeight);
+};
+
+#endif // PVS_H
@@ -3,7 +3,7 @@
 using namespace std;
 using namespace Raytest;
 
-int Raytest::intersectCallCnt;
+thread_local int Raytest::intersectCallCnt;
 
 std::vector<BVHLeaf<Triangle>> toLeafVec(const Mesh &mesh){
     std::vector<BVHLeaf<Triangle>> ret;
@@ -36,11 +36,24 @@ float BBox3D::intersectDis(const Ray &ray)const{
 }
 
 void RaytestManager::appendMesh(const Mesh &mesh){
-    meshTrees.push_back(BVHTree<Triangle>(toLeafVec(mesh)));
-    qDebug()<<"built BVH tree for mesh"<<mesh.meshID<<"with"<<meshTrees.back().nodes.size()<<"nodes";
+    setMeshTree(mesh.meshID, BVHTree<Triangle>(toLeafVec(mesh)), false);
+    qDebug()<<"built BVH tree for mesh"<<mesh.meshID<<"with"<<meshTrees[mesh.meshID].nodes.size()<<"nodes";
+}
+
+void RaytestManager::setMeshTree(uint meshID, BVHTree<Triangle> &&tree, bool worldSpace){
+    if(meshTrees.size() <= meshID) meshTrees.resize(meshID + 1);
+    meshTrees[meshID] = std::move(tree);
+    if(worldSpace) worldMeshes.push_back(meshID);
+}
+
+void RaytestManager::releaseMesh(uint meshID){
+    if(meshID >= meshTrees.size()) return;
+    meshTrees[meshID] = BVHTree<Triangle>();
+    erase(worldMeshes, meshID);
 }
 
 RaytestResult<Triangle> RaytestManager::meshIntersect(uint meshID, const Ray &ray)const{
+    if(meshID >= meshTrees.size() || meshTrees[meshID].empty()) return {false};
     return meshTrees[meshID].intersect(ray);
 }
 
@@ -152,5 +165,23 @@ void RaytestManager::buildStaticBVH(const QList<Mesh> &lst){
 }
 
 std::set<BoxtestResult> RaytestManager::sceneBoxIntersect(const BBox3D &box)const{
-    return staticSceneBVH.boxIntersect(box);
+    std::set<BoxtestResult> ret;
+    if(!staticSceneBVH.empty()) ret = staticSceneBVH.boxIntersect(box);
+    for(uint meshID: worldMeshes) ret.merge(meshTrees[meshID].boxIntersect(box));
+    return ret;
+}
+
+RaytestResult<Triangle> RaytestManager::sceneIntersect(const Ray &ray)const{
+    RaytestResult<Triangle> ret = {false};
+    if(!staticSceneBVH.empty()) ret = staticSceneBVH.intersect(ray);
+    for(uint meshID: worldMeshes){
+        RaytestResult<Triangle> curr = meshTrees[meshID].intersect(ray);
+        if(curr.hit && (!ret.hit || curr.dis < ret.dis)) ret = curr;
+    }
+    return ret;
+}
+
+BBox3D RaytestManager::staticSceneBox()const{
+    if(staticSceneBVH.empty()) return {};
+    return staticSceneBVH.nodes[0].box;
 }
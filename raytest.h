@@ -97,7 +97,8 @@ namespace Raytest{
         float dis;
     };
 
-    extern int intersectCallCnt;
+    // 调试用的计数，按线程分开，PVS 烘焙时多个 worker 同时在测
+    extern thread_local int intersectCallCnt;
     RaytestHit inline lowLevelIntersect(const BVHLeaf<Triangle> &leaf, const Ray &ray){
         intersectCallCnt ++;
         Vec3 hit = leaf.plane.intersect(ray);
@@ -273,19 +274,30 @@ public:
         assert(nodes.size());
         return recursiveBoxIntersect(nodes[0], box);
     }
+    bool empty()const{
+        return nodes.empty();
+    }
     friend class RaytestManager;
 };
 
 
 class RaytestManager{
 public:
+    // 按 meshID 存放，流式卸载掉的网格留空
     std::vector<BVHTree<Triangle>> meshTrees;
     BVHTree<Triangle> staticSceneBVH;
+    // 树本身就在世界坐标下的网格（流式加载的格子），和 staticSceneBVH 一起参与整个场景的查询
+    std::vector<uint> worldMeshes;
 
     void appendMesh(const Mesh &mesh);
+    void setMeshTree(uint meshID, BVHTree<Triangle> &&tree, bool worldSpace);
+    void releaseMesh(uint meshID);
     void buildStaticBVH(const QList<Mesh> &lst);
     RaytestResult<Triangle> meshIntersect(uint meshID, const Ray &ray)const;
     std::set<BoxtestResult> sceneBoxIntersect(const BBox3D &box)const;
+    // 对静态场景整体求交，没建静态 BVH 时总是 miss。只读，可以多线程同时调用
+    RaytestResult<Triangle> sceneIntersect(const Ray &ray)const;
+    BBox3D staticSceneBox()const;
 };
 
 #endif // RAYTEST_H
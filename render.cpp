@@ -2,31 +2,42 @@
 #include "utils.h"
 #include <QDebug>
 #include "shader_interface.h"
+#include "occlusion.h"
+#include "meshprocessing.h"
+#include <mutex>
+#include <condition_variable>
 using namespace std;
 
-FrameStat frameStat;
-
-namespace ShaderInternal{
-    vector<Vertex> vertices;
-    vector<Triangle> triangles;
-    CameraInfo camera;
-    uint *buffer;
-
-    uint pixelW, pixelH;
-
-    // (x, y, 4096.0f/z)
-    vector<Vertex> projectedVertices;
-
-    vector<Fragment> fragments;
-    vector<float> maxZInv;
-}
-
-
-using namespace ShaderInternal;
-
-ShadingBuffer shadingBuffer;
-
-
+// 常驻几何占据顶点编号和 triangles 的前缀，每个对象一段连续区间。
+// 常驻顶点是紧凑格式，存在 RetainedGeometry::vertices 里，按对象自己的量化参数解码
+struct RenderObject{
+    uint vertexBegin, vertexCount;
+    uint triangleBegin, triangleCount;
+    VertexQuantization quant;
+    bool alive = false;
+    bool visible = true;
+    bool culled = false;        // 调用方按它自己的相机剔掉的，多视图时不算数
+    vector<Meshlet> meshlets;   // 世界坐标，triangleBegin 相对于对象自己的区间
+    vector<uint8_t> meshletMask;    // 空或者和 meshlets 一样长，也只对调用方自己的相机有效
+    BoundingSphere bounds;
+    bool occluder = false;
+    vector<Vec3> occluderProxy; // 每 3 个点一个三角形，空的话用常驻三角形
+};
+
+struct RetainedGeometry{
+    vector<RenderObject> objects;
+    vector<CompactVertex> vertices;
+    vector<RenderObjectID> freeIDs;
+    uint residentVertices = 0, residentTriangles = 0;
+    // 大小变了的对象会换到末尾，旧区间留成空洞，攒多了再整理
+    vector<pair<uint, uint>> holes;
+    uint garbageTriangles = 0;
+};
+
+struct InstanceBatch{
+    uint meshID;
+    vector<InstanceData> instances;
+};
 Vertex vertexIntersect(const Vertex &a, const Vertex &b, const Plane &p){
     Vec3 intersection = p.intersect(link(a.pos, b.pos));
     float c = (intersection - a.pos).len() / (b.pos - a.pos).len();
@@ -40,17 +51,220 @@ uint simpleLightBlend(uint color, float intensity){
     uint b = color & 0x000000ff;
     return 0xff000000 | (uint(r*intensity) << 16) | (uint(g*intensity) << 8) | (uint(b*intensity));
 }
-class Renderer{
-private:
+// w 是 b 的权重，0~256。两个通道一组相乘，每个通道占 16 位，不会互相进位
+static inline uint lerpColor(uint a, uint b, uint w){
+    uint rb = ((a & 0xff00ff) * (256 - w) + (b & 0xff00ff) * w) >> 8 & 0xff00ff;
+    uint ag = ((a >> 8 & 0xff00ff) * (256 - w) + (b >> 8 & 0xff00ff) * w) & 0xff00ff00;
+    return rb | ag;
+}
+// 双线性放大：输出像素中心对应到源图的 (o+0.5)*src/dst-0.5，取相邻四个像素按 8 位定点权重插值
+static void upscaleBilinear(const FrameTarget &src, const FrameTarget &dst){
+    struct Tap{ int i0, i1; uint w; };
+    auto taps = [](int s, int d){
+        vector<Tap> ret(d);
+        for(int o = 0; o < d; o++){
+            float p = clamp((o + 0.5f) * s / d - 0.5f, 0.0f, float(s - 1));
+            int i0 = (int)p;
+            ret[o] = {i0, min(i0 + 1, s - 1), (uint)lround((p - i0) * 256)};
+        }
+        return ret;
+    };
+    vector<Tap> tx = taps(src.width, dst.width), ty = taps(src.height, dst.height);
+    taskDispatcher.parallelFor(dst.height, 16, [&](int begin, int end){
+        for(int oy = begin; oy < end; oy++){
+            const uint *r0 = src.pixels + (size_t)ty[oy].i0 * src.stride;
+            const uint *r1 = src.pixels + (size_t)ty[oy].i1 * src.stride;
+            uint wy = ty[oy].w;
+            uint *out = dst.pixels + (size_t)oy * dst.stride;
+            for(int ox = 0; ox < dst.width; ox++){
+                const Tap &t = tx[ox];
+                out[ox] = lerpColor(lerpColor(r0[t.i0], r0[t.i1], t.w), lerpColor(r1[t.i0], r1[t.i1], t.w), wy);
+            }
+        }
+    });
+}
+struct FrameHandle::State{
+    CameraInfo camera;
+    FrameTarget target;
+    std::function<void(FrameHandle::Status)> onComplete;
+
+    std::atomic<bool> cancelRequested = false;
+    mutable std::mutex mtx;
+    mutable std::condition_variable cv;
+    Status status = Pending;
+
+    // 回调先于状态更新：wait 返回时回调已经跑完，等待方可以放心销毁回调里用到的东西
+    void finish(Status s){
+        if(onComplete) onComplete(s);
+        {
+            lock_guard<mutex> lock(mtx);
+            status = s;
+        }
+        cv.notify_all();
+    }
+};
+
+FrameHandle::Status FrameHandle::status() const{
+    if(!state) return Cancelled;
+    lock_guard<mutex> lock(state->mtx);
+    return state->status;
+}
+
+bool FrameHandle::ready() const{
+    Status s = status();
+    return s == Finished || s == Cancelled || s == Failed || s == Unchanged;
+}
+
+void FrameHandle::wait() const{
+    if(!state) return;
+    unique_lock<mutex> lock(state->mtx);
+    state->cv.wait(lock, [this]{return state->status != Pending && state->status != Running;});
+}
+
+bool FrameHandle::waitFor(std::chrono::microseconds timeout) const{
+    if(!state) return true;
+    unique_lock<mutex> lock(state->mtx);
+    return state->cv.wait_for(lock, timeout, [this]{return state->status != Pending && state->status != Running;});
+}
 
+void FrameHandle::cancel() const{
+    if(state) state->cancelRequested = true;
+}
 
+// 后台渲染线程，只有一个排队槽位
+class AsyncFrameRunner{
 public:
+    using RenderFunc = std::function<FrameHandle::Status(FrameHandle::State&)>;
+    explicit AsyncFrameRunner(RenderFunc _render):render(std::move(_render)){}
+    ~AsyncFrameRunner(){
+        {
+            lock_guard<mutex> lock(mtx);
+            quit = true;
+        }
+        cv.notify_all();
+        if(worker.joinable()) worker.join();
+        if(pending) pending->finish(FrameHandle::Cancelled);
+    }
+    void submit(std::shared_ptr<FrameHandle::State> frame){
+        std::shared_ptr<FrameHandle::State> stale;
+        {
+            lock_guard<mutex> lock(mtx);
+            if(!worker.joinable()) worker = std::thread([this]{run();});
+            stale = std::move(pending);
+            pending = std::move(frame);
+        }
+        if(stale) stale->finish(FrameHandle::Cancelled);
+        cv.notify_all();
+    }
+private:
+    void run(){
+        while(true){
+            std::shared_ptr<FrameHandle::State> frame;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [this]{return quit || pending != nullptr;});
+                if(quit) return;
+                frame = std::move(pending);
+            }
+            if(frame->cancelRequested){
+                frame->finish(FrameHandle::Cancelled);
+                continue;
+            }
+            {
+                lock_guard<mutex> lock(frame->mtx);
+                frame->status = FrameHandle::Running;
+            }
+            FrameHandle::Status result;
+            try{
+                result = render(*frame);
+            }catch(const std::exception &e){
+                qWarning()<<"async frame failed:"<<e.what();
+                result = FrameHandle::Failed;
+            }
+            frame->finish(result);
+        }
+    }
+
+    RenderFunc render;
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::shared_ptr<FrameHandle::State> pending;
+    bool quit = false;
+};
+
+struct Renderer::Impl : RenderContext{
+    RetainedGeometry retained;
+    // 本帧提交的实例，clearRenderBuffer 时清掉
+    vector<InstanceBatch> instanceBatches;
+
+    OcclusionBuffer occlusionBuffer;
+    bool occlusionCulling = true;
+    // drawViews 期间为 true：调用方按单个相机给的 culled 和 meshletMask 都不用，对象改按所有视锥的并集剔除
+    bool multiView = false;
+
+    TileScheduler scheduler{*this};
+    FrameStat frameStat;
+    vector<chrono::microseconds> frametimes;
+
+    // 双线性缩放时 target 指向 lowRes（渲染分辨率），整帧画完再放大到 presentTarget；其它情况两者相同
+    FrameTarget presentTarget;
+    vector<uint> lowRes;
+
+    // 增量渲染：上一帧完整写回的输出表面尺寸（0 表示没有），不一样的话即使没有 tile 变化也要整个写回
+    int resolvedWidth = 0, resolvedHeight = 0;
+    uint tileMaterialVersion = 0;
+
+    // 各阶段每帧重复用的临时数组
+    vector<pair<const Meshlet*, uint>> meshletWork;
+    vector<const RenderObject*> occludeeWork;
+    vector<tuple<const RenderObject*, uint, uint>> sliceWork;
+    // 活着的常驻对象按 triangleBegin 排序，cullResident 时更新
+    vector<const RenderObject*> residentSlices;
+    vector<Vec3> occluderTriangles;
+    vector<uint8_t> sharedCulled;
+
+    // 同步和异步的帧都要先拿到这把锁
+    std::mutex frameMutex;
+    // 放在最后，析构时最先停下渲染线程
+    AsyncFrameRunner asyncRunner{[this](FrameHandle::State &frame){ return renderAsync(frame); }};
+
+    // fragment 光栅化和着色用到的全部输入：屏幕上的范围、边方程、插值系数和材质。线框按三角形编号上色，要带上编号
+    uint64_t fragmentSignature(const Fragment &frag) const{
+        const Triangle &t = triangles[frag.triangleID];
+        uint64_t h = 0xcbf29ce484222325ull ^ ((uint64_t)t.materialID << 32 | t.shaderConfig);
+        if(t.shaderConfig & ShaderConfig::WireframeOnly) h = (h ^ frag.triangleID) * 0x100000001b3ull;
+        constexpr size_t words = (sizeof(Fragment) - offsetof(Fragment, xlt)) / sizeof(uint32_t);
+        uint32_t data[words];
+        memcpy(data, &frag.xlt, sizeof(data));
+        for(uint32_t w: data) h = (h ^ w) * 0x100000001b3ull;
+        return h;
+    }
+    // 按三角形编号从小到大找常驻三角形属于哪个对象，其它三角形返回 nullptr。
+    // 只能问没被剔除的三角形：常驻的一定属于某个活着的对象，residentSlices 按 triangleBegin 排好了
+    struct SliceCursor{
+        const vector<const RenderObject*> &slices;
+        uint residentTriangles;
+        size_t k = 0;
+        const RenderObject *owner(uint triangle){
+            if(triangle >= residentTriangles) return nullptr;
+            while(slices[k]->triangleBegin + slices[k]->triangleCount <= triangle) k++;
+            return slices[k];
+        }
+    };
+    // 常驻顶点用所属对象的参数解码
+    Vertex vertexAt(uint vid, const RenderObject *owner) const{
+        if(vid < retained.residentVertices) return owner->quant.decode(retained.vertices[vid]);
+        return vertices[vid - retained.residentVertices];
+    }
+    // 顶点之间互不相关，按块分给线程池。常驻顶点按对象的区间走，边解码边投影；
+    // 不显示的对象没有三角形会用到它的投影，直接跳过
     void vertexProject(){
-        projectedVertices.reserve(vertices.size());
+        uint residentVertices = retained.residentVertices;
+        projectedVertices.resize(residentVertices + vertices.size());
         Vec3 screenCenter = camera.pos + camera.focalLength * camera.frame.axisZ;
         // qDebug()<<screenCenter.to_string();
-
-        for(const Vertex& v:vertices){
+        auto project = [&](const Vertex &v){
             Vec3 ray = v.pos - camera.pos;
             Vec3 projection = camera.pos + ray / ray.dot(camera.frame.axisZ) * camera.focalLength;
 
@@ -66,68 +280,270 @@ public:
             Vec3 pos = {x2d, y2d, zInv};
             Vec3 uv = v.uv * zInv;
 
-            projectedVertices.push_back({pos, uv});
+            return Vertex{pos, uv};
+        };
+
+        vector<tuple<const RenderObject*, uint, uint>> &work = sliceWork;
+        work.clear();
+        for(const RenderObject *obj: residentSlices){
+            if(!shown(*obj)) continue;
+            for(uint begin = obj->vertexBegin; begin < obj->vertexBegin + obj->vertexCount; begin += 4096)
+                work.push_back({obj, begin, min(begin + 4096, obj->vertexBegin + obj->vertexCount)});
         }
+        taskDispatcher.parallelFor(work.size(), 1, [&](int begin, int end){
+            for(int k = begin; k < end; k++){
+                auto [obj, first, last] = work[k];
+                for(uint i = first; i < last; i++)
+                    projectedVertices[i] = project(obj->quant.decode(retained.vertices[i]));
+            }
+        });
+        taskDispatcher.parallelFor(vertices.size(), 4096, [&](int begin, int end){
+            for(int i = begin; i < end; i++)
+                projectedVertices[residentVertices + i] = project(vertices[i]);
+        });
 
         maxZInv.resize(triangles.size());
-        for(int i=0;i<triangles.size();i++){
-            maxZInv[i] = max({projectedVertices[triangles[i].vid[0]].pos.z, projectedVertices[triangles[i].vid[1]].pos.z, projectedVertices[triangles[i].vid[2]].pos.z});
+        taskDispatcher.parallelFor(triangles.size(), 4096, [&](int begin, int end){
+            for(int i = begin; i < end; i++)
+                maxZInv[i] = max({projectedVertices[triangles[i].vid[0]].pos.z, projectedVertices[triangles[i].vid[1]].pos.z, projectedVertices[triangles[i].vid[2]].pos.z});
+        });
+    }
+    // 顶点阶段：把本帧的实例变换到世界坐标，接在临时几何后面。
+    // 多视图时只剔掉所有视图都看不到的实例和 meshlet；遮挡图只对应一个相机，occlusion 为 false 时不用
+    void expandInstances(const vector<CameraInfo> &views, bool occlusion){
+        vector<Frustum> frustums;
+        for(const CameraInfo &view: views) frustums.push_back(Frustum::fromCamera(view));
+        auto outsideAll = [&](const Vec3 &center, float radius){
+            for(const Frustum &f: frustums)
+                if(!f.sphereOutside(center, radius)) return false;
+            return true;
+        };
+        auto backfacingAll = [&](const Meshlet &m){
+            for(const CameraInfo &view: views)
+                if(!m.backfacing(view.pos)) return false;
+            return true;
+        };
+        const vector<Mesh> &meshes = assetManager.getMeshes();
+        for(const InstanceBatch &batch: instanceBatches){
+            const Mesh &mesh = meshes.at(batch.meshID);
+            const CompactMesh &compact = assetManager.compactMesh(batch.meshID);
+            for(const InstanceData &inst: batch.instances){
+                Vec3 center = mesh.bounds.center * inst.scale * inst.transform.rotation + inst.transform.translation;
+                if(outsideAll(center, mesh.bounds.radius * std::abs(inst.scale))) continue;
+                if(occlusion && occlusionBuffer.sphereOccluded(center, mesh.bounds.radius * std::abs(inst.scale))){
+                    frameStat.occlusionCulled ++;
+                    continue;
+                }
+
+                uint n = retained.residentVertices + vertices.size();
+                ushort materialID = inst.materialID == 0xffff ? mesh.materialID : inst.materialID;
+                // 顶点从紧凑格式解码，反量化和实例变换合在一起：pos = (origin + q*step) * scale * R + T
+                Mat3 rotation = inst.transform.rotation;
+                Vec3 origin = compact.posOrigin * inst.scale * rotation + inst.transform.translation;
+                Vec3 axisX = rotation.row(0) * (compact.posStep.x * inst.scale);
+                Vec3 axisY = rotation.row(1) * (compact.posStep.y * inst.scale);
+                Vec3 axisZ = rotation.row(2) * (compact.posStep.z * inst.scale);
+                for(const CompactVertex &v: compact.vertices)
+                    vertices.push_back({origin + axisX * v.pos[0] + axisY * v.pos[1] + axisZ * v.pos[2], compact.texcoord(v)});
+
+                auto pushRange = [&](uint begin, uint count){
+                    for(uint i = begin; i < begin + count; i++){
+                        triangles.push_back(compact.triangle(i));
+                        Triangle &curr = triangles.back();
+                        curr.materialID = materialID;
+                        curr.vid[0] += n;
+                        curr.vid[1] += n;
+                        curr.vid[2] += n;
+                    }
+                };
+                if(mesh.meshlets.empty()){
+                    pushRange(0, compact.triangles.size());
+                    continue;
+                }
+                // 实例的 meshlet 在这里顺便剔掉，被剔掉的三角形根本不进工作数组
+                for(Meshlet m: mesh.meshlets){
+                    m.bounds.center = m.bounds.center * inst.scale * inst.transform.rotation + inst.transform.translation;
+                    m.bounds.radius *= std::abs(inst.scale);
+                    m.coneAxis = m.coneAxis * inst.transform.rotation;
+                    if(outsideAll(m.bounds.center, m.bounds.radius) || backfacingAll(m)){
+                        frameStat.meshletCulled ++;
+                        continue;
+                    }
+                    if(occlusion && occlusionBuffer.sphereOccluded(m.bounds.center, m.bounds.radius)){
+                        frameStat.occlusionCulled ++;
+                        continue;
+                    }
+                    pushRange(m.triangleBegin, m.triangleCount);
+                }
+            }
+        }
+    }
+    bool shown(const RenderObject &obj) const{
+        return obj.alive && obj.visible && (multiView || !obj.culled);
+    }
+    // views 不为空时整个对象落在所有视锥外面的也剔掉
+    void cullResident(const vector<CameraInfo> &views = {}){
+        vector<Frustum> frustums;
+        for(const CameraInfo &view: views) frustums.push_back(Frustum::fromCamera(view));
+        auto outsideAll = [&](const BoundingSphere &bounds){
+            if(frustums.empty()) return false;
+            for(const Frustum &f: frustums)
+                if(!f.sphereOutside(bounds.center, bounds.radius)) return false;
+            return true;
+        };
+        triangleCulled.assign(triangles.size(), 0);
+        residentSlices.clear();
+        for(const RenderObject &obj: retained.objects){
+            if(obj.alive) residentSlices.push_back(&obj);
+            if(shown(obj) && !outsideAll(obj.bounds)) continue;
+            fill_n(triangleCulled.begin() + obj.triangleBegin, obj.triangleCount, 1);
+        }
+        sort(residentSlices.begin(), residentSlices.end(), [](const RenderObject *a, const RenderObject *b){
+            return a->triangleBegin < b->triangleBegin;
+        });
+        for(auto [begin, count]: retained.holes)
+            fill_n(triangleCulled.begin() + begin, count, 1);
+    }
+    // 整簇剔除：视锥外或者整簇背对相机的 meshlet，在 frontClip 和投影之前就标记掉。
+    // 每个 meshlet 只写自己那段 triangleCulled，按 meshlet 分块并行
+    void cullMeshlets(){
+        vector<pair<const Meshlet*, uint>> &work = meshletWork;
+        work.clear();
+        int masked = 0;
+        for(const RenderObject &obj: retained.objects){
+            if(!shown(obj)) continue;
+            for(auto [i, m]: enumerate(obj.meshlets)){
+                if(!multiView && obj.meshletMask.size() && !obj.meshletMask[i]){
+                    fill_n(triangleCulled.begin() + obj.triangleBegin + m.triangleBegin, m.triangleCount, 1);
+                    masked++;
+                }else work.push_back({&m, obj.triangleBegin});
+            }
+        }
+        frameStat.meshletCulled += masked;
+        Frustum frustum = Frustum::fromCamera(camera);
+        std::atomic<int> culled = 0;
+        taskDispatcher.parallelFor(work.size(), 256, [&](int begin, int end){
+            int cnt = 0;
+            for(int i = begin; i < end; i++){
+                const Meshlet &m = *work[i].first;
+                if(frustum.sphereOutside(m.bounds.center, m.bounds.radius) || m.backfacing(camera.pos)){
+                    fill_n(triangleCulled.begin() + work[i].second + m.triangleBegin, m.triangleCount, 1);
+                    cnt++;
+                }
+            }
+            culled += cnt;
+        });
+        frameStat.meshletCulled += culled;
+    }
+    // 遮挡体先画进低分辨率深度图，必须在 expandInstances 之前
+    void buildOcclusion(){
+        occlusionBuffer.begin(camera);
+        if(!occlusionCulling) return;
+        occluderTriangles.clear();
+        for(const RenderObject &obj: retained.objects){
+            if(!shown(obj) || !obj.occluder) continue;
+            if(obj.occluderProxy.size()){
+                occluderTriangles.insert(occluderTriangles.end(), obj.occluderProxy.begin(), obj.occluderProxy.end());
+                continue;
+            }
+            for(uint i = obj.triangleBegin; i < obj.triangleBegin + obj.triangleCount; i++)
+                for(uint vid: triangles[i].vid) occluderTriangles.push_back(obj.quant.position(retained.vertices[vid]));
         }
+        occlusionBuffer.rasterize(occluderTriangles);
+    }
+    // 先测整个对象，没被挡住再逐个测还没被剔除的 meshlet
+    void cullOccluded(){
+        if(occlusionBuffer.empty()) return;
+        vector<const RenderObject*> &work = occludeeWork;
+        work.clear();
+        for(const RenderObject &obj: retained.objects)
+            if(shown(obj) && !obj.occluder) work.push_back(&obj);
+        std::atomic<int> culled = 0;
+        taskDispatcher.parallelFor(work.size(), 16, [&](int begin, int end){
+            int cnt = 0;
+            for(int i = begin; i < end; i++){
+                const RenderObject &obj = *work[i];
+                if(occlusionBuffer.sphereOccluded(obj.bounds.center, obj.bounds.radius)){
+                    fill_n(triangleCulled.begin() + obj.triangleBegin, obj.triangleCount, 1);
+                    cnt++;
+                    continue;
+                }
+                for(const Meshlet &m: obj.meshlets){
+                    if(triangleCulled[obj.triangleBegin + m.triangleBegin]) continue;
+                    if(occlusionBuffer.sphereOccluded(m.bounds.center, m.bounds.radius)){
+                        fill_n(triangleCulled.begin() + obj.triangleBegin + m.triangleBegin, m.triangleCount, 1);
+                        cnt++;
+                    }
+                }
+            }
+            culled += cnt;
+        });
+        frameStat.occlusionCulled += culled;
     }
     void frontClip(){
-        // 可能在 triangles 末尾填充切分出的新三角形
+        // 不改动已有的三角形：被切开的三角形标记为剔除，切出来的新三角形和新顶点追加在末尾。
+        // 常驻三角形按所属对象解码顶点；新三角形不属于任何对象，用到的常驻顶点也复制一份到 vertices
         vector<pair<uint, Vertex>> front, back;
 
         Vec3 screenCenter = camera.pos + camera.focalLength * camera.frame.axisZ;
         Plane cameraPlane = {screenCenter, camera.frame.axisZ};
         vector<Triangle> tmpTriangles;
+        uint residentVertices = retained.residentVertices;
+        auto append = [&](const Vertex &v){
+            vertices.push_back(v);
+            return residentVertices + (uint)vertices.size() - 1;
+        };
+        SliceCursor slices{residentSlices, retained.residentTriangles};
 
         for(auto [id, triangle]: enumerate(triangles)){
+            if(triangleCulled[id]) continue;
 
             front.clear();
             back.clear();
 
+            const RenderObject *owner = slices.owner(id);
+            Vertex tv[3];
             for(uint i=0;i<3;i++){
                 uint vid = triangle.vid[i];
+                tv[i] = vertexAt(vid, owner);
 
-                float dist = (vertices[vid].pos - screenCenter).dot(camera.frame.axisZ);
-                if(dist >= 0)front.push_back({vid, vertices[vid]});
-                else back.push_back({vid, vertices[vid]});
+                float dist = (tv[i].pos - screenCenter).dot(camera.frame.axisZ);
+                if(dist >= 0)front.push_back({vid, tv[i]});
+                else back.push_back({vid, tv[i]});
             }
 
             if(front.size() == 3u) continue;
-            if(back.size() == 3u){
-                triangle.vid[0] = -1;
-                continue;
-            }
+            triangleCulled[id] = 1;
+            if(back.size() == 3u) continue;
+
+            for(auto &[vid, v]: front)
+                if(vid < residentVertices) vid = append(v);
+            Vec3 oldNorm = (tv[2].pos - tv[0].pos).cross(tv[1].pos - tv[0].pos);
+
             if(front.size() == 2u && back.size() == 1u){
                 Vertex int0 = vertexIntersect(front[0].second, back[0].second, cameraPlane);
                 Vertex int1 = vertexIntersect(front[1].second, back[0].second, cameraPlane);
 
-                uint id0 = vertices.size();
-                vertices.push_back(int0);
-                uint id1 = vertices.size();
-                vertices.push_back(int1);
+                uint id0 = append(int0);
+                uint id1 = append(int1);
 
-                Vec3 oldNorm = (vertices[triangle.vid[2]].pos - vertices[triangle.vid[0]].pos).cross(vertices[triangle.vid[1]].pos - vertices[triangle.vid[0]].pos);
-
-                triangle.vid[0] = front[0].first;
-                triangle.vid[1] = id0;
-                triangle.vid[2] = front[1].first;
+                Triangle tmp1 = triangle;
+                tmp1.vid[0] = front[0].first;
+                tmp1.vid[1] = id0;
+                tmp1.vid[2] = front[1].first;
 
                 Vec3 newNorm2 = (front[1].second.pos - int0.pos).cross(int1.pos - int0.pos);
                 Vec3 newNorm1 = (front[1].second.pos - front[0].second.pos).cross(int0.pos - front[0].second.pos);
 
-                Triangle tmp;
+                Triangle tmp = triangle;
                 tmp.vid[0] = id0;
                 tmp.vid[1] = id1;
                 tmp.vid[2] = front[1].first;
 
                 if(newNorm2.dot(oldNorm) < 0) swap(tmp.vid[1], tmp.vid[2]);
-                if(newNorm1.dot(oldNorm) < 0) swap(triangle.vid[1], triangle.vid[2]);
+                if(newNorm1.dot(oldNorm) < 0) swap(tmp1.vid[1], tmp1.vid[2]);
 
-                tmp.materialID = triangle.materialID;
-                tmp.shaderConfig = triangle.shaderConfig;
+                tmpTriangles.push_back(tmp1);
                 tmpTriangles.push_back(tmp);
                 // if(int0.pos.y > 280)qDebug()<<back[0].second.pos.y;
                 continue;
@@ -136,42 +552,44 @@ public:
                 Vertex int0 = vertexIntersect(front[0].second, back[0].second, cameraPlane);
                 Vertex int1 = vertexIntersect(front[0].second, back[1].second, cameraPlane);
 
-                uint id0 = vertices.size();
-                vertices.push_back(int0);
-                uint id1 = vertices.size();
-                vertices.push_back(int1);
+                uint id0 = append(int0);
+                uint id1 = append(int1);
 
-                Vec3 oldNorm = (vertices[triangle.vid[2]].pos - vertices[triangle.vid[0]].pos).cross(vertices[triangle.vid[1]].pos - vertices[triangle.vid[0]].pos);
                 Vec3 newNorm = (int1.pos - front[0].second.pos).cross(int0.pos - front[0].second.pos);
 
-                triangle.vid[0] = front[0].first;
-                triangle.vid[1] = id0;
-                triangle.vid[2] = id1;
+                Triangle tmp = triangle;
+                tmp.vid[0] = front[0].first;
+                tmp.vid[1] = id0;
+                tmp.vid[2] = id1;
 
-                if(newNorm.dot(oldNorm) < 0) swap(triangle.vid[0], triangle.vid[1]);
+                if(newNorm.dot(oldNorm) < 0) swap(tmp.vid[0], tmp.vid[1]);
 
+                tmpTriangles.push_back(tmp);
                 continue;
             }
             throw runtime_error("how did we get here?");
         }
 
-        triangles.erase(
-            remove_if(triangles.begin(), triangles.end(), [](const Triangle &t){return t.vid[0]==-1;}),
-            triangles.end()
-            );
         for(const Triangle &t: tmpTriangles) triangles.push_back(t);
+        triangleCulled.resize(triangles.size(), 0);
     }
     void getFragments(){
         fragments.reserve(triangles.size());
+        SliceCursor slices{residentSlices, retained.residentTriangles};
 
         for(auto [id, triangle]: enumerate(triangles)){
+            if(triangleCulled[id]) continue;
 
-            triangle.hardNormal = (vertices[triangle.vid[2]].pos - vertices[triangle.vid[0]].pos).cross(vertices[triangle.vid[1]].pos-vertices[triangle.vid[0]].pos);
+            const RenderObject *owner = slices.owner(id);
+            Vec3 p0 = vertexAt(triangle.vid[0], owner).pos;
+            Vec3 p1 = vertexAt(triangle.vid[1], owner).pos;
+            Vec3 p2 = vertexAt(triangle.vid[2], owner).pos;
+            triangle.hardNormal = (p2 - p0).cross(p1 - p0);
             triangle.hardNormal.normalize();
 
             if(!(triangle.shaderConfig & ShaderConfig::DisableBackCulling)){
 
-                if(triangle.hardNormal.dot(vertices[triangle.vid[0]].pos - camera.pos) < 0) continue;
+                if(triangle.hardNormal.dot(p0 - camera.pos) < 0) continue;
             }
 
             fragments.push_back(Fragment());
@@ -219,9 +637,13 @@ public:
 
         }
     }
-    void parallelRasterization(){
+    FrameHandle::Status parallelRasterization(bool allowUnchanged){
 
-        taskDispatcher.init();
+        scheduler.init();
+        if(scheduler.incremental && assetManager.materialVersion() != tileMaterialVersion){
+            scheduler.invalidateTiles();
+            tileMaterialVersion = assetManager.materialVersion();
+        }
         int cnt=0;
         for(const Fragment &frag:fragments){
             int tileXlt = frag.xlt / tileSize;
@@ -234,6 +656,7 @@ public:
             }
 
             // EdgeIterator edgeIt = frag.edgeIterator, tmp;
+            uint64_t signature = scheduler.incremental ? fragmentSignature(frag) : 0;
 
             for(int y = tileYlt; y <= tileYrb; y++){
                 for(int x = tileXlt; x <= tileXrb; x++){
@@ -243,23 +666,36 @@ public:
                     // int innerYlt = frag.ylt; //std::max(frag.ylt, y * tileSize);
                     // int innerYrb = frag.yrb; //std::min(frag.yrb, y * tileSize + tileSize-1);
 
-                    taskDispatcher.submitFragment(frag, x, y);
+                    scheduler.submitFragment(frag, signature, x, y);
                     frameStat.tileFragmentSum ++;
                 }
             }
         }
-        taskDispatcher.finish();
+        int dirty = scheduler.classifyTiles();
+        frameStat.tilesClean = scheduler.tileW * scheduler.tileH - dirty;
+        if(dirty == 0 && allowUnchanged && resolvedWidth == presentTarget.width && resolvedHeight == presentTarget.height)
+            return FrameHandle::Unchanged;
+        resolvedWidth = resolvedHeight = 0;
+        scheduler.finish();
+        if(cancelled()) return FrameHandle::Cancelled;
+        present();
+        resolvedWidth = presentTarget.width;
+        resolvedHeight = presentTarget.height;
+        return FrameHandle::Finished;
+    }
+    void present(){
+        if(target.pixels != presentTarget.pixels) upscaleBilinear(target, presentTarget);
     }
 
     void bfRasterization(){
         for(const Fragment& frag:fragments){
             ushort shaderConfig = triangles[frag.triangleID].shaderConfig;
             if(shaderConfig & ShaderConfig::WireframeOnly)
-                segmentRasterization<WireframeShader>(frag, pixelW, pixelH);
+                segmentRasterization<WireframeShader>(*this, frag);
             else if (shaderConfig & ShaderConfig::MonoChrome)
-                segmentRasterization<MonoChromeShader>(frag, pixelW, pixelH);
+                segmentRasterization<MonoChromeShader>(*this, frag);
             else
-                segmentRasterization<BaseShader>(frag, pixelW, pixelH);
+                segmentRasterization<BaseShader>(*this, frag);
         }
     }
     void determineColor(){
@@ -273,6 +709,8 @@ public:
         Vec3 sunLight = {1, -1, -1};
         sunLight.normalize();
 
+        const ShadingBuffer &shadingBuffer = *this->shadingBuffer;
+        vector<uint> colors(pixelW);
         for(uint y = 0; y < pixelH; y++)
         {
             Vec3 tmpView = view;
@@ -287,11 +725,11 @@ public:
 
                     // 静态转发逻辑
                     if(shaderConfig & ShaderConfig::WireframeOnly)
-                        colorRef = colorDetermination<WireframeShader>(u, v, shadingBuffer.triangleID[y][x], tmpView);
+                        colorRef = colorDetermination<WireframeShader>(*this, u, v, shadingBuffer.triangleID[y][x], tmpView);
                     else if (shaderConfig & ShaderConfig::MonoChrome)
-                        colorRef = colorDetermination<MonoChromeShader>(u, v, shadingBuffer.triangleID[y][x], tmpView);
+                        colorRef = colorDetermination<MonoChromeShader>(*this, u, v, shadingBuffer.triangleID[y][x], tmpView);
                     else
-                        colorRef = colorDetermination<BaseShader>(u, v, shadingBuffer.triangleID[y][x], tmpView);
+                        colorRef = colorDetermination<BaseShader>(*this, u, v, shadingBuffer.triangleID[y][x], tmpView);
 
                     if(!(shaderConfig & ShaderConfig::DisableLightModel)){
                         // 对于简单光照，这一步可以提前；
@@ -303,35 +741,87 @@ public:
                 tmpView += dy;
 
                 // if(x%64==0 || y%64==0) colorRef = 0xffff0000;
-                buffer[y*pixelW + x] = colorRef;
+                colors[x] = colorRef;
             }
+            resolveSpan(y, 0, pixelW - 1, colors.data());
             view += dx;
         }
     }
-    void drawFrame(const CameraInfo &_camera, uint *_buffer){
-        // vertices   = _vertices;
-        // triangles = _triangles;
-        camera = _camera;
-        buffer = _buffer;
-        projectedVertices.clear();
-        fragments.clear();
-
-        if(!BaseShader::lg2[255]){
+    // 画完后 vertices/triangles 恢复成画之前的样子，常驻几何可以留到下一帧
+    template<typename Func> auto keepGeometry(Func &&func){
+        size_t vertexCount = vertices.size();
+        size_t triangleCount = triangles.size();
+        try{
+            auto ret = func();
+            vertices.resize(vertexCount);
+            triangles.resize(triangleCount);
+            return ret;
+        }catch(...){
+            vertices.resize(vertexCount);
+            triangles.resize(triangleCount);
+            throw;
+        }
+    }
+    // 返回 Finished / Cancelled，allowUnchanged 时还可能是 Unchanged
+    FrameHandle::Status drawFrame(const CameraInfo &_camera, const FrameTarget &_target, bool allowUnchanged){
+        return keepGeometry([&]{ return renderStages(_camera, _target, allowUnchanged); });
+    }
+    bool drawViews(const vector<FrameView> &views){
+        return keepGeometry([&]{ return renderViews(views); });
+    }
+    // 第 i 个源像素覆盖 (ox+0.5)*src/dst 落在 [i, i+1) 里的输出像素，也就是最近邻缩放
+    static void buildTargetMap(vector<int> &map, int src, int dst){
+        map.resize(src + 1);
+        for(int i = 0; i <= src; i++)
+            map[i] = clamp((int)ceil((double)i * dst / src - 0.5), 0, dst);
+        map[src] = dst;
+    }
+    // 着色器的对数表所有实例共用，只初始化一次
+    static void initShaderTables(){
+        static std::once_flag once;
+        std::call_once(once, []{
             for(int i=1;i<256;i++){
                 BaseShader::lg2[i] = int(ceil(log2(i+1)));
             }
             for(int i=1;i<4096;i++){
                 BaseShader::lg2f[i] = log2(i/16.0f);
             }
-        }
+        });
+    }
+    // 切换到一个视图：相机、分辨率和输出表面
+    void setupView(const CameraInfo &_camera, const FrameTarget &_target){
+        camera = _camera;
+        target = presentTarget = _target;
+        projectedVertices.clear();
+        fragments.clear();
 
-        pixelW = camera.width * tileSize;
-        pixelH = camera.height * tileSize;
+        pixelW = camera.pixelWidth();
+        pixelH = camera.pixelHeight();
 
         if(pixelW > ShadingBuffer::W)
             throw runtime_error("width "+to_string(pixelW)+" is too wide for buffer");
         if(pixelH > ShadingBuffer::H)
             throw runtime_error("height "+to_string(pixelH)+" is too high for buffer");
+        if(target.pixels == nullptr || target.width <= 0 || target.height <= 0 || target.stride < target.width)
+            throw runtime_error("invalid frame target");
+
+        targetScaled = target.width != (int)pixelW || target.height != (int)pixelH;
+        if(targetScaled && target.filter == ScaleFilter::Bilinear){
+            lowRes.resize((size_t)pixelW * pixelH);
+            target = {lowRes.data(), (int)pixelW, (int)pixelH, (int)pixelW};
+            targetScaled = false;
+        }
+        if(targetScaled){
+            buildTargetMap(targetX, pixelW, target.width);
+            buildTargetMap(targetY, pixelH, target.height);
+        }
+    }
+    FrameHandle::Status renderStages(const CameraInfo &_camera, const FrameTarget &_target, bool allowUnchanged){
+        // vertices   = _vertices;
+        // triangles = _triangles;
+        initShaderTables();
+        multiView = false;
+        setupView(_camera, _target);
 
         // for(uint j=0;j<pixelH;j++)
         // {
@@ -342,42 +832,96 @@ public:
         // }
 
         auto t0 = std::chrono::system_clock::now();
+        frameStat.meshletCulled = 0;
+        frameStat.occlusionCulled = 0;
+        buildOcclusion();
+        expandInstances({camera}, true);
+        cullResident();
+        return viewStages(t0, allowUnchanged, true);
+    }
+    // 多视图：实例展开和对象可见性只做一次，每个视图从这份共享的结果开始，切出来的几何画完就丢掉。
+    // 被取消时返回 false
+    bool renderViews(const vector<FrameView> &views){
+        initShaderTables();
+        multiView = true;
+        vector<CameraInfo> cameras;
+        for(const FrameView &view: views) cameras.push_back(view.camera);
+
+        auto t0 = std::chrono::system_clock::now();
+        frameStat.meshletCulled = 0;
+        frameStat.occlusionCulled = 0;
+        expandInstances(cameras, false);
+        cullResident(cameras);
+        auto t1 = std::chrono::system_clock::now();
+        if(showStatistics) qDebug()<<"shared: instances, cull   |"<<t1-t0<<"for"<<views.size()<<"views";
+
+        size_t sharedVertices = vertices.size(), sharedTriangles = triangles.size();
+        sharedCulled = triangleCulled;
+        for(auto [i, view]: enumerate(views)){
+            if(i > 0){
+                vertices.resize(sharedVertices);
+                triangles.resize(sharedTriangles);
+                triangleCulled = sharedCulled;
+            }
+            setupView(view.camera, view.target);
+            auto t = std::chrono::system_clock::now();
+            buildOcclusion();
+            if(viewStages(t, false, false) == FrameHandle::Cancelled) return false;
+        }
+        return true;
+    }
+    // 单个视图从剔除到光栅化的部分。recordFrameTime 为 false 时不计入帧率统计
+    FrameHandle::Status viewStages(std::chrono::system_clock::time_point t0, bool allowUnchanged, bool recordFrameTime){
+        cullMeshlets();
+        cullOccluded();
         frontClip();
         auto t1 = std::chrono::system_clock::now();
         if(showStatistics) qDebug()<<"stage1: frontclip         |"<<t1-t0;
+        if(cancelled()) return FrameHandle::Cancelled;
         vertexProject();
         auto t2 = std::chrono::system_clock::now();
         if(showStatistics) qDebug()<<"stage2: vertexProject     |"<<t2-t1;
+        if(cancelled()) return FrameHandle::Cancelled;
         getFragments();
         auto t3 = std::chrono::system_clock::now();
         if(showStatistics) qDebug()<<"stage3: getFragments      |"<<t3-t2;
+        if(cancelled()) return FrameHandle::Cancelled;
 
         decltype(t3-t2) total;
-        static vector<chrono::microseconds> frametimes;
 
-        frameStat.vcnt = vertices.size();
+        frameStat.vcnt = retained.residentVertices + vertices.size();
         frameStat.tcnt = triangles.size();
         frameStat.tileFragmentSum = 0;
-        frameStat.pixelIterated = 0;
 
+        FrameHandle::Status status = FrameHandle::Finished;
+        frameStat.tilesClean = 0;
         if(1){
-            parallelRasterization();
+            status = parallelRasterization(allowUnchanged);
+            if(status == FrameHandle::Cancelled) return status;
             auto t4 = std::chrono::system_clock::now();
             if(showStatistics) qDebug()<<"stage4&5: parallel render |"<<t4-t3;
+            scheduler.collectStats(frameStat);
             total = t4-t0;
         }else{
+            // 不经过 tile，缓存的颜色都过期了
+            scheduler.invalidateTiles();
+            resolvedWidth = resolvedHeight = 0;
+            if(!shadingBuffer) shadingBuffer = make_unique<ShadingBuffer>();
             bfRasterization();
             auto t4 = std::chrono::system_clock::now();
             if(showStatistics) qDebug()<<"stage4: rasterization     |"<<t4-t3;
             determineColor();
+            present();
             auto t5 = std::chrono::system_clock::now();
             if(showStatistics) qDebug()<<"stage5: color             |"<<t5-t4;
             total = t5-t0;
         }
         if(showStatistics) qDebug()<<"---------------------------------";
         if(showStatistics) qDebug()<<"total                     |"<<total;
+        frameStat.frameTime = chrono::duration<float, micro>(total).count();
 
-        frametimes.push_back(chrono::duration_cast<chrono::microseconds>(total));
+        if(recordFrameTime || frametimes.empty())
+            frametimes.push_back(chrono::duration_cast<chrono::microseconds>(total));
         if(frametimes.size() > 100u)
             frametimes.erase(frametimes.begin());
 
@@ -403,36 +947,452 @@ public:
             qDebug()<<"vertex                    |"<<frameStat.vcnt;
             qDebug()<<"triangle                  |"<<frameStat.tcnt;
             qDebug()<<"tiled triangle part       |"<<frameStat.tileFragmentSum;
+            qDebug()<<"culled meshlet            |"<<frameStat.meshletCulled;
+            qDebug()<<"occlusion culled          |"<<frameStat.occlusionCulled;
             qDebug()<<"iterated pixel            |"<<frameStat.pixelIterated;
+            qDebug()<<"written pixel             |"<<frameStat.pixelWritten;
+            qDebug()<<"shaded pixel              |"<<frameStat.pixelShaded;
+            qDebug()<<"depth rejected part       |"<<frameStat.depthRejected;
+            qDebug()<<"tiles / steals            |"<<frameStat.tilesProcessed<<"/"<<frameStat.steals;
+            qDebug()<<"clean tiles               |"<<frameStat.tilesClean;
+        }
+        return status;
+    }
+    FrameHandle::Status renderAsync(FrameHandle::State &frame){
+        lock_guard<mutex> lock(frameMutex);
+        cancelFlag = &frame.cancelRequested;
+        try{
+            FrameHandle::Status result = drawFrame(frame.camera, frame.target, true);
+            cancelFlag = nullptr;
+            return result;
+        }catch(...){
+            cancelFlag = nullptr;
+            throw;
         }
     }
-    friend void clearRenderBuffer();
-    friend void submitMesh(const Mesh &mesh);
-}renderer;
 
-void drawFrame(const CameraInfo &camera, uint *buffer){
-    renderer.drawFrame(camera, buffer);
+    // 把本帧的临时三角形暂时摘下来，改完常驻部分再接回去。临时顶点不用动，编号跟着常驻顶点数平移
+    template<typename Func> void editResident(Func &&func){
+        vector<Triangle> transientTriangles(triangles.begin() + retained.residentTriangles, triangles.end());
+        uint oldVertexBase = retained.residentVertices;
+        triangles.resize(retained.residentTriangles);
+
+        func();
+
+        uint shift = retained.residentVertices - oldVertexBase;
+        for(Triangle &t: transientTriangles){
+            t.vid[0] += shift;
+            t.vid[1] += shift;
+            t.vid[2] += shift;
+        }
+        triangles.insert(triangles.end(), transientTriangles.begin(), transientTriangles.end());
+    }
+
+    // 三角形追加到 triangles 末尾，顶点编号从 n 开始
+    void appendTriangles(const Mesh &mesh, uint n){
+        for(const Triangle &t:mesh.triangles){
+            triangles.push_back(t);
+            Triangle &curr = triangles.back();
+
+            curr.materialID = mesh.materialID;
+            // curr.shaderConfig = mesh.shaderConfig;
+            curr.vid[0] += n;
+            curr.vid[1] += n;
+            curr.vid[2] += n;
+        }
+    }
+
+    // 空洞超过常驻三角形的一半时整理一次，所有对象往前挪
+    void compactResident(){
+        vector<CompactVertex> newVertices;
+        vector<Triangle> newTriangles;
+        newVertices.reserve(retained.residentVertices);
+        newTriangles.reserve(retained.residentTriangles - retained.garbageTriangles);
+        for(RenderObject &obj: retained.objects){
+            if(!obj.alive) continue;
+            uint vertexBegin = newVertices.size();
+            newVertices.insert(newVertices.end(), retained.vertices.begin() + obj.vertexBegin,
+                               retained.vertices.begin() + obj.vertexBegin + obj.vertexCount);
+            uint triangleBegin = newTriangles.size();
+            for(uint i = 0; i < obj.triangleCount; i++){
+                Triangle t = triangles[obj.triangleBegin + i];
+                for(uint &vid: t.vid) vid = vid - obj.vertexBegin + vertexBegin;
+                newTriangles.push_back(t);
+            }
+            obj.vertexBegin = vertexBegin;
+            obj.triangleBegin = triangleBegin;
+        }
+        retained.vertices = std::move(newVertices);
+        triangles = std::move(newTriangles);
+        retained.residentVertices = retained.vertices.size();
+        retained.residentTriangles = triangles.size();
+        retained.holes.clear();
+        retained.garbageTriangles = 0;
+    }
+
+    void releaseSlice(RenderObject &obj){
+        if(obj.triangleCount) retained.holes.push_back({obj.triangleBegin, obj.triangleCount});
+        retained.garbageTriangles += obj.triangleCount;
+        obj.vertexCount = obj.triangleCount = 0;
+    }
+
+    // 加载的网格都算好了包围球，临时拼出来的网格可能没有
+    static BoundingSphere meshBounds(const Mesh &mesh){
+        if(mesh.bounds.radius > 0.0f) return mesh.bounds;
+        Mesh tmp;
+        tmp.vertices = mesh.vertices;
+        tmp.computeBounds();
+        return tmp.bounds;
+    }
+
+    void allocateSlice(RenderObject &obj, const Mesh &mesh){
+        obj.meshlets = mesh.meshlets;
+        obj.meshletMask.clear();
+        obj.bounds = meshBounds(mesh);
+        obj.vertexBegin = retained.residentVertices;
+        obj.vertexCount = mesh.vertices.size();
+        obj.triangleBegin = retained.residentTriangles;
+        obj.triangleCount = mesh.triangles.size();
+        retained.vertices.resize(obj.vertexBegin + obj.vertexCount);
+        obj.quant = quantizeVertices(mesh.vertices, retained.vertices.data() + obj.vertexBegin);
+        appendTriangles(mesh, obj.vertexBegin);
+        retained.residentVertices = retained.vertices.size();
+        retained.residentTriangles = triangles.size();
+    }
+
+    RenderObjectID createRenderObject(const Mesh &mesh){
+        RenderObjectID id;
+        if(retained.freeIDs.size()){
+            id = retained.freeIDs.back();
+            retained.freeIDs.pop_back();
+        }else{
+            id = retained.objects.size();
+            retained.objects.push_back({});
+        }
+        RenderObject &obj = retained.objects[id];
+        obj.alive = true;
+        obj.visible = true;
+        obj.culled = false;
+        obj.occluder = false;
+        obj.occluderProxy.clear();
+        editResident([&]{ allocateSlice(obj, mesh); });
+        return id;
+    }
+
+    void updateRenderObject(RenderObjectID id, const Mesh &mesh){
+        RenderObject &obj = retained.objects.at(id);
+        if(mesh.vertices.size() == obj.vertexCount && mesh.triangles.size() == obj.triangleCount){
+            // 大小没变就原地覆盖
+            obj.meshlets = mesh.meshlets;
+            obj.meshletMask.clear();
+            obj.bounds = meshBounds(mesh);
+            obj.quant = quantizeVertices(mesh.vertices, retained.vertices.data() + obj.vertexBegin);
+            for(auto [i, t]: enumerate(mesh.triangles)){
+                Triangle &curr = triangles[obj.triangleBegin + i];
+                curr = t;
+                curr.materialID = mesh.materialID;
+                curr.vid[0] += obj.vertexBegin;
+                curr.vid[1] += obj.vertexBegin;
+                curr.vid[2] += obj.vertexBegin;
+            }
+            return;
+        }
+        editResident([&]{
+            releaseSlice(obj);
+            if(retained.garbageTriangles * 2 > retained.residentTriangles) compactResident();
+            allocateSlice(obj, mesh);
+        });
+    }
+
+    void destroyRenderObject(RenderObjectID id){
+        RenderObject &obj = retained.objects.at(id);
+        if(!obj.alive) return;
+        editResident([&]{
+            releaseSlice(obj);
+            obj.alive = false;
+            retained.freeIDs.push_back(id);
+            if(retained.garbageTriangles * 2 > retained.residentTriangles) compactResident();
+        });
+    }
+
+    void setRenderObjectVisible(RenderObjectID id, bool visible){
+        retained.objects.at(id).visible = visible;
+    }
+    void setRenderObjectCulled(RenderObjectID id, bool culled){
+        retained.objects.at(id).culled = culled;
+    }
+
+    void setRenderObjectMeshletMask(RenderObjectID id, const std::vector<uint8_t> &visible){
+        RenderObject &obj = retained.objects.at(id);
+        obj.meshletMask = visible;
+        if(obj.meshletMask.size() != obj.meshlets.size()) obj.meshletMask.clear();
+    }
+
+    void setRenderObjectOccluder(RenderObjectID id, bool occluder, const Mesh *proxy){
+        RenderObject &obj = retained.objects.at(id);
+        obj.occluder = occluder;
+        obj.occluderProxy.clear();
+        if(!occluder || proxy == nullptr) return;
+        for(const Triangle &t: proxy->triangles)
+            for(uint vid: t.vid) obj.occluderProxy.push_back(proxy->vertices[vid].pos);
+    }
+
+    void setOcclusionCulling(bool enable){
+        occlusionCulling = enable;
+    }
+
+    // 速率变了缓存的颜色就对不上了
+    void setShadingRate(const ShadingRatePolicy &policy){
+        shadingRate = policy;
+        scheduler.invalidateTiles();
+        resolvedWidth = resolvedHeight = 0;
+    }
+    void setIncrementalRendering(bool enable){
+        scheduler.incremental = enable;
+        scheduler.invalidateTiles();
+        resolvedWidth = resolvedHeight = 0;
+    }
+
+    void clearRenderBuffer(){
+        vertices.clear();
+        triangles.resize(retained.residentTriangles);
+        instanceBatches.clear();
+    }
+
+    void submitInstances(uint meshID, const std::vector<InstanceData> &instances){
+        if(instances.empty()) return;
+        assetManager.getCompactMesh(meshID);
+        instanceBatches.push_back({meshID, instances});
+    }
+
+    void submitMesh(const Mesh &mesh){
+        uint n = retained.residentVertices + vertices.size();
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        appendTriangles(mesh, n);
+    }
+};
+
+static FrameTarget bufferTarget(const CameraInfo &camera, uint *buffer){
+    int w = camera.pixelWidth(), h = camera.pixelHeight();
+    return {buffer, w, h, w};
 }
 
-void clearRenderBuffer(){
-    vertices.clear();
-    triangles.clear();
+Renderer::Renderer():impl(make_unique<Impl>()){}
+
+Renderer::~Renderer() = default;
+
+void Renderer::clearRenderBuffer(){
+    impl->clearRenderBuffer();
+}
+
+void Renderer::submitMesh(const Mesh &mesh){
+    impl->submitMesh(mesh);
+}
+
+void Renderer::submitInstances(uint meshID, const std::vector<InstanceData> &instances){
+    impl->submitInstances(meshID, instances);
+}
+
+RenderObjectID Renderer::createRenderObject(const Mesh &mesh){
+    return impl->createRenderObject(mesh);
+}
+
+void Renderer::updateRenderObject(RenderObjectID id, const Mesh &mesh){
+    impl->updateRenderObject(id, mesh);
+}
+
+void Renderer::destroyRenderObject(RenderObjectID id){
+    impl->destroyRenderObject(id);
+}
+
+void Renderer::setRenderObjectVisible(RenderObjectID id, bool visible){
+    impl->setRenderObjectVisible(id, visible);
+}
+
+void Renderer::setRenderObjectCulled(RenderObjectID id, bool culled){
+    impl->setRenderObjectCulled(id, culled);
+}
+
+void Renderer::setRenderObjectMeshletMask(RenderObjectID id, const std::vector<uint8_t> &visible){
+    impl->setRenderObjectMeshletMask(id, visible);
+}
+
+void Renderer::setRenderObjectOccluder(RenderObjectID id, bool occluder, const Mesh *proxy){
+    impl->setRenderObjectOccluder(id, occluder, proxy);
+}
+
+void Renderer::setOcclusionCulling(bool enable){
+    impl->setOcclusionCulling(enable);
+}
+
+void Renderer::setIncrementalRendering(bool enable){
+    impl->setIncrementalRendering(enable);
+}
+
+void Renderer::setShadingRate(const ShadingRatePolicy &policy){
+    impl->setShadingRate(policy);
+}
+
+void Renderer::drawFrame(const CameraInfo &camera, const FrameTarget &target){
+    lock_guard<mutex> lock(impl->frameMutex);
+    impl->drawFrame(camera, target, false);
+}
+
+void Renderer::drawFrame(const CameraInfo &camera, uint *buffer){
+    drawFrame(camera, bufferTarget(camera, buffer));
+}
+
+void Renderer::drawViews(const std::vector<FrameView> &views){
+    if(views.empty()) return;
+    lock_guard<mutex> lock(impl->frameMutex);
+    impl->drawViews(views);
+}
+
+FrameHandle Renderer::drawFrameAsync(const CameraInfo &camera, const FrameTarget &target, std::function<void(FrameHandle::Status)> onComplete){
+    auto state = std::make_shared<FrameHandle::State>();
+    state->camera = camera;
+    state->target = target;
+    state->onComplete = std::move(onComplete);
+    impl->asyncRunner.submit(state);
+    return FrameHandle(state);
+}
+
+FrameHandle Renderer::drawFrameAsync(const CameraInfo &camera, uint *buffer, std::function<void(FrameHandle::Status)> onComplete){
+    return drawFrameAsync(camera, bufferTarget(camera, buffer), std::move(onComplete));
+}
+
+const FrameStat &Renderer::stats() const{
+    return impl->frameStat;
+}
+
+Renderer &defaultRenderer(){
+    static Renderer renderer;
+    return renderer;
+}
 
+void clearRenderBuffer(){
+    defaultRenderer().clearRenderBuffer();
 }
 
 void submitMesh(const Mesh &mesh){
-    uint n = vertices.size();
-    for(const Vertex &v:mesh.vertices){
-        vertices.push_back(v);
-    }
-    for(const Triangle &t:mesh.triangles){
-        triangles.push_back(t);
-        Triangle &curr = triangles.back();
+    defaultRenderer().submitMesh(mesh);
+}
+
+void submitInstances(uint meshID, const std::vector<InstanceData> &instances){
+    defaultRenderer().submitInstances(meshID, instances);
+}
+
+RenderObjectID createRenderObject(const Mesh &mesh){
+    return defaultRenderer().createRenderObject(mesh);
+}
+
+void updateRenderObject(RenderObjectID id, const Mesh &mesh){
+    defaultRenderer().updateRenderObject(id, mesh);
+}
+
+void destroyRenderObject(RenderObjectID id){
+    defaultRenderer().destroyRenderObject(id);
+}
+
+void setRenderObjectVisible(RenderObjectID id, bool visible){
+    defaultRenderer().setRenderObjectVisible(id, visible);
+}
+
+void setRenderObjectCulled(RenderObjectID id, bool culled){
+    defaultRenderer().setRenderObjectCulled(id, culled);
+}
 
-        curr.materialID = mesh.materialID;
-        // curr.shaderConfig = mesh.shaderConfig;
-        curr.vid[0] += n;
-        curr.vid[1] += n;
-        curr.vid[2] += n;
+void setRenderObjectMeshletMask(RenderObjectID id, const std::vector<uint8_t> &visible){
+    defaultRenderer().setRenderObjectMeshletMask(id, visible);
+}
+
+void setRenderObjectOccluder(RenderObjectID id, bool occluder, const Mesh *proxy){
+    defaultRenderer().setRenderObjectOccluder(id, occluder, proxy);
+}
+
+void setOcclusionCulling(bool enable){
+    defaultRenderer().setOcclusionCulling(enable);
+}
+
+void setIncrementalRendering(bool enable){
+    defaultRenderer().setIncrementalRendering(enable);
+}
+
+void setShadingRate(const ShadingRatePolicy &policy){
+    defaultRenderer().setShadingRate(policy);
+}
+
+void drawFrame(const CameraInfo &camera, const FrameTarget &target){
+    defaultRenderer().drawFrame(camera, target);
+}
+
+void drawFrame(const CameraInfo &camera, uint *buffer){
+    defaultRenderer().drawFrame(camera, buffer);
+}
+
+void drawViews(const std::vector<FrameView> &views){
+    defaultRenderer().drawViews(views);
+}
+
+FrameHandle drawFrameAsync(const CameraInfo &camera, const FrameTarget &target, std::function<void(FrameHandle::Status)> onComplete){
+    return defaultRenderer().drawFrameAsync(camera, target, std::move(onComplete));
+}
+
+FrameHandle drawFrameAsync(const CameraInfo &camera, uint *buffer, std::function<void(FrameHandle::Status)> onComplete){
+    return defaultRenderer().drawFrameAsync(camera, buffer, std::move(onComplete));
+}
+
+void DynamicResolution::addFrame(float frameTime){
+    if(frameTime <= 0.0f) return;
+    float estimate = frameTime / (current * current);
+    fullResTime = fullResTime > 0.0f ? 0.8f * fullResTime + 0.2f * estimate : estimate;
+    float predicted = fullResTime * current * current;
+    // 调整的目标放在 [headroom, 1] 倍目标时间的中间，调完之后落在不动的区间里
+    float ideal = sqrt(targetFrameTime * (1.0f + headroom) / 2 / fullResTime);
+    float next = current;
+    if(predicted > targetFrameTime) next = ideal;
+    else if(predicted < targetFrameTime * headroom) next = min(ideal, current + 1.0f / 16);
+    current = clamp(floor(next * 64) / 64, minScale, maxScale);
+}
+
+void DynamicResolution::reset(){
+    current = maxScale;
+    fullResTime = 0.0f;
+}
+
+vector<CameraInfo> cubeMapCameras(const Vec3 &pos, uint faceTiles){
+    // 依次是 +X -X +Y -Y +Z -Z 面的 (axisX, axisY, axisZ)
+    static const Vec3 axes[6][3] = {
+        {{0, 0, -1}, {0, -1, 0}, {1, 0, 0}},
+        {{0, 0, 1},  {0, -1, 0}, {-1, 0, 0}},
+        {{1, 0, 0},  {0, 0, 1},  {0, 1, 0}},
+        {{1, 0, 0},  {0, 0, -1}, {0, -1, 0}},
+        {{1, 0, 0},  {0, -1, 0}, {0, 0, 1}},
+        {{-1, 0, 0}, {0, -1, 0}, {0, 0, -1}},
+    };
+    vector<CameraInfo> ret(6);
+    for(int i = 0; i < 6; i++){
+        CameraInfo &cam = ret[i];
+        cam.pos = pos;
+        cam.width = cam.height = faceTiles;
+        // 90 度视角：屏幕半宽等于焦距
+        cam.focalLength = 1.0f;
+        cam.screenSize = {2.0f, 2.0f, 0.0f};
+        cam.frame.axisX = axes[i][0];
+        cam.frame.axisY = axes[i][1];
+        cam.frame.axisZ = axes[i][2];
     }
+    return ret;
+}
+
+void setRenderThreadCount(int n){
+    taskDispatcher.resize(n);
+}
+
+int renderThreadCount(){
+    return taskDispatcher.threadCount();
+}
+
+void setRenderThreadPinned(bool pinned){
+    taskDispatcher.setPinned(pinned);
 }
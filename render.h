@@ -2,14 +2,191 @@
 #define RENDER_H
 
 #include "structures.h"
+#include <functional>
+#include <memory>
+#include <chrono>
 
 const bool showStatistics = true;
 
-void clearRenderBuffer();
+using RenderObjectID = uint;
+const RenderObjectID invalidRenderObject = -1u;
 
-void submitMesh(const Mesh &mesh);
+// 实例化：同一个网格（assetManager 里的 meshID）画很多份，每份只有变换和材质。
+// 网格本身不复制，变换在渲染的顶点阶段做，整个实例在视锥外时直接跳过。只画这一帧
+struct InstanceData{
+    Transform transform;
+    float scale = 1.0f;
+    ushort materialID = 0xffff;     // 0xffff 表示用网格自己的材质
+};
+
+// 渲染分辨率和输出表面不一样大时的缩放方式。
+// Nearest 在 tile 写回颜色时顺带缩放；Bilinear 先写进渲染器自己的渲染分辨率缓冲，整帧画完再双线性放大到表面
+enum class ScaleFilter{ Nearest, Bilinear };
+
+// 输出表面。尺寸和渲染分辨率（camera.pixelWidth/pixelHeight）不一样时按 filter 缩放过去，
+// 不用调用方再另外缩放、拷贝一遍。stride 是一行的 uint 个数
+struct FrameTarget{
+    uint *pixels = nullptr;
+    int width = 0, height = 0;
+    int stride = 0;
+    ScaleFilter filter = ScaleFilter::Nearest;
+};
+
+// 可变速率着色：tile 按 8x8 的块选着色速率（1x1、2x2 或 4x4 像素着色一次），样本广播给同一格里属于同一个三角形的像素，
+// 别的三角形的像素（边缘）还是逐像素着色，深度和三角形归属始终是逐像素的。
+// 一个块取下面几条里最粗的速率
+struct ShadingRatePolicy{
+    bool enabled = false;
+    // 纹理被放大、一个像素不到这么多纹素时（块里取最大的），整块按 2x2 / 4x4 着色
+    float texelSpan2 = 0.5f, texelSpan4 = 0.25f;
+    // 块中心离画面中心的距离（画面角上为 1）超过它时按 2x2 / 4x4，大于 1 表示不用
+    float periphery2 = 2.0f, periphery4 = 2.0f;
+    // 块里所有像素都比这更远（沿视线方向）时至少 2x2，0 表示不用
+    float farDistance = 0.0f;
+};
+
+// 多视图里的一个视图
+struct FrameView{
+    CameraInfo camera;
+    FrameTarget target;
+};
+
+// 异步提交的一帧。渲染在后台线程上进行，完成之前不能改动已提交的几何（clearRenderBuffer/submitMesh）和输出表面
+class FrameHandle{
+public:
+    // Unchanged：增量渲染下没有任何 tile 变化，输出表面也和上一帧一样大。这时表面没有写，上一帧的画面可以直接沿用
+    enum Status{ Pending, Running, Finished, Cancelled, Failed, Unchanged };
+
+    FrameHandle() = default;
+    bool valid() const{ return state != nullptr; }
+    Status status() const;
+    // Finished / Cancelled / Failed / Unchanged 都算结束
+    bool ready() const;
+    void wait() const;
+    bool waitFor(std::chrono::microseconds timeout) const;
+    // 还没开始的帧直接丢弃；正在画的帧会在下一个阶段边界停下，buffer 内容不完整
+    void cancel() const;
+
+    struct State;
+private:
+    std::shared_ptr<State> state;
+    explicit FrameHandle(std::shared_ptr<State> s):state(std::move(s)){}
+    friend class Renderer;
+};
+
+// 一个独立的渲染器：自己的几何、实例、遮挡图、tile 缓存、统计和异步渲染线程。
+// 不同实例之间没有共享的可变状态，可以在不同线程上同时画；它们共用一个线程池（任务按批排队）和只读的 assetManager。
+// 同一个实例的调用不能交错，除了异步帧本身
+class Renderer{
+public:
+    Renderer();
+    ~Renderer();
+    Renderer(const Renderer&) = delete;
+    Renderer &operator=(const Renderer&) = delete;
+
+    // 清掉上一帧用 submitMesh 提交的临时几何，常驻几何不受影响
+    void clearRenderBuffer();
+    // 临时几何，只画这一帧
+    void submitMesh(const Mesh &mesh);
+    void submitInstances(uint meshID, const std::vector<InstanceData> &instances);
+
+    // 常驻几何：注册一次，之后只有网格或变换变化时才需要 update。
+    // 这些调用都要在两帧之间进行；同一帧里的 submitMesh 会被保留。
+    // 顶点按每个对象自己的包围盒量化成 16 位存放（CompactVertex），精度是对象尺寸的 1/65535
+    RenderObjectID createRenderObject(const Mesh &mesh);
+    void updateRenderObject(RenderObjectID id, const Mesh &mesh);
+    void destroyRenderObject(RenderObjectID id);
+    void setRenderObjectVisible(RenderObjectID id, bool visible);
+    // 调用方按自己的相机剔掉的对象（比如场景 BVH 判断在视锥外）。和 setRenderObjectVisible 分开：
+    // drawFrame 两个都看，drawViews 的视角不一样，只看 visible，对象另外按所有视锥的并集剔除
+    void setRenderObjectCulled(RenderObjectID id, bool culled);
+    // 按 meshlet 屏蔽对象的一部分（比如 PVS 查出来看不到的），visible[i] 为 0 的 meshlet 不画。
+    // 传空表示全部可见；对象的网格更新后要重新设置。和 culled 一样只对调用方自己的相机有效，drawViews 不用它
+    void setRenderObjectMeshletMask(RenderObjectID id, const std::vector<uint8_t> &visible);
+
+    // 遮挡剔除：标记为遮挡体的对象每帧先画进一张低分辨率深度图，
+    // 其它常驻对象、meshlet 和实例整个被挡住时就不再裁剪和投影。
+    // proxy 是可选的简化遮挡网格（世界坐标），应当整个落在原网格内部；不给就用对象自己的三角形
+    void setRenderObjectOccluder(RenderObjectID id, bool occluder, const Mesh *proxy = nullptr);
+    void setOcclusionCulling(bool enable);
+
+    // 增量渲染：每个 tile 记下上一帧落在它上面的 fragment 的签名（投影后的边方程、插值系数、材质），
+    // 签名没变的 tile 不再光栅化，直接把缓存的颜色写回输出表面。相机或物体动了投影就会变，受影响的 tile 自然变脏。
+    // 贴图内容的变化看 AssetManager::materialVersion，一变就全部重画
+    void setIncrementalRendering(bool enable);
+    void setShadingRate(const ShadingRatePolicy &policy);
 
+    void drawFrame(const CameraInfo &camera, const FrameTarget &target);
+    // buffer 是渲染分辨率大小的连续缓冲
+    void drawFrame(const CameraInfo &camera, uint *buffer);
+
+    // 多视图：同一份场景从几个相机画出来（分屏、小地图、立方体贴图的六个面），一个接一个画完才返回。
+    // 实例展开到世界坐标和常驻对象的可见性只做一次，都按所有视锥的并集剔除，不用 setRenderObjectCulled 和 meshlet 屏蔽表；
+    // 每个视图再各自做 meshlet 视锥剔除、遮挡、frontClip、投影和 tile 光栅化，这些阶段都在同一个线程池上并行。
+    // 遮挡剔除只作用于常驻对象
+    void drawViews(const std::vector<FrameView> &views);
+
+    // 回调在渲染线程上执行，跑完之后帧才算结束（wait 才返回）。一次只画一帧：新提交的帧会顶掉还在排队、没开始画的旧帧（旧帧状态变为 Cancelled）
+    FrameHandle drawFrameAsync(const CameraInfo &camera, const FrameTarget &target, std::function<void(FrameHandle::Status)> onComplete = {});
+    FrameHandle drawFrameAsync(const CameraInfo &camera, uint *buffer, std::function<void(FrameHandle::Status)> onComplete = {});
+
+    // 最近一帧的统计，帧率是最近 100 帧的平均
+    const FrameStat &stats() const;
+
+    struct Impl;
+private:
+    std::unique_ptr<Impl> impl;
+};
+
+// 动态分辨率：按最近几帧的渲染耗时调 CameraInfo::resolutionScale，让帧时间贴近 targetFrameTime。
+// 耗时换算成全分辨率下的估计值再平均，分辨率变了也不用从头统计；像素数和比例的平方成正比，
+// 超出目标时马上降，低于目标的 headroom 倍时才慢慢升，比例按 1/64 取整，免得每帧都换分辨率（换了增量渲染的缓存就作废了）
+class DynamicResolution{
+public:
+    float targetFrameTime = 16667.0f;   // 微秒
+    float minScale = 0.5f, maxScale = 1.0f;
+    float headroom = 0.8f;
+
+    float scale() const{ return current; }
+    // 只传真正画过的帧（Finished），Unchanged 的帧几乎不花时间，会把估计拉偏
+    void addFrame(float frameTime);
+    void reset();
+
+private:
+    float current = 1.0f;
+    float fullResTime = 0.0f;   // 全分辨率下一帧的估计耗时，0 表示还没有数据
+};
+
+// 进程里默认的那个渲染器，下面的自由函数都作用在它上面
+Renderer &defaultRenderer();
+
+void clearRenderBuffer();
+void submitMesh(const Mesh &mesh);
+void submitInstances(uint meshID, const std::vector<InstanceData> &instances);
+RenderObjectID createRenderObject(const Mesh &mesh);
+void updateRenderObject(RenderObjectID id, const Mesh &mesh);
+void destroyRenderObject(RenderObjectID id);
+void setRenderObjectVisible(RenderObjectID id, bool visible);
+void setRenderObjectCulled(RenderObjectID id, bool culled);
+void setRenderObjectMeshletMask(RenderObjectID id, const std::vector<uint8_t> &visible);
+void setRenderObjectOccluder(RenderObjectID id, bool occluder, const Mesh *proxy = nullptr);
+void setOcclusionCulling(bool enable);
+void setIncrementalRendering(bool enable);
+void setShadingRate(const ShadingRatePolicy &policy);
+void drawFrame(const CameraInfo &camera, const FrameTarget &target);
 void drawFrame(const CameraInfo &camera, uint *buffer);
+void drawViews(const std::vector<FrameView> &views);
+FrameHandle drawFrameAsync(const CameraInfo &camera, const FrameTarget &target, std::function<void(FrameHandle::Status)> onComplete = {});
+FrameHandle drawFrameAsync(const CameraInfo &camera, uint *buffer, std::function<void(FrameHandle::Status)> onComplete = {});
+
+// 以 pos 为中心的立方体贴图六个面的相机，面的顺序和朝向同 OpenGL（+X -X +Y -Y +Z -Z，图像 y 向下），
+// 每个面 faceTiles x faceTiles 个 tile
+std::vector<CameraInfo> cubeMapCameras(const Vec3 &pos, uint faceTiles);
+
+// 渲染线程池设置，所有 Renderer 共用。只能在所有实例都不在画的时候调用
+void setRenderThreadCount(int n);
+int renderThreadCount();
+void setRenderThreadPinned(bool pinned);
 
 
 #endif // RENDER_H
@@ -0,0 +1,146 @@
+#include "scenebvh.h"
+#include "gameobject.h"
+#include <algorithm>
+
+using namespace std;
+
+BBox3D actorBounds(const MeshActor *actor){
+    const BoundingSphere &b = components<MeshActor>().columns().bounds[actor->componentIndex()];
+    Vec3 r = {b.radius, b.radius, b.radius};
+    return BBox3D({b.center - r, b.center + r});
+}
+
+static float boxArea(const BBox3D &box){
+    float dx = box.x2 - box.x1, dy = box.y2 - box.y1, dz = box.z2 - box.z1;
+    if(dx < 0 || dy < 0 || dz < 0) return 0.0f;
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+// 0 完全在外面，1 和边界相交，2 完全在里面
+static int classifyBox(const Frustum &frustum, const BBox3D &box){
+    int result = 2;
+    for(const Plane &p: frustum.planes){
+        // 沿法线方向最靠里/最靠外的两个角
+        Vec3 inner = {p.normal.x >= 0 ? box.x2 : box.x1, p.normal.y >= 0 ? box.y2 : box.y1, p.normal.z >= 0 ? box.z2 : box.z1};
+        Vec3 outer = {p.normal.x >= 0 ? box.x1 : box.x2, p.normal.y >= 0 ? box.y1 : box.y2, p.normal.z >= 0 ? box.z1 : box.z2};
+        if((inner - p.point).dot(p.normal) < 0) return 0;
+        if((outer - p.point).dot(p.normal) < 0) result = 1;
+    }
+    return result;
+}
+
+void ActorBVH::clear(){
+    nodes.clear();
+    leafOf.clear();
+    movedLeaves.clear();
+    builtArea = currentArea = 0.0f;
+}
+
+void ActorBVH::build(const vector<MeshActor*> &actors){
+    clear();
+    if(actors.empty()) return;
+    vector<pair<BBox3D, MeshActor*>> items;
+    items.reserve(actors.size());
+    for(MeshActor *actor: actors) items.push_back({actorBounds(actor), actor});
+    nodes.reserve(actors.size() * 2);
+    buildRecursive(items, 0, items.size(), -1);
+    builtArea = currentArea = totalArea();
+}
+
+// 按包围盒中心最长的轴从中间切开
+int ActorBVH::buildRecursive(vector<pair<BBox3D, MeshActor*>> &items, int begin, int end, int parent){
+    int id = nodes.size();
+    nodes.push_back({});
+    nodes[id].parent = parent;
+    if(end - begin == 1){
+        nodes[id].box = items[begin].first;
+        nodes[id].actor = items[begin].second;
+        leafOf[items[begin].second] = id;
+        return id;
+    }
+    BBox3D centers;
+    for(int i = begin; i < end; i++){
+        const BBox3D &b = items[i].first;
+        Vec3 c = {(b.x1 + b.x2) / 2, (b.y1 + b.y2) / 2, (b.z1 + b.z2) / 2};
+        centers = centers.merge(BBox3D({c}));
+    }
+    float dx = centers.x2 - centers.x1, dy = centers.y2 - centers.y1, dz = centers.z2 - centers.z1;
+    auto key = [axis = (dx >= dy && dx >= dz) ? 0 : (dy >= dz ? 1 : 2)](const pair<BBox3D, MeshActor*> &item){
+        const BBox3D &b = item.first;
+        return axis == 0 ? b.x1 + b.x2 : axis == 1 ? b.y1 + b.y2 : b.z1 + b.z2;
+    };
+    int mid = (begin + end) / 2;
+    nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                [&](const auto &a, const auto &b){return key(a) < key(b);});
+    int left = buildRecursive(items, begin, mid, id);
+    int right = buildRecursive(items, mid, end, id);
+    nodes[id].left = left;
+    nodes[id].right = right;
+    nodes[id].box = nodes[left].box.merge(nodes[right].box);
+    return id;
+}
+
+bool ActorBVH::contains(const MeshActor *actor) const{
+    return leafOf.count(actor);
+}
+
+void ActorBVH::markMoved(const MeshActor *actor){
+    auto it = leafOf.find(actor);
+    if(it != leafOf.end()) movedLeaves.push_back(it->second);
+}
+
+void ActorBVH::refit(){
+    for(int leaf: movedLeaves){
+        BBox3D box = actorBounds(nodes[leaf].actor);
+        currentArea += boxArea(box) - boxArea(nodes[leaf].box);
+        nodes[leaf].box = box;
+        // 往上合并，父节点的盒子没变就可以停了
+        for(int id = nodes[leaf].parent; id != -1; id = nodes[id].parent){
+            BBox3D box = nodes[nodes[id].left].box.merge(nodes[nodes[id].right].box);
+            const BBox3D &old = nodes[id].box;
+            if(box.x1 == old.x1 && box.x2 == old.x2 && box.y1 == old.y1 && box.y2 == old.y2 && box.z1 == old.z1 && box.z2 == old.z2) break;
+            currentArea += boxArea(box) - boxArea(old);
+            nodes[id].box = box;
+        }
+    }
+    movedLeaves.clear();
+}
+
+float ActorBVH::totalArea() const{
+    float sum = 0.0f;
+    for(const Node &node: nodes) sum += boxArea(node.box);
+    return sum;
+}
+
+bool ActorBVH::degraded() const{
+    return nodes.size() > 1 && currentArea > builtArea * 2.0f;
+}
+
+void ActorBVH::collect(int node, vector<MeshActor*> &visible) const{
+    if(nodes[node].actor != nullptr){
+        visible.push_back(nodes[node].actor);
+        return;
+    }
+    collect(nodes[node].left, visible);
+    collect(nodes[node].right, visible);
+}
+
+void ActorBVH::query(const Frustum &frustum, vector<MeshActor*> &visible) const{
+    if(nodes.empty()) return;
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while(top){
+        int id = stack[--top];
+        const Node &node = nodes[id];
+        int c = classifyBox(frustum, node.box);
+        if(c == 0) continue;
+        // 整个盒子都在视锥里，子树不用再测
+        if(c == 2 || node.actor != nullptr){
+            collect(id, visible);
+            continue;
+        }
+        stack[top++] = node.left;
+        stack[top++] = node.right;
+    }
+}
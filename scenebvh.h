@@ -0,0 +1,46 @@
+#ifndef SCENEBVH_H
+#define SCENEBVH_H
+
+#include "raytest.h"
+#include <vector>
+#include <unordered_map>
+
+class MeshActor;
+
+// MeshActor 世界包围盒上的 BVH，渲染提交前用视锥整棵子树地剔除。
+// 每个叶子一个对象；对象移动后 markMoved，refit 只沿着被标记的叶子往上更新
+class ActorBVH{
+public:
+    void build(const std::vector<MeshActor*> &actors);
+    void clear();
+    bool contains(const MeshActor *actor) const;
+    uint size() const{ return leafOf.size(); }
+
+    void markMoved(const MeshActor *actor);
+    void refit();
+    // refit 多了以后树会变松，包围盒总表面积比刚建好时大太多就该重建了
+    bool degraded() const;
+
+    // 视锥内（可能可见）的对象追加到 visible
+    void query(const Frustum &frustum, std::vector<MeshActor*> &visible) const;
+
+private:
+    struct Node{
+        BBox3D box;
+        int left = -1, right = -1;      // 叶子两个都是 -1
+        int parent = -1;
+        MeshActor *actor = nullptr;
+    };
+    std::vector<Node> nodes;
+    std::unordered_map<const MeshActor*, int> leafOf;
+    std::vector<int> movedLeaves;
+    float builtArea = 0.0f, currentArea = 0.0f;     // 所有节点包围盒的表面积之和，refit 时增量维护
+
+    int buildRecursive(std::vector<std::pair<BBox3D, MeshActor*>> &items, int begin, int end, int parent);
+    float totalArea() const;
+    void collect(int node, std::vector<MeshActor*> &visible) const;
+};
+
+BBox3D actorBounds(const MeshActor *actor);
+
+#endif // SCENEBVH_H
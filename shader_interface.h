@@ -6,13 +6,14 @@
 
 template<typename T> concept IsShader = requires(const EdgeIterator &edgeIt, const Iterator2D &zInv, const Iterator2D &u_z, const Iterator2D &v_z){
     {T::alphaTest(uint(), edgeIt, zInv, u_z, v_z)} -> std::same_as<bool>;
-} && requires(float u, float v, float d, uint triangleID, Vec3 viewDirection){
-    {T::colorSample(u, v, triangleID, viewDirection, d)} -> std::same_as<uint>;
+} && requires(const RenderContext &ctx, float u, float v, float d, uint triangleID, Vec3 viewDirection){
+    {T::colorSample(ctx, u, v, triangleID, viewDirection, d)} -> std::same_as<uint>;
 };
 
 // 所有涉及部分透明面片的逻辑在这里实现，包括线框渲染，单片草之类的
 template<typename FragmentShader>
-    requires IsShader<FragmentShader> void segmentRasterization(const Fragment &frag, int pixelW, int pixelH){
+    requires IsShader<FragmentShader> void segmentRasterization(RenderContext &ctx, const Fragment &frag){
+    ShadingBuffer &shadingBuffer = *ctx.shadingBuffer;
 
     EdgeIterator edgeIt = frag.edgeIterator;
     Iterator2D zInv = frag.zInv;
@@ -46,7 +47,7 @@ template<typename FragmentShader>
                     shadingBuffer.zInv[y][x] = tempZInv.val;
                     shadingBuffer.u_z[y][x] = tempUZ.val;
                     shadingBuffer.v_z[y][x] = tempVZ.val;
-                    shadingBuffer.materialID[y][x] = ShaderInternal::triangles[frag.triangleID].materialID;
+                    shadingBuffer.materialID[y][x] = ctx.triangles[frag.triangleID].materialID;
                 }
             }else if(passFlag)break;
 
@@ -84,10 +85,11 @@ std::tuple<bool, float, float> inline yTest(Vec3 p0, Vec3 p1, float y){
     return {true, p0.x + k *(p1.x-p0.x), y};
 }
 
-std::tuple<bool, int, int, int, int> inline getTiledBBox(const Fragment &frag, int xmin, int xmax, int ymin, int ymax){
-    Vec3 p0 = ShaderInternal::projectedVertices[ShaderInternal::triangles[frag.triangleID].vid[0]].pos;
-    Vec3 p1 = ShaderInternal::projectedVertices[ShaderInternal::triangles[frag.triangleID].vid[1]].pos;
-    Vec3 p2 = ShaderInternal::projectedVertices[ShaderInternal::triangles[frag.triangleID].vid[2]].pos;
+std::tuple<bool, int, int, int, int> inline getTiledBBox(const RenderContext &ctx, const Fragment &frag, int xmin, int xmax, int ymin, int ymax){
+    const Triangle &t = ctx.triangles[frag.triangleID];
+    Vec3 p0 = ctx.projectedVertices[t.vid[0]].pos;
+    Vec3 p1 = ctx.projectedVertices[t.vid[1]].pos;
+    Vec3 p2 = ctx.projectedVertices[t.vid[2]].pos;
     p0.z = 0;
     p1.z = 0;
     p2.z = 0;
@@ -126,7 +128,7 @@ std::tuple<bool, int, int, int, int> inline getTiledBBox(const Fragment &frag, i
 
 }
 template<typename FragmentShader>
-    requires IsShader<FragmentShader> void tileRasterization(const Fragment &frag,Tile& __restrict tile, int tileLevelResult){
+    requires IsShader<FragmentShader> void tileRasterization(const RenderContext &ctx, const Fragment &frag,Tile& __restrict tile, TileRegion &region, int tileLevelResult, WorkerCounters &stat){
 
     if(tileLevelResult == TileLevelResult::OUTER) return;
 
@@ -135,10 +137,10 @@ template<typename FragmentShader>
     Iterator2D u_z = frag.u_z;
     Iterator2D v_z = frag.v_z;
 
-    int tileXmin = tile.tileX * tileSize;
-    int tileXmax = tile.tileX * tileSize + tileSize-1;
-    int tileYmin = tile.tileY * tileSize;
-    int tileYmax = tile.tileY * tileSize + tileSize-1;
+    int tileXmin = region.xmin;
+    int tileXmax = region.xmax;
+    int tileYmin = region.ymin;
+    int tileYmax = region.ymax;
 
     int xlt = std::max(frag.xlt, tileXmin);
     int xrb = std::min(frag.xrb, tileXmax);
@@ -146,7 +148,7 @@ template<typename FragmentShader>
     int yrb = std::min(frag.yrb, tileYmax);
 
     if((frag.xrb-frag.xlt+1)*(frag.yrb-frag.ylt+1) > 4096){
-        auto [flag, precXlt, precYlt, precXrb, precYrb] = getTiledBBox(frag, tileXmin, tileXmax, tileYmin, tileYmax);
+        auto [flag, precXlt, precYlt, precXrb, precYrb] = getTiledBBox(ctx, frag, tileXmin, tileXmax, tileYmin, tileYmax);
         if(flag){
             xlt = std::max(xlt, precXlt);
             ylt = std::max(ylt, precYlt);
@@ -158,9 +160,13 @@ template<typename FragmentShader>
                                       xrb*zInv.dv_dx+ylt*zInv.dv_dy,
                                       xlt*zInv.dv_dx+yrb*zInv.dv_dy,
                                       xrb*zInv.dv_dx+yrb*zInv.dv_dy});
-    if(zMax < tile.zInvMin && tile.cpCount == tileSize*tileSize) return;
+    if(zMax < region.zInvMin && region.cpCount == region.area()){
+        stat.depthRejected ++;
+        return;
+    }
 
-    frameStat.pixelIterated += (xrb-xlt+1)*(yrb-ylt+1);
+    stat.pixelIterated += (xrb-xlt+1)*(yrb-ylt+1);
+    uint written = 0;
 
     edgeIt.batchIterate(xlt, ylt);
     zInv.batchIterate(xlt, ylt);
@@ -188,10 +194,11 @@ template<typename FragmentShader>
                     // passFlag = true;
                     if(!tile.vis[y][x]){
                         tile.vis[y][x] = true;
-                        tile.cpCount ++;
-                        tile.zInvMin = std::min(tile.zInvMin, tempZInv.val);
+                        region.cpCount ++;
+                        region.zInvMin = std::min(region.zInvMin, tempZInv.val);
                     }
                     // tile.zInvMin = min(tile.zInvMin, tempZInv.val);
+                    written ++;
                     tile.triangleID[y][x] = frag.triangleID;
                     tile.zInv[y][x] = tempZInv.val;
                     tile.u_z[y][x] = tempUZ.val;
@@ -212,12 +219,13 @@ template<typename FragmentShader>
         v_z.yIterate();
 
     }
+    stat.pixelWritten += written;
 }
 
 
 template<typename FragmentShader>
-    requires IsShader<FragmentShader> uint colorDetermination(float u, float v, uint triangleID, const Vec3 &view, float d=0.0f){
-    return FragmentShader::colorSample(u, v, triangleID, view, d);
+    requires IsShader<FragmentShader> uint colorDetermination(const RenderContext &ctx, float u, float v, uint triangleID, const Vec3 &view, float d=0.0f){
+    return FragmentShader::colorSample(ctx, u, v, triangleID, view, d);
 }
 
 #endif // SHADER_INTERFACE_H
@@ -3,18 +3,10 @@
 
 #include "structures.h"
 #include "assetmanager.h"
+#include "render.h"
 #include <QDebug>
-
-namespace ShaderInternal{
-    extern std::vector<Vertex> vertices;
-    extern std::vector<Triangle> triangles;
-    extern CameraInfo camera;
-    extern uint *buffer;
-    extern uint pixelW, pixelH;
-    extern std::vector<Vertex> projectedVertices;
-    extern std::vector<Fragment> fragments;
-    extern std::vector<float> maxZInv;
-}
+#include <cstring>
+#include <memory>
 
 struct ShadingBuffer{
     constexpr static int W=1500, H=1500;
@@ -24,7 +16,54 @@ struct ShadingBuffer{
     float zInv[H][W], u_z[H][W], v_z[H][W];
 
 };
-extern ShadingBuffer shadingBuffer;
+
+// 一个 Renderer 实例一帧的工作数据。光栅化和着色器都通过它读三角形、投影结果和输出表面，
+// 不同实例之间互不相干，可以在不同线程上同时画
+struct RenderContext{
+    // triangles 是 [常驻几何 | 本帧 submitMesh 的临时几何 | 本帧 frontClip 切出来的]。
+    // 常驻顶点是紧凑格式，存在渲染器自己那里，占顶点编号的前缀；vertices 只放后面两部分，
+    // 编号 vid 对应 vertices[vid - 常驻顶点数]。projectedVertices 按完整的顶点编号排
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> triangles;
+    // 本帧不参与渲染的三角形：隐藏/已销毁的常驻对象、被 frontClip 整个丢掉或替换掉的
+    std::vector<uint8_t> triangleCulled;
+    CameraInfo camera;
+    FrameTarget target;
+    uint pixelW = 0, pixelH = 0;
+    // 渲染分辨率下第 x 列落在输出表面的 [targetX[x], targetX[x+1]) 列，行同理
+    std::vector<int> targetX, targetY;
+    bool targetScaled = false;
+    // (x, y, 4096.0f/z)
+    std::vector<Vertex> projectedVertices;
+    std::vector<Fragment> fragments;
+    std::vector<float> maxZInv;
+    // 逐像素光栅化（bfRasterization）用的整屏缓冲，很大，第一次用到时才分配
+    std::unique_ptr<ShadingBuffer> shadingBuffer;
+    // 当前帧被取消时置位，各阶段和 tile 任务开始前检查
+    const std::atomic<bool> *cancelFlag = nullptr;
+    ShadingRatePolicy shadingRate;
+
+    bool cancelled() const{
+        return cancelFlag != nullptr && cancelFlag->load(std::memory_order_relaxed);
+    }
+    // 渲染分辨率下第 y 行 [x0, x1] 的颜色写到输出表面。缩放时先展开第一行，其余行直接复制
+    void resolveSpan(int y, int x0, int x1, const uint *colors) const{
+        if(!targetScaled){
+            memcpy(target.pixels + (size_t)y * target.stride + x0, colors, sizeof(uint) * (x1 - x0 + 1));
+            return;
+        }
+        int oy0 = targetY[y], oy1 = targetY[y+1];
+        if(oy0 == oy1) return;
+        uint *row = target.pixels + (size_t)oy0 * target.stride;
+        for(int x = x0; x <= x1; x++){
+            uint c = colors[x - x0];
+            for(int ox = targetX[x]; ox < targetX[x+1]; ox++) row[ox] = c;
+        }
+        int ox0 = targetX[x0], n = targetX[x1+1] - ox0;
+        for(int oy = oy0 + 1; oy < oy1; oy++)
+            memcpy(target.pixels + (size_t)oy * target.stride + ox0, row + ox0, sizeof(uint) * n);
+    }
+};
 
 struct IntColorRef{
     int r, g, b;
@@ -84,9 +123,14 @@ public:
     bool static alphaTest(uint triangleID, const EdgeIterator &edgeIt, const Iterator2D &zInv, const Iterator2D &u_z, const Iterator2D &v_z){
         return edgeIt.check() == EdgeIterator::INNER;
     }
+    // 一个像素覆盖多少个第 0 级纹素，和 colorSample 选 mip 的算法一致。可变速率着色按它判断纹理有没有被放大
+    float static texelSpan(const RenderContext &ctx, uint triangleID, float d){
+        uint materialID = ctx.triangles[triangleID].materialID;
+        return d * assetManager.getMaterials()[materialID].mipmap2[0].w;
+    }
     // 在着色阶段，算出当前像素的颜色。输入的 x 和 y 是屏幕像素坐标；此函数只在 alphaTest 返回 true 的像素上执行
-    uint static colorSample(float u, float v, uint triangleID, const Vec3 &view, float d=0.0f){
-        uint materialID = ShaderInternal::triangles[triangleID].materialID;
+    uint static colorSample(const RenderContext &ctx, float u, float v, uint triangleID, const Vec3 &view, float d=0.0f){
+        uint materialID = ctx.triangles[triangleID].materialID;
 
         // uint materialID = shadingBuffer.materialID[y][x];
 
@@ -153,7 +197,7 @@ public:
         if(ttfa == 4 || ttfa == 5) return true;
         else return false;
     }
-    uint static colorSample(float u, float v, uint triangleID, const Vec3 &view, float d=0.0f){
+    uint static colorSample(const RenderContext &ctx, float u, float v, uint triangleID, const Vec3 &view, float d=0.0f){
         unsigned int h = triangleID;
 
         // 简单的位混合哈希，让相邻 ID 的颜色产生剧烈跳变
@@ -177,8 +221,8 @@ public:
     bool static alphaTest(uint triangleID, const EdgeIterator &edgeIt, const Iterator2D &zInv, const Iterator2D &u_z, const Iterator2D &v_z){
         return edgeIt.check() == EdgeIterator::INNER;
     }
-    uint static colorSample(float u, float v, uint triangleID, const Vec3 &view, float d=0.0f) {
-        uint materialID = ShaderInternal::triangles[triangleID].materialID;
+    uint static colorSample(const RenderContext &ctx, float u, float v, uint triangleID, const Vec3 &view, float d=0.0f) {
+        uint materialID = ctx.triangles[triangleID].materialID;
 
         const Material &material = assetManager.getMaterials()[materialID];
 
@@ -1,89 +1,293 @@
 #include "stage3d.h"
 #include "render.h"
 #include "raytest.h"
+#include "meshprocessing.h"
 #include <QPaintEvent>
+#include <QResizeEvent>
 #include <QPainter>
+#include <QMetaObject>
 using namespace std;
 
 Stage3D::Stage3D(QWidget *parent)
     : QWidget{parent}
 {
     activeCam = nullptr;
-    root = new GameObject(this);
+    // root 不挂在窗口下面，模拟线程开始时要把整棵树移过去
+    root = new GameObject();
+    // 场景和相机都没变时只有很少的 tile 要重画，整帧没变就不再发布和重绘
+    setIncrementalRendering(true);
+    // 被放大的纹理和画面外圈按 2x2 着色，省下的时间留给动态分辨率
+    ShadingRatePolicy shadingRate;
+    shadingRate.enabled = true;
+    shadingRate.periphery2 = 0.75f;
+    setShadingRate(shadingRate);
+}
+
+void PresentSurface::resize(int w, int h, qreal ratio){
+    if(pixels && w == width && h == height){
+        if(image.devicePixelRatio() != ratio) image.setDevicePixelRatio(ratio);
+        return;
+    }
+    width = w;
+    height = h;
+    stride = (w + 15) & ~15;
+    pixels.reset(new (std::align_val_t(64)) uint[(size_t)stride * h]);
+    // 渲染器每帧都会写满整个表面，不用清零
+    image = QImage((uchar*)pixels.get(), w, h, stride * sizeof(uint), QImage::Format_RGB32);
+    image.setDevicePixelRatio(ratio);
+}
+
+Stage3D::~Stage3D(){
+    stopSimulation();
+    endFrame();
+    delete root;
 }
 
 void Stage3D::updateFrame(){
-    auto frameStart = chrono::system_clock::now();
+    beginFrame();
+    endFrame();
+}
+
+void Stage3D::beginFrame(){
+    endFrame();
+    submitFrame();
+}
+
+// 把当前场景交给渲染线程。调用前上一帧必须已经结束
+void Stage3D::submitFrame(){
+    frameStart = chrono::system_clock::now();
     clearRenderBuffer();
-    updateObjects(root, Transform());
+    if(streamingMap && activeCam != nullptr) streamingMap->update(activeCam->camInfo.pos);
+    updateObjects();
     if(activeCam != nullptr){
-        submitObjects(root);
-        int pw = activeCam->camInfo.width * tileSize;
-        int ph = activeCam->camInfo.height * tileSize;
-        if(frameBuffer.isNull() || pw != frameBuffer.width() || ph != frameBuffer.height()){
-            frameBuffer = QImage(pw, ph, QImage::Format_ARGB32);
+        CameraInfo camera = activeCam->camInfo;
+        if(dynamicResolution) camera.resolutionScale = resolutionController.scale();
+        applyPVS(camera.pos);
+        cullActors(camera);
+        submitObjects(camera);
+        // 窗口还没显示过时按全分辨率画
+        int w = surfaceWidth, h = surfaceHeight;
+        if(w <= 0 || h <= 0){
+            w = camera.width * tileSize;
+            h = camera.height * tileSize;
         }
-        drawFrame(activeCam->camInfo, (uint*)frameBuffer.bits());
-        avgRenderTime = 1e6 / frameStat.fps;
+        PresentSurface &surface = frames.back();
+        surface.resize(w, h, surfaceRatio);
+        FrameTarget target = surface.target();
+        if(dynamicResolution) target.filter = ScaleFilter::Bilinear;
+        pendingFrame = drawFrameAsync(camera, target, [this](FrameHandle::Status){
+            // 在渲染线程上，叫醒模拟线程马上交下一帧
+            {
+                lock_guard<mutex> lock(simMutex);
+                renderIdle = true;
+            }
+            simCv.notify_all();
+        });
+    }
+}
+
+bool Stage3D::frameInFlight() const{
+    return pendingFrame.valid() && !pendingFrame.ready();
+}
+
+void Stage3D::endFrame(){
+    if(!pendingFrame.valid()) return;
+    pendingFrame.wait();
+    // Unchanged 的帧没有写表面，上一张还在 front 上
+    bool finished = pendingFrame.status() == FrameHandle::Finished;
+    pendingFrame = FrameHandle();
+    if(finished){
+        // 发布要放在交下一帧之前的同一个线程上做，渲染线程不碰三缓冲
+        frames.publish();
+        QMetaObject::invokeMethod(this, [this]{QWidget::update();}, Qt::QueuedConnection);
+    }
+    avgRenderTime = 1e6 / defaultRenderer().stats().fps;
+    if(finished && dynamicResolution){
+        resolutionController.addFrame(defaultRenderer().stats().frameTime);
+        renderScale = resolutionController.scale();
     }
-    QWidget::update();
     auto frameEnd = chrono::system_clock::now();
     double t = chrono::duration_cast<chrono::microseconds>(frameEnd - frameStart).count();
     frameTimes.push_back(t);
     if(frameTimes.size() > 100u) frameTimes.erase(frameTimes.begin());
     avgFrameTime = accumulate(frameTimes.begin(), frameTimes.end(), 0.0) / frameTimes.size();
 }
+
+void Stage3D::startSimulation(double stepSeconds, std::function<void(double)> step){
+    stopSimulation();
+    endFrame();
+    simStep = std::move(step);
+    simStepSeconds = stepSeconds;
+    simQuit = false;
+    QThread *owner = QThread::currentThread();
+    simThread = QThread::create([this, owner]{simulationLoop(owner);});
+    root->moveToThread(simThread);
+    simThread->start();
+}
+
+void Stage3D::stopSimulation(){
+    if(simThread == nullptr) return;
+    {
+        lock_guard<mutex> lock(simMutex);
+        simQuit = true;
+    }
+    simCv.notify_all();
+    simThread->wait();
+    delete simThread;
+    simThread = nullptr;
+}
+
+void Stage3D::setDynamicResolution(bool enable, double targetFrameMs){
+    dynamicResolution = enable;
+    resolutionController.targetFrameTime = targetFrameMs * 1000;
+    resolutionController.reset();
+    renderScale = resolutionController.scale();
+}
+
+void Stage3D::simulationLoop(QThread *owner){
+    using clock = chrono::steady_clock;
+    const int maxCatchUp = 4;
+    auto step = chrono::duration_cast<clock::duration>(chrono::duration<double>(simStepSeconds));
+    auto next = clock::now();
+    // 上次交帧之后有没有走过模拟步，没走过的话场景没变，不用再画
+    bool stepped = true;
+    bool rendered = false;
+    unique_lock<mutex> lock(simMutex);
+    while(!simQuit){
+        lock.unlock();
+        int steps = 0;
+        while(clock::now() >= next && steps < maxCatchUp){
+            simStep(simStepSeconds);
+            next += step;
+            steps++;
+        }
+        if(steps > 0) stepped = true;
+        if(clock::now() >= next) next = clock::now() + step;
+        // 画完的帧马上发布，不用等到下一步。被渲染线程的回调叫醒时帧马上就结束，endFrame 只会等一小下
+        if(rendered || !frameInFlight()){
+            endFrame();
+            if(stepped){
+                submitFrame();
+                stepped = false;
+            }
+        }
+        lock.lock();
+        simCv.wait_until(lock, next, [this]{return simQuit || renderIdle;});
+        rendered = renderIdle;
+        renderIdle = false;
+    }
+    lock.unlock();
+    endFrame();
+    // 对象还给原来的线程，停下之后 GUI 线程又可以直接改场景
+    root->moveToThread(owner);
+}
+
 void Stage3D::paintEvent(QPaintEvent *evt){
-    if(activeCam == nullptr) return;
-    if(frameBuffer.isNull()) return;
+    frames.acquire();
+    const QImage &frame = frames.front().image;
+    if(frame.isNull()) return;
     QPainter painter(this);
-    QImage img = frameBuffer.scaled(size());
-    int x = (width() - img.width())/2;
-    int y = (height() - img.height())/2;
-    painter.drawImage(x, y, img);
+    // 表面和窗口一样大时是直接拷贝；刚改过窗口大小、新尺寸的帧还没画好时才会缩放
+    painter.drawImage(rect(), frame);
+}
+
+void Stage3D::resizeEvent(QResizeEvent *evt){
+    qreal ratio = devicePixelRatioF();
+    surfaceWidth = qRound(evt->size().width() * ratio);
+    surfaceHeight = qRound(evt->size().height() * ratio);
+    surfaceRatio = ratio;
+    QWidget::resizeEvent(evt);
+}
+
+// 层级里的节点父节点在前，一遍线性扫描；只通知挂在 root 下面、变换确实变了的对象
+void Stage3D::updateObjects(){
+    transformHierarchy.update();
+    TransformHierarchy::Handle rootHandle = root->transformHandle();
+    for(uint slot = 0; slot < transformHierarchy.slotCount(); slot++){
+        TransformHierarchy::Handle h = transformHierarchy.handleAt(slot);
+        if(h == TransformHierarchy::invalidHandle || h == rootHandle) continue;
+        if(!transformHierarchy.changedAt(slot) || transformHierarchy.rootAt(slot) != rootHandle) continue;
+        GameObject *obj = GameObject::fromTransformHandle(h);
+        obj->updatePosition(transformHierarchy.worldAt(slot));
+        if(MeshActor *actor = dynamic_cast<MeshActor*>(obj)){
+            staticActorBVH.markMoved(actor);
+            dynamicActorBVH.markMoved(actor);
+        }
+    }
 }
 
-void Stage3D::updateObjects(GameObject *rt, const Transform &curr, bool ignoreFlag) const{
-    if(rt == nullptr) return;
-    rt->modified = false;
-    for(GameObject *child: rt->children()){
-        assert(child != nullptr);
-        Transform ttfa = child->transform * curr;
-        if(child->modified || ignoreFlag)
-            child->updatePosition(ttfa);
-        updateObjects(child, ttfa, ignoreFlag || child->modified);
+// 合批的对象没有自己的常驻对象，不进 BVH
+void Stage3D::rebuildActorBVH(){
+    vector<MeshActor*> staticActors, dynamicActors;
+    const ComponentStore<MeshActor> &actors = components<MeshActor>();
+    const MeshActor::Columns &columns = actors.columns();
+    for(uint i = 0; i < actors.size(); i++){
+        if(columns.flags[i] & MeshActor::Batched || !underRoot(columns.transform[i])) continue;
+        (columns.flags[i] & MeshActor::Static ? staticActors : dynamicActors).push_back(actors[i]);
     }
+    // 先全部当成不可见，下面的查询再把视锥里的打开
+    for(MeshActor *actor: staticActors) actor->setCulled(true);
+    for(MeshActor *actor: dynamicActors) actor->setCulled(true);
+    staticActorBVH.build(staticActors);
+    dynamicActorBVH.build(dynamicActors);
+    actorStoreVersion = components<MeshActor>().version();
+    visibleActors.clear();
 }
-void Stage3D::submitObjects(GameObject *rt) const{
-    if(rt == nullptr) return;
-    for(GameObject *child: rt->children()){
-        child->submitForRender();
-        submitObjects(child);
+
+// 只碰上一帧和这一帧可见的对象，视锥外整棵子树直接跳过
+void Stage3D::cullActors(const CameraInfo &camera){
+    if(components<MeshActor>().version() != actorStoreVersion) rebuildActorBVH();
+    else{
+        staticActorBVH.refit();
+        dynamicActorBVH.refit();
+        if(dynamicActorBVH.degraded()) rebuildActorBVH();
+    }
+    for(MeshActor *actor: visibleActors) actor->setCulled(true);
+    visibleActors.clear();
+    Frustum frustum = Frustum::fromCamera(camera);
+    staticActorBVH.query(frustum, visibleActors);
+    dynamicActorBVH.query(frustum, visibleActors);
+    if(pvsCell >= 0 && pvsActorTargets.size()){
+        erase_if(visibleActors, [this](MeshActor *actor){
+            auto it = pvsActorTargets.find(actor);
+            return it != pvsActorTargets.end() && !pvs.visible(pvsCell, it->second);
+        });
+    }
+    for(MeshActor *actor: visibleActors) actor->setCulled(false);
+}
+void Stage3D::submitObjects(const CameraInfo &camera) const{
+    TransformHierarchy::Handle rootHandle = root->transformHandle();
+    for(uint slot = 0; slot < transformHierarchy.slotCount(); slot++){
+        TransformHierarchy::Handle h = transformHierarchy.handleAt(slot);
+        if(h == TransformHierarchy::invalidHandle || h == rootHandle) continue;
+        if(transformHierarchy.rootAt(slot) != rootHandle) continue;
+        GameObject::fromTransformHandle(h)->submitForRender(camera);
     }
 }
 
 SceneRayHit Stage3D::raytest(const Ray &ray)const{
-    QList<SceneRayHit> res = root->forEach<MeshActor>([&](MeshActor *actor) -> SceneRayHit{
-        Transform global = actor->getGlobalTransform();
+    SceneRayHit best;
+    const ComponentStore<MeshActor> &actors = components<MeshActor>();
+    const MeshActor::Columns &columns = actors.columns();
+    for(uint i = 0; i < actors.size(); i++){
+        if(!underRoot(columns.transform[i])) continue;
+        Transform global = transformHierarchy.world(columns.transform[i]);
         Transform inv = global.inverseTransform();
         Ray localRay = {ray.point * inv.rotation + inv.translation, ray.direction * inv.rotation};
-        auto ttfa = raytestManager.meshIntersect(actor->meshID, localRay);
-        if(ttfa.hit) return {actor, ttfa.leaf.triangleID, ttfa.dis, ttfa.pos*global.rotation+global.translation};
-        else return {};
-    });
-    return *min_element(res.begin(), res.end(), [](SceneRayHit a, SceneRayHit b){
-        if(a.miss()) return false;
-        if(b.miss()) return true;
-        return a.dis < b.dis;
-    });
+        auto ttfa = raytestManager.meshIntersect(columns.meshID[i], localRay);
+        if(!ttfa.hit) continue;
+        if(best.miss() || ttfa.dis < best.dis)
+            best = {actors[i], ttfa.leaf.triangleID, ttfa.dis, ttfa.pos*global.rotation+global.translation};
+    }
+    return best;
 }
 
 // 过会给对象树也安排上 BVH
 
 Ray Stage3D::pixelToRay(int x, int y) const{
-    if(activeCam == nullptr || this->frameBuffer.isNull()) return {};
-    int x1 = (float)x/this->size().width() * this->frameBuffer.width();
-    int y1 = (float)y/this->size().height() * this->frameBuffer.height();
+    if(activeCam == nullptr) return {};
+    int x1 = (float)x/this->size().width() * activeCam->camInfo.width * tileSize;
+    int y1 = (float)y/this->size().height() * activeCam->camInfo.height * tileSize;
     return activeCam->pixelToRay(x1, y1);
 }
 BBox3D boxTransform(const BBox3D &box, const Transform &transform){
@@ -104,16 +308,136 @@ set<BoxtestResult> Stage3D::boxtest(const BBox3D &box)const{
 
 void Stage3D::buildStaticBVH(){
     updateFrame();
-    raytestManager.buildStaticBVH(root->forEach<MeshActor>([](const MeshActor *actor)->Mesh{
-        if(actor->isStatic)
-            return actor->mesh;
-        else return {};
-    }));
+    QList<Mesh> meshes;
+    const ComponentStore<MeshActor> &actors = components<MeshActor>();
+    const MeshActor::Columns &columns = actors.columns();
+    for(uint i = 0; i < actors.size(); i++)
+        if(columns.flags[i] & MeshActor::Static && underRoot(columns.transform[i]) && !isStreamed(actors[i]))
+            meshes.push_back(actors[i]->mesh);
+    raytestManager.buildStaticBVH(meshes);
     qDebug()<<"scene static BVH built";
 }
 
+// PVS 烘焙用的目标：[begin, begin + count) 的三角形，采样点由烘焙时按格子大小去取
+static PVSTarget pvsTarget(const Mesh &mesh, uint begin, uint count, const BoundingSphere &bounds){
+    PVSTarget ret;
+    ret.bounds = bounds;
+    ret.triangles.reserve(count * 3);
+    for(uint i = begin; i < begin + count; i++)
+        for(uint vid: mesh.triangles[i].vid) ret.triangles.push_back(mesh.vertices[vid].pos);
+    return ret;
+}
+
+void Stage3D::buildStaticBatches(){
+    clearStaticBatches();
+    updateFrame();
+    // 遮挡体和隐藏的对象保持独立，遮挡体要单独画进遮挡缓冲
+    vector<const Mesh*> meshes;
+    const ComponentStore<MeshActor> &actors = components<MeshActor>();
+    const MeshActor::Columns &columns = actors.columns();
+    const uint8_t wanted = MeshActor::Static | MeshActor::Visible;
+    for(uint i = 0; i < actors.size(); i++){
+        if((columns.flags[i] & wanted) != wanted || !underRoot(columns.transform[i])) continue;
+        if(actors[i]->isOccluder() || isStreamed(actors[i])) continue;
+        meshes.push_back(&actors[i]->mesh);
+        actors[i]->setBatched(true);
+    }
+    staticBatchTargets = {0};
+    for(const Mesh &batch: ::buildStaticBatches(meshes)){
+        staticBatches.push_back(createRenderObject(batch));
+        for(const Meshlet &m: batch.meshlets)
+            batchTargets.push_back(pvsTarget(batch, m.triangleBegin, m.triangleCount, m.bounds));
+        staticBatchTargets.push_back(batchTargets.size());
+    }
+    // 合进批次的对象要从 BVH 里拿掉
+    actorStoreVersion = -1u;
+    qDebug()<<"static batches built:"<<meshes.size()<<"meshes ->"<<staticBatches.size()<<"batches";
+}
+
+void Stage3D::clearStaticBatches(){
+    endFrame();
+    for(RenderObjectID id: staticBatches) destroyRenderObject(id);
+    staticBatches.clear();
+    const ComponentStore<MeshActor> &actors = components<MeshActor>();
+    for(uint i = 0; i < actors.size(); i++)
+        if(actors.columns().flags[i] & MeshActor::Batched) actors[i]->setBatched(false);
+    actorStoreVersion = -1u;
+    // PVS 的目标是按批次编号的，批次没了就作废
+    staticBatchTargets.clear();
+    batchTargets.clear();
+    pvs.clear();
+    pvsActorTargets.clear();
+    pvsCell = -2;
+}
+
+void Stage3D::buildPVS(const QString &cachePath, int resolution, float eyeHeight){
+    endFrame();
+    vector<PVSTarget> targets = batchTargets;
+    vector<MeshActor*> actors;
+    const ComponentStore<MeshActor> &store = components<MeshActor>();
+    const MeshActor::Columns &columns = store.columns();
+    for(uint i = 0; i < store.size(); i++){
+        if((columns.flags[i] & (MeshActor::Static | MeshActor::Batched)) != MeshActor::Static) continue;
+        if(underRoot(columns.transform[i]) && !isStreamed(store[i])) actors.push_back(store[i]);
+    }
+    // 目标编号要和存下来的文件一致，按 meshID 排
+    sort(actors.begin(), actors.end(), [](MeshActor *a, MeshActor *b){return a->meshID < b->meshID;});
+    pvsActorTargets.clear();
+    for(MeshActor *actor: actors){
+        pvsActorTargets[actor] = targets.size();
+        targets.push_back(pvsTarget(actor->mesh, 0, actor->mesh.triangles.size(), actor->mesh.bounds));
+    }
+    BBox3D volume = raytestManager.staticSceneBox();
+    if(targets.empty() || volume.x1 > volume.x2) return;
+    if(!pvs.load(cachePath, volume, resolution, targets, 8, eyeHeight)){
+        pvs.bake(raytestManager, volume, resolution, targets, 8, eyeHeight);
+        if(!pvs.save(cachePath)) qDebug()<<"failed to save PVS to"<<cachePath;
+    }
+    pvsCell = -2;
+}
+
+// 相机换了格子才需要更新各批次的 meshlet 屏蔽表
+void Stage3D::applyPVS(const Vec3 &cameraPos){
+    int cell = pvs.cellIndex(cameraPos);
+    if(cell == pvsCell) return;
+    pvsCell = cell;
+    vector<uint8_t> mask;
+    for(auto [i, id]: enumerate(staticBatches)){
+        mask.clear();
+        if(cell >= 0){
+            for(uint t = staticBatchTargets[i]; t < staticBatchTargets[i+1]; t++)
+                mask.push_back(pvs.visible(cell, t));
+        }
+        setRenderObjectMeshletMask(id, mask);
+    }
+}
+
 GameObject *Stage3D::loadObj(const QString &path, bool isStatic){
     GameObject *ret = assetManager.loadOBJ(path, isStatic);
-    ret->forEach<MeshActor>([this](MeshActor *curr){raytestManager.appendMesh(curr->mesh);});
+    // 射线检测的 BVH 按 meshID 顺序追加，组件表的顺序不可靠，排一下
+    vector<MeshActor*> loaded;
+    for(MeshActor *actor: components<MeshActor>())
+        if(actor->isUnder(ret)) loaded.push_back(actor);
+    sort(loaded.begin(), loaded.end(), [](MeshActor *a, MeshActor *b){return a->meshID < b->meshID;});
+    for(MeshActor *actor: loaded) raytestManager.appendMesh(actor->mesh);
     return ret;
 }
+
+bool Stage3D::openStreamingMap(const QString &path, const StreamingSettings &settings){
+    endFrame();
+    QString packPath = path + ".pack";
+    streamingMap = std::make_unique<StreamingMap>(raytestManager, root);
+    if(streamingMap->open(packPath, settings)) return true;
+    if(assetManager.buildStreamingPack(path, packPath, settings.cellSize) && streamingMap->open(packPath, settings)) return true;
+    delete streamingMap->root();
+    streamingMap.reset();
+    return false;
+}
+
+bool Stage3D::underRoot(TransformHierarchy::Handle h) const{
+    return transformHierarchy.root(h) == root->transformHandle();
+}
+
+bool Stage3D::isStreamed(const GameObject *obj) const{
+    return streamingMap && obj->isUnder(streamingMap->root());
+}
@@ -5,7 +5,18 @@
 #include "assetmanager.h"
 #include "gameobject.h"
 #include "raytest.h"
+#include "render.h"
+#include "scenebvh.h"
+#include "pvs.h"
+#include "streaming.h"
+#include <memory>
 #include <set>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <QThread>
+#include <unordered_map>
 
 struct SceneRayHit{
     MeshActor *actor = nullptr;
@@ -17,32 +28,112 @@ struct SceneRayHit{
     }
 };
 
+// 显示用的表面：持久的 64 字节对齐内存（每行也对齐），按窗口的物理像素大小分配。
+// 渲染器直接往里写（需要时顺带缩放），image 只是包在外面的一层，paintEvent 不再缩放和拷贝
+struct PresentSurface{
+    struct AlignedDelete{
+        void operator()(uint *p) const{ ::operator delete[](p, std::align_val_t(64)); }
+    };
+    std::unique_ptr<uint[], AlignedDelete> pixels;
+    int width = 0, height = 0, stride = 0;
+    QImage image;
+
+    // 尺寸没变时什么都不做
+    void resize(int w, int h, qreal ratio);
+    FrameTarget target() const{ return {pixels.get(), width, height, stride}; }
+};
+
 class Stage3D : public QWidget
 {
     Q_OBJECT
 public:
     explicit Stage3D(QWidget *parent = nullptr);
+    ~Stage3D();
 
-    QImage frameBuffer;
     GameObject *root;
     Camera *activeCam;
 
-    double avgFrameTime;
-    double avgRenderTime;
+    // 模拟线程写，GUI 线程读
+    std::atomic<double> avgFrameTime = 0;
+    std::atomic<double> avgRenderTime = 0;
+    std::atomic<double> renderScale = 1.0;
 
+    // updateFrame = beginFrame + endFrame。两者之间可以做输入、碰撞之类不碰渲染缓冲的工作
     void updateFrame();
+    void beginFrame();
+    // 等当前帧画完，画好的图交给 paintEvent
+    void endFrame();
+    bool frameInFlight() const;
+
+    // 模拟线程：按固定步长 stepSeconds 调用 step，渲染线程一空下来就把当前的场景交给它画。
+    // 开始之后 root 下的对象都归模拟线程，只能在 step 里改；GUI 线程只收输入和显示画好的帧。
+    // 来不及时最多连着补几步，再落后就直接跳过，不会越拖越慢
+    void startSimulation(double stepSeconds, std::function<void(double)> step);
+    void stopSimulation();
+    // 动态分辨率：按渲染耗时调整相机的渲染分辨率，让帧时间贴近 targetFrameMs，放大到窗口时用双线性。
+    // 和 updateFrame 在同一个线程上调用，模拟线程开始之前设好
+    void setDynamicResolution(bool enable, double targetFrameMs = 1000.0 / 60);
     void buildStaticBVH();
+    // 把 isStatic 的 MeshActor 按材质合成少数几个大的常驻对象。
+    // 合批之后这些对象不应该再移动，要动的话先 clearStaticBatches
+    void buildStaticBatches();
+    void clearStaticBatches();
+    // 静态几何的 PVS，要在 buildStaticBVH 和 buildStaticBatches 之后调用。
+    // cachePath 有对得上的烘焙结果就直接读，否则现烘焙一份再写回去。
+    // 目标是合批后的每个 meshlet 和没合批的静态对象，动态对象不受影响。
+    // eyeHeight 是相机离地面的高度，烘焙时只从地面上这个高度的位置采样
+    void buildPVS(const QString &cachePath, int resolution = 32, float eyeHeight = 0.0f);
     GameObject *loadObj(const QString &path, bool isStatic=false);
+    // 大地图的流式模式：第一次打开时把 OBJ 切成格子写进 <path>.pack，之后只读索引，
+    // 每帧按相机位置在后台加载附近的格子。流式的对象不参与静态 BVH、合批和 PVS。只能打开一张
+    bool openStreamingMap(const QString &path, const StreamingSettings &settings);
     Ray pixelToRay(int x, int y)const;
     SceneRayHit raytest(const Ray &ray)const;
     std::set<BoxtestResult> boxtest(const BBox3D &box)const;
 
 protected:
     void paintEvent(QPaintEvent *evt) override;
+    void resizeEvent(QResizeEvent *evt) override;
 private:
     std::vector<double> frameTimes;
-    void updateObjects(GameObject *rt, const Transform &c, bool ignoreFlag=false) const;
-    void submitObjects(GameObject *rt) const;
+    FrameHandle pendingFrame;
+    // 渲染线程往 back 里画，endFrame 时发布，paintEvent 取最新的一张
+    TripleBuffer<PresentSurface> frames;
+    // GUI 线程在 resizeEvent 里写，交帧时按它分配表面
+    std::atomic<int> surfaceWidth = 0, surfaceHeight = 0;
+    std::atomic<qreal> surfaceRatio = 1.0;
+    void submitFrame();
+    bool dynamicResolution = false;
+    DynamicResolution resolutionController;
+
+    QThread *simThread = nullptr;
+    std::function<void(double)> simStep;
+    double simStepSeconds;
+    std::mutex simMutex;
+    std::condition_variable simCv;
+    bool simQuit = false, renderIdle = false;
+    void simulationLoop(QThread *owner);
+    std::vector<RenderObjectID> staticBatches;
+    // 第 i 批的 meshlet 对应 PVS 目标 [staticBatchTargets[i], staticBatchTargets[i+1])
+    std::vector<uint> staticBatchTargets;
+    std::vector<PVSTarget> batchTargets;
+    PotentiallyVisibleSet pvs;
+    std::unordered_map<const MeshActor*, uint> pvsActorTargets;
+    int pvsCell = -2;
+    void applyPVS(const Vec3 &cameraPos);
+    std::unique_ptr<StreamingMap> streamingMap;
+    // 组件表里存的是变换句柄，root 是层级最上面的节点，比一下所在层级的根就行
+    bool underRoot(TransformHierarchy::Handle h) const;
+    bool isStreamed(const GameObject *obj) const;
+    // 静态和动态对象分开两棵树：静态的建一次，动态的每帧 refit，变松了再重建
+    ActorBVH staticActorBVH, dynamicActorBVH;
+    uint actorStoreVersion = -1u;
+    std::vector<MeshActor*> visibleActors;
+    void rebuildActorBVH();
+    void cullActors(const CameraInfo &camera);
+    std::chrono::system_clock::time_point frameStart;
+    void updateObjects();
+    void submitObjects(const CameraInfo &camera) const;
 
     // AssetManager assetManager;
     RaytestManager raytestManager;
@@ -0,0 +1,306 @@
+#include "streaming.h"
+#include "gameobject.h"
+#include "meshprocessing.h"
+#include <QFile>
+#include <QDebug>
+using namespace std;
+
+// 一个格子常驻时大致占的内存：assetManager 里的原网格加简化链（约两倍）、MeshActor 的世界坐标副本、
+// 渲染器里的常驻副本，再加上射线检测 BVH 的叶子和节点
+static size_t estimateCellBytes(const StreamingCellRecord &r){
+    return (size_t)r.vertexCount * sizeof(Vertex) * 4
+         + (size_t)r.triangleCount * (sizeof(Triangle) * 4 + sizeof(Raytest::BVHLeaf<Triangle>) + 2 * sizeof(BVHNode));
+}
+
+static size_t materialBytes(const Material &m){
+    size_t ret = (size_t)m.img.width() * m.img.height() * 4;
+    for(const TextureMap &t: m.mipmap2)
+        if(t.tiles.size()) ret += t.tiles.size() * t.tiles[0].size() * sizeof(TextureTile);
+    return ret;
+}
+
+static float boxDistance(const BBox3D &box, const Vec3 &p){
+    float dx = max({box.x1 - p.x, 0.0f, p.x - box.x2});
+    float dy = max({box.y1 - p.y, 0.0f, p.y - box.y2});
+    float dz = max({box.z1 - p.z, 0.0f, p.z - box.z2});
+    return sqrt(dx * dx + dy * dy + dz * dz);
+}
+
+StreamingMap::StreamingMap(RaytestManager &_raytest, GameObject *parent)
+    : raytest(_raytest){
+    streamRoot = new GameObject(parent);
+}
+
+StreamingMap::~StreamingMap(){
+    {
+        lock_guard<mutex> lock(mtx);
+        quit = true;
+    }
+    cv.notify_all();
+    if(worker.joinable()) worker.join();
+}
+
+bool StreamingMap::open(const QString &_packPath, const StreamingSettings &_settings){
+    QFile file(_packPath);
+    if(!file.open(QIODevice::ReadOnly)) return false;
+    StreamingPackHeader header;
+    if(file.read((char*)&header, sizeof(header)) != sizeof(header)) return false;
+    if(header.magic != streamingPackMagic || header.version != streamingPackVersion || header.cellSize != _settings.cellSize)
+        return false;
+    if(!file.seek(header.indexOffset)) return false;
+
+    vector<Texture> newTextures(header.materialCount);
+    for(Texture &t: newTextures){
+        uint32_t len;
+        if(file.read((char*)&len, sizeof(len)) != sizeof(len)) return false;
+        string path(len, '\0');
+        if(file.read(path.data(), len) != len) return false;
+        t.path = QString::fromStdString(path);
+    }
+    vector<StreamingCellRecord> records(header.cellCount);
+    qint64 bytes = records.size() * sizeof(StreamingCellRecord);
+    if(file.read((char*)records.data(), bytes) != bytes) return false;
+    uint32_t materialListSize;
+    if(file.read((char*)&materialListSize, sizeof(materialListSize)) != sizeof(materialListSize)) return false;
+    cellMaterials.resize(materialListSize);
+    bytes = materialListSize * sizeof(ushort);
+    if(file.read((char*)cellMaterials.data(), bytes) != bytes) return false;
+
+    packPath = _packPath;
+    settings = _settings;
+    textures = std::move(newTextures);
+    // 材质先占好位置，materialID 之后不变，贴图用到时才加载
+    for(Texture &t: textures) t.materialID = assetManager.addMaterial();
+    cells.resize(records.size());
+    for(auto [i, cell]: enumerate(cells)){
+        cell.record = records[i];
+        const StreamingCellRecord &r = cell.record;
+        vector<Vec3> corners;
+        for(float x: {r.lo[0], r.hi[0]})
+            for(float y: {r.lo[1], r.hi[1]})
+                for(float z: {r.lo[2], r.hi[2]})
+                    corners.push_back(Vec3{x, y, z} * settings.scale * settings.transform.rotation + settings.transform.translation);
+        cell.bounds = BBox3D(corners);
+        cell.bytes = estimateCellBytes(r);
+    }
+    worker = std::thread([this]{run();});
+    qDebug()<<"streaming map opened:"<<packPath<<cells.size()<<"cells,"<<textures.size()<<"materials";
+    return true;
+}
+
+int StreamingMap::residentCells() const{
+    int ret = 0;
+    for(const Cell &cell: cells) ret += cell.state == CellState::Resident;
+    return ret;
+}
+
+void StreamingMap::run(){
+    while(true){
+        Job job;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv.wait(lock, [this]{return quit || jobs.size();});
+            if(quit) return;
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        JobResult result = job.texture ? loadTexture(job) : loadCell(job);
+        lock_guard<mutex> lock(mtx);
+        results.push_back(std::move(result));
+    }
+}
+
+StreamingMap::JobResult StreamingMap::loadTexture(const Job &job){
+    JobResult ret;
+    ret.job = job;
+    ret.material.img = QImage(textures[job.index].path);
+    if(ret.material.img.isNull()) qWarning()<<"  [!] Failed to load texture:"<<textures[job.index].path;
+    ret.material.updateImage();
+    ret.bytes = materialBytes(ret.material);
+    return ret;
+}
+
+// 在后台线程上读一个格子，把变换烘进顶点，做加载时的网格处理，顺便建好 BVH
+StreamingMap::JobResult StreamingMap::loadCell(const Job &job){
+    JobResult ret;
+    ret.job = job;
+    const StreamingCellRecord &r = cells[job.index].record;
+    QFile file(packPath);
+    vector<char> data(r.size);
+    if(!file.open(QIODevice::ReadOnly) || !file.seek(r.offset) || file.read(data.data(), r.size) != (qint64)r.size){
+        qWarning()<<"[Streaming] Failed to read cell"<<job.index;
+        return ret;
+    }
+    size_t cursor = 0;
+    auto take = [&](void *dst, size_t n){
+        if(cursor + n > data.size()) return false;
+        memcpy(dst, data.data() + cursor, n);
+        cursor += n;
+        return true;
+    };
+    for(uint m = 0; m < r.meshCount; m++){
+        ushort material;
+        uint32_t vertexCount, triangleCount;
+        if(!take(&material, sizeof(material)) || !take(&vertexCount, sizeof(vertexCount)) || !take(&triangleCount, sizeof(triangleCount)))
+            break;
+        Mesh mesh;
+        mesh.materialID = material < textures.size() ? textures[material].materialID : ushort(-1);
+        mesh.vertices.resize(vertexCount);
+        if(!take(mesh.vertices.data(), vertexCount * sizeof(Vertex))) break;
+        mesh.triangles.resize(triangleCount);
+        bool ok = true;
+        for(Triangle &t: mesh.triangles) ok = ok && take(t.vid, sizeof(t.vid));
+        if(!ok) break;
+        for(Vertex &v: mesh.vertices) v.pos = v.pos * settings.scale * settings.transform.rotation + settings.transform.translation;
+        for(Triangle &t: mesh.triangles){
+            Vec3 v0 = mesh.vertices[t.vid[0]].pos;
+            Vec3 v1 = mesh.vertices[t.vid[1]].pos;
+            Vec3 v2 = mesh.vertices[t.vid[2]].pos;
+            t.hardNormal = (v1 - v0).cross(v2 - v0);
+            t.hardNormal.normalize();
+        }
+        generateLODs(mesh);
+        buildMeshlets(mesh);
+        mesh.computeBounds();
+        ret.trees.emplace_back(toLeafVec(mesh));
+        ret.meshes.push_back(std::move(mesh));
+    }
+    return ret;
+}
+
+void StreamingMap::collectResults(){
+    vector<JobResult> done;
+    {
+        lock_guard<mutex> lock(mtx);
+        swap(done, results);
+    }
+    for(JobResult &result: done){
+        if(result.job.texture){
+            Texture &t = textures[result.job.index];
+            t.bytes = result.bytes;
+            // 等待期间没人要了就直接丢掉
+            if(t.refs == 0){
+                t.state = TextureState::Unloaded;
+                continue;
+            }
+            assetManager.setMaterial(t.materialID, std::move(result.material));
+            t.state = TextureState::Resident;
+            residentTextureBytes += t.bytes;
+            continue;
+        }
+        Cell &cell = cells[result.job.index];
+        if(cell.state != CellState::Loading || cell.generation != result.job.generation) continue;
+        cell.readyMeshes = std::move(result.meshes);
+        cell.readyTrees = std::move(result.trees);
+        cell.state = CellState::Ready;
+    }
+    // 贴图都到了的格子才挂进场景
+    for(auto [i, cell]: enumerate(cells)){
+        if(cell.state != CellState::Ready) continue;
+        bool texturesReady = true;
+        for(uint k = 0; k < cell.record.materialCount; k++)
+            texturesReady = texturesReady && textures[cellMaterials[cell.record.materialBegin + k]].state == TextureState::Resident;
+        if(texturesReady) install(i);
+    }
+}
+
+void StreamingMap::install(uint index){
+    Cell &cell = cells[index];
+    cell.object = new GameObject(streamRoot);
+    for(auto [i, mesh]: enumerate(cell.readyMeshes)){
+        uint meshID = assetManager.addMesh(std::move(mesh));
+        raytest.setMeshTree(meshID, std::move(cell.readyTrees[i]), true);
+        new MeshActor(meshID, true, cell.object);
+        cell.meshIDs.push_back(meshID);
+    }
+    cell.readyMeshes.clear();
+    cell.readyTrees.clear();
+    cell.state = CellState::Resident;
+    residentCellBytes += cell.bytes;
+}
+
+void StreamingMap::request(uint index){
+    Cell &cell = cells[index];
+    cell.state = CellState::Loading;
+    cell.generation++;
+    lock_guard<mutex> lock(mtx);
+    // 贴图排在格子前面，单个后台线程按顺序做，格子到的时候贴图一般也到了
+    for(uint k = 0; k < cell.record.materialCount; k++){
+        uint t = cellMaterials[cell.record.materialBegin + k];
+        if(textures[t].refs++ == 0 && textures[t].state == TextureState::Unloaded){
+            textures[t].state = TextureState::Loading;
+            jobs.push_back({true, t, 0});
+        }
+    }
+    jobs.push_back({false, index, cell.generation});
+    cv.notify_one();
+}
+
+void StreamingMap::releaseTexture(uint index){
+    Texture &t = textures[index];
+    if(--t.refs > 0 || t.state != TextureState::Resident) return;
+    assetManager.releaseMaterial(t.materialID);
+    residentTextureBytes -= t.bytes;
+    t.state = TextureState::Unloaded;
+}
+
+void StreamingMap::unload(uint index){
+    Cell &cell = cells[index];
+    if(cell.state == CellState::Loading){
+        lock_guard<mutex> lock(mtx);
+        erase_if(jobs, [&](const Job &job){return !job.texture && job.index == index;});
+    }
+    if(cell.state == CellState::Resident){
+        // 删掉对象时 MeshActor 会释放自己的常驻对象
+        delete cell.object;
+        cell.object = nullptr;
+        for(uint meshID: cell.meshIDs){
+            raytest.releaseMesh(meshID);
+            assetManager.releaseMesh(meshID);
+        }
+        cell.meshIDs.clear();
+        residentCellBytes -= cell.bytes;
+    }
+    cell.readyMeshes.clear();
+    cell.readyTrees.clear();
+    cell.state = CellState::Unloaded;
+    cell.generation++;
+    for(uint k = 0; k < cell.record.materialCount; k++)
+        releaseTexture(cellMaterials[cell.record.materialBegin + k]);
+}
+
+// 近的格子优先，已经在内存里的格子用更大的半径，预算从近往远分，分不到的卸掉
+void StreamingMap::update(const Vec3 &cameraPos){
+    if(cells.empty()) return;
+    collectResults();
+
+    vector<pair<float, uint>> order;
+    for(auto [i, cell]: enumerate(cells)){
+        float d = boxDistance(cell.bounds, cameraPos);
+        float radius = cell.state == CellState::Unloaded ? settings.loadRadius : max(settings.loadRadius, settings.unloadRadius);
+        if(d <= radius) order.push_back({d, (uint)i});
+    }
+    sort(order.begin(), order.end());
+
+    vector<char> wanted(cells.size(), 0), textureCounted(textures.size(), 0);
+    size_t planned = 0;
+    for(auto [d, i]: order){
+        const Cell &cell = cells[i];
+        size_t cost = cell.bytes;
+        for(uint k = 0; k < cell.record.materialCount; k++){
+            uint t = cellMaterials[cell.record.materialBegin + k];
+            if(!textureCounted[t]) cost += textures[t].bytes;
+        }
+        // 最近的一个格子总是要的，不然预算太小时什么都看不到
+        if(planned + cost > settings.memoryBudget && planned > 0) break;
+        planned += cost;
+        wanted[i] = 1;
+        for(uint k = 0; k < cell.record.materialCount; k++)
+            textureCounted[cellMaterials[cell.record.materialBegin + k]] = 1;
+    }
+
+    for(uint i = 0; i < cells.size(); i++)
+        if(!wanted[i] && cells[i].state != CellState::Unloaded) unload(i);
+    for(auto [d, i]: order)
+        if(wanted[i] && cells[i].state == CellState::Unloaded) request(i);
+}
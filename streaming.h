@@ -0,0 +1,121 @@
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include "structures.h"
+#include "raytest.h"
+#include "assetmanager.h"
+#include <QString>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// 流式包：OBJ 按 cellSize 的格子切开后的二进制文件，第一次打开地图时由 AssetManager::buildStreamingPack 生成。
+// 文件布局：头 | 各格子的网格数据 | 索引（材质贴图路径、格子记录、每个格子用到的材质）
+// 每个网格：uint16 材质下标（0xffff 没有材质）、uint32 顶点数、uint32 三角形数、Vertex 数组、每个三角形三个 uint32
+struct StreamingPackHeader{
+    uint32_t magic, version;
+    float origin[3], cellSize;
+    int32_t dims[3];
+    uint32_t cellCount, materialCount;
+    uint64_t indexOffset;
+};
+
+struct StreamingCellRecord{
+    int32_t coord[3];
+    float lo[3], hi[3];     // 格子里三角形的实际范围，会比格子本身大一点
+    uint64_t offset, size;
+    uint32_t vertexCount, triangleCount, meshCount;
+    uint32_t materialBegin, materialCount;
+};
+
+const uint32_t streamingPackMagic = 0x4d525453;     // "STRM"
+const uint32_t streamingPackVersion = 1;
+
+struct StreamingSettings{
+    float cellSize = 1024.0f;       // OBJ 原始坐标下的格子边长，和已有的包不一致时重新切
+    // 加载时直接把缩放和变换烘进顶点，格子里的对象挂在单位变换的节点下面，不要再移动
+    float scale = 1.0f;
+    Transform transform;
+    float loadRadius = 2048.0f;     // 世界坐标下相机到格子包围盒的距离
+    float unloadRadius = 2560.0f;   // 已经加载的格子超出这个距离才卸载，免得在边界上反复加载
+    size_t memoryBudget = size_t(512) << 20;
+};
+
+// 只让相机附近的格子常驻。格子的网格、简化链、射线检测用的 BVH 和贴图都在后台线程上准备好，
+// update 时（两帧之间）再挂到场景里；离开范围或者超出内存预算的格子整个卸掉。
+// 贴图按引用计数跟着格子走，最后一个用到它的格子卸载时一起释放
+class StreamingMap{
+public:
+    StreamingMap(RaytestManager &raytest, GameObject *parent);
+    ~StreamingMap();
+
+    // 包不存在或者和 settings 对不上时返回 false
+    bool open(const QString &packPath, const StreamingSettings &settings);
+    // 每帧 beginFrame 里调用，只能在两帧之间
+    void update(const Vec3 &cameraPos);
+    GameObject *root() const{ return streamRoot; }
+    size_t residentBytes() const{ return residentCellBytes + residentTextureBytes; }
+    int residentCells() const;
+
+private:
+    enum class CellState{ Unloaded, Loading, Ready, Resident };
+    struct Cell{
+        StreamingCellRecord record;
+        BBox3D bounds;          // 世界坐标
+        size_t bytes;           // 按顶点和三角形数估计的常驻内存
+        CellState state = CellState::Unloaded;
+        uint generation = 0;    // 每次请求加一，过期的后台结果直接丢掉
+        GameObject *object = nullptr;
+        std::vector<uint> meshIDs;
+        std::vector<Mesh> readyMeshes;
+        std::vector<BVHTree<Triangle>> readyTrees;
+    };
+    enum class TextureState{ Unloaded, Loading, Resident };
+    struct Texture{
+        QString path;
+        uint materialID;
+        uint refs = 0;
+        TextureState state = TextureState::Unloaded;
+        size_t bytes = 0;       // 第一次加载之后才知道，之前按 0 算
+    };
+    struct Job{
+        bool texture;
+        uint index, generation;
+    };
+    struct JobResult{
+        Job job;
+        std::vector<Mesh> meshes;
+        std::vector<BVHTree<Triangle>> trees;
+        Material material;
+        size_t bytes = 0;
+    };
+
+    RaytestManager &raytest;
+    GameObject *streamRoot;
+    QString packPath;
+    StreamingSettings settings;
+    std::vector<Cell> cells;
+    std::vector<Texture> textures;
+    std::vector<ushort> cellMaterials;
+    size_t residentCellBytes = 0, residentTextureBytes = 0;
+
+    // 后台线程只读 cells 的 record、textures 的 path/materialID 和 settings，它们在 open 之后不变
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    std::vector<JobResult> results;
+    bool quit = false;
+
+    void run();
+    JobResult loadCell(const Job &job);
+    JobResult loadTexture(const Job &job);
+    void collectResults();
+    void request(uint cell);
+    void unload(uint cell);
+    void install(uint cell);
+    void releaseTexture(uint texture);
+};
+
+#endif // STREAMING_H
@@ -31,6 +31,30 @@ struct Triangle{
     ushort shaderConfig = 0;
 };
 
+struct BoundingSphere{
+    Vec3 center;
+    float radius = 0.0f;
+};
+
+// 一小簇空间上相邻的三角形（64~128 个），作为剔除和并行的单位。
+// triangleBegin 是在所属 mesh 的 triangles 里的下标
+struct Meshlet{
+    uint triangleBegin, triangleCount;
+    BoundingSphere bounds;
+    // 法线锥：所有三角形的法线与 coneAxis 的夹角不超过 asin(coneSin) 对应的角度
+    Vec3 coneAxis;
+    float coneSin;
+    bool coneValid = false;     // 法线太分散或者有双面三角形时不做背面剔除
+
+    // 法线定义和 getFragments 里的 hardNormal 一致，保守判断整个簇都是背面
+    bool backfacing(const Vec3 &cameraPos) const{
+        if(!coneValid) return false;
+        Vec3 d = bounds.center - cameraPos;
+        float dist = d.len();
+        return coneAxis.dot(d) + bounds.radius < -coneSin * (dist + bounds.radius);
+    }
+};
+
 // 这里 triangle 的 vid 是在此 mesh 内部的 vertexs 中的下标
 struct Mesh{
     std::vector<Triangle> triangles;
@@ -38,17 +62,47 @@ struct Mesh{
     ushort materialID;
     ushort shaderConfig = 0;
     uint meshID;
+    BoundingSphere bounds;  // 局部坐标下的包围球，加载时算好
+    std::vector<Meshlet> meshlets;
+    // 加载时生成的简化链，lods[i] 是第 i+1 级，越往后越粗。
+    // lodError 是这一级相对原网格的最大几何误差（局部坐标下的长度），原网格为 0
+    std::vector<Mesh> lods;
+    float lodError = 0.0f;
+
+    void computeBounds(){
+        if(vertices.empty()) return;
+        Vec3 lo = vertices[0].pos, hi = vertices[0].pos;
+        for(const Vertex &v:vertices){
+            lo = {std::min(lo.x, v.pos.x), std::min(lo.y, v.pos.y), std::min(lo.z, v.pos.z)};
+            hi = {std::max(hi.x, v.pos.x), std::max(hi.y, v.pos.y), std::max(hi.z, v.pos.z)};
+        }
+        bounds.center = (lo + hi) / 2;
+        bounds.radius = 0.0f;
+        for(const Vertex &v:vertices)
+            bounds.radius = std::max(bounds.radius, (v.pos - bounds.center).len());
+    }
 
     void applyTransform(const Transform &t){
         for(Vertex &v:vertices){
             v.pos = v.pos*t.rotation;
             v.pos += t.translation;
         }
+        bounds.center = bounds.center*t.rotation + t.translation;
+        for(Meshlet &m:meshlets){
+            m.bounds.center = m.bounds.center*t.rotation + t.translation;
+            m.coneAxis = m.coneAxis*t.rotation;
+        }
     }
     void scale(float s){
         for(Vertex &v:vertices){
             v.pos *= s;
         }
+        bounds.center *= s;
+        bounds.radius *= std::abs(s);
+        for(Meshlet &m:meshlets){
+            m.bounds.center *= s;
+            m.bounds.radius *= std::abs(s);
+        }
     }
 };
 
@@ -115,18 +169,112 @@ struct CameraInfo{
     Vec3 screenSize;
     float focalLength;
     LocalFrame frame;
+    // 动态分辨率：实际渲染 width*tileSize*resolutionScale 个像素宽，不必是 tile 的整数倍，最后一列/行 tile 只画一部分
+    float resolutionScale = 1.0f;
+
+    uint pixelWidth() const{ return std::max(1, (int)std::lround(width * tileSize * resolutionScale)); }
+    uint pixelHeight() const{ return std::max(1, (int)std::lround(height * tileSize * resolutionScale)); }
+};
+
+// 紧凑网格格式：位置相对包围盒量化成 16 位，UV 相对 UV 范围量化成 16 位，一个顶点 10 字节（Vertex 是 24 字节）。
+// 三角形不存法线，getFragments 每帧都会重算；材质是整个网格一个。
+// 渲染只用到位置和 UV，所以顶点不带法线。渲染器的常驻几何按对象用这种顶点存，实例化每帧从资源的 CompactMesh 展开
+struct CompactVertex{
+    ushort pos[3];
+    ushort uv[2];
 };
 
+struct CompactTriangle{
+    uint vid[3];
+    ushort shaderConfig;
+};
+
+// 一组紧凑顶点的反量化参数
+struct VertexQuantization{
+    Vec3 posOrigin, posStep;        // pos = posOrigin + q * posStep
+    float uvOrigin[2] = {}, uvStep[2] = {};
+
+    Vec3 position(const CompactVertex &v) const{
+        return {posOrigin.x + v.pos[0] * posStep.x, posOrigin.y + v.pos[1] * posStep.y, posOrigin.z + v.pos[2] * posStep.z};
+    }
+    Vec3 texcoord(const CompactVertex &v) const{
+        return {uvOrigin[0] + v.uv[0] * uvStep[0], uvOrigin[1] + v.uv[1] * uvStep[1], 0.0f};
+    }
+    Vertex decode(const CompactVertex &v) const{
+        return {position(v), texcoord(v)};
+    }
+};
+
+struct CompactMesh : VertexQuantization{
+    std::vector<CompactVertex> vertices;
+    std::vector<CompactTriangle> triangles;
+    ushort materialID = 0;
+
+    bool empty() const{
+        return triangles.empty();
+    }
+    Triangle triangle(uint i) const{
+        Triangle ret;
+        const CompactTriangle &t = triangles[i];
+        ret.vid[0] = t.vid[0];
+        ret.vid[1] = t.vid[1];
+        ret.vid[2] = t.vid[2];
+        ret.materialID = materialID;
+        ret.shaderConfig = t.shaderConfig;
+        return ret;
+    }
+};
+
+// 相机的视锥：近平面（也就是屏幕所在平面）加上下左右四个面，法线都朝里
+struct Frustum{
+    Plane planes[5];
+
+    static Frustum fromCamera(const CameraInfo &camera){
+        Frustum ret;
+        const LocalFrame &f = camera.frame;
+        Vec3 center = camera.pos + camera.focalLength * f.axisZ;
+        ret.planes[0] = {center, f.axisZ};
+        float hx = camera.screenSize.x / 2, hy = camera.screenSize.y / 2;
+        Vec3 edges[4] = {
+            f.axisZ * camera.focalLength + f.axisX * hx,
+            f.axisZ * camera.focalLength - f.axisX * hx,
+            f.axisZ * camera.focalLength + f.axisY * hy,
+            f.axisZ * camera.focalLength - f.axisY * hy,
+        };
+        Vec3 sides[4] = {f.axisY, f.axisY, f.axisX, f.axisX};
+        for(int i=0;i<4;i++){
+            Vec3 n = edges[i].cross(sides[i]).normalized();
+            if(n.dot(f.axisZ * camera.focalLength - edges[i]) < 0) n = -n;
+            ret.planes[i+1] = {camera.pos, n};
+        }
+        return ret;
+    }
+    // 保守判断：只有整个球都在某个面外侧时才返回 true
+    bool sphereOutside(const Vec3 &center, float radius) const{
+        for(const Plane &p: planes)
+            if((center - p.point).dot(p.normal) < -radius) return true;
+        return false;
+    }
+};
+
+// 渲染线程的计数器由 RenderTaskDispatcher 按 worker 分开统计，drawFrame 结束时汇总到这里
 struct FrameStat{
     int vcnt;
     int tcnt;
     int tileFragmentSum;
-    std::atomic<uint> pixelIterated;
+    uint pixelIterated;
+    uint pixelWritten;
+    uint pixelShaded;       // 实际调用着色器的次数，可变速率着色时比写出的像素少
+    uint depthRejected;     // 整个被 tile 内已有深度挡住、直接跳过的 triangle-tile 对
+    uint tilesProcessed;
+    uint steals;
+    int meshletCulled;
+    int occlusionCulled;    // 被遮挡剔除的对象、meshlet 和实例
+    int tilesClean;         // 增量渲染时沿用上一帧颜色的 tile
+    float frameTime;        // 最近一帧的渲染耗时（微秒）
     float fps;
 };
 
-extern FrameStat frameStat;
-
 inline void loadEdgeEquation(Iterator2D &edgeIter, const Vec3 &point, const Vec3 &edge, bool direction){
     edgeIter.dv_dx = -edge.y;
     edgeIter.dv_dy = edge.x;
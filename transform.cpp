@@ -1,4 +1,7 @@
 #include "transform.h"
+#include "utils.h"
+
+using namespace std;
 
 // by gemini
 Transform Transform::rotateAroundAxis(Vec3 axis, float rad)
@@ -32,3 +35,182 @@ Transform Transform::rotateAroundAxis(Vec3 axis, float rad)
     // 3. 返回变换对象（纯旋转，位移通常设为 0）
     return {Vec3(0, 0, 0), rot};
 }
+
+TransformHierarchy transformHierarchy;
+
+TransformHierarchy::Handle TransformHierarchy::create(Handle parent){
+    Handle h;
+    if(freeHandles.size()){
+        h = freeHandles.back();
+        freeHandles.pop_back();
+    }else{
+        h = slotOf.size();
+        slotOf.push_back(-1u);
+        parentOf.push_back(invalidHandle);
+    }
+    // 新节点放在末尾，父节点一定已经在它前面
+    slotOf[h] = handles.size();
+    parentOf[h] = parent;
+    handles.push_back(h);
+    parentSlots.push_back(parent == invalidHandle ? -1u : slotOf[parent]);
+    locals.push_back({});
+    worlds.push_back({});
+    dirty.push_back(1);
+    changed.push_back(0);
+    roots.push_back(h);
+    fresh.push_back(0);
+    resolvedEpoch.push_back(0);
+    dirtyCount++;
+    epoch++;
+    return h;
+}
+
+void TransformHierarchy::destroy(Handle h){
+    uint slot = slotOf[h];
+    handles[slot] = invalidHandle;
+    slotOf[h] = -1u;
+    parentOf[h] = invalidHandle;
+    // 子节点在下次 update 整理顺序时一起断开，不用每次都扫一遍所有节点。
+    // 在那之前 Handle 不能复用，子节点才能认出父节点已经没了
+    pendingFree.push_back(h);
+    orderDirty = true;
+    epoch++;
+}
+
+void TransformHierarchy::setParent(Handle h, Handle parent){
+    if(parentOf[h] == parent) return;
+    parentOf[h] = parent;
+    uint slot = slotOf[h];
+    uint pslot = parent == invalidHandle ? -1u : slotOf[parent];
+    parentSlots[slot] = pslot;
+    if(pslot != -1u && pslot > slot) orderDirty = true;
+    markDirty(h);
+}
+
+// 父节点已经销毁、还没到 update 的也当作没有父节点
+TransformHierarchy::Handle TransformHierarchy::parent(Handle h) const{
+    Handle p = parentOf[h];
+    return p != invalidHandle && slotOf[p] != -1u ? p : invalidHandle;
+}
+
+TransformHierarchy::Handle TransformHierarchy::root(Handle h) const{
+    uint slot = slotOf[h];
+    if(dirtyCount != 0 || orderDirty) resolve(slot);
+    return roots[slot];
+}
+
+void TransformHierarchy::setLocal(Handle h, const Transform &t){
+    locals[slotOf[h]] = t;
+    markDirty(h);
+}
+
+const Transform &TransformHierarchy::local(Handle h) const{
+    return locals[slotOf[h]];
+}
+
+void TransformHierarchy::markDirty(Handle h){
+    uint slot = slotOf[h];
+    if(!dirty[slot]) dirtyCount++;
+    dirty[slot] = 1;
+    epoch++;
+}
+
+Transform TransformHierarchy::world(Handle h) const{
+    uint slot = slotOf[h];
+    if(dirtyCount != 0 || orderDirty) resolve(slot);
+    return worlds[slot];
+}
+
+// 查询时只处理这个节点和它的祖先：每个节点在两次改动之间最多验证一次，
+// 自己或者祖先改过的才重算，结果直接写回缓存，update 时会再按同样的规则算一遍
+void TransformHierarchy::resolve(uint slot) const{
+    if(resolvedEpoch[slot] == epoch) return;
+    resolvedEpoch[slot] = epoch;
+    Handle h = handles[slot];
+    Handle p = parentOf[h];
+    if(p != invalidHandle && slotOf[p] != -1u){
+        uint pslot = slotOf[p];
+        resolve(pslot);
+        if(!dirty[slot] && !fresh[pslot]) return;
+        worlds[slot] = locals[slot] * worlds[pslot];
+        roots[slot] = roots[pslot];
+    }else{
+        // 父节点销毁了、还没到 update 的也当作根
+        if(!dirty[slot] && p == invalidHandle) return;
+        worlds[slot] = Transform();
+        roots[slot] = h;
+    }
+    fresh[slot] = 1;
+}
+
+// 按层级重新排一遍：从各个根开始广度优先，保证父节点在前，同时去掉已销毁的空位。
+// 父节点销毁了的节点在这里断开，变成根
+void TransformHierarchy::rebuildOrder(){
+    uint n = handles.size();
+    vector<vector<uint>> children(n);
+    vector<uint> order;
+    order.reserve(n);
+    for(uint slot = 0; slot < n; slot++){
+        Handle h = handles[slot];
+        if(h == invalidHandle) continue;
+        Handle p = parentOf[h];
+        if(p != invalidHandle && slotOf[p] == -1u){
+            p = parentOf[h] = invalidHandle;
+            dirty[slot] = 1;
+        }
+        if(p == invalidHandle) order.push_back(slot);
+        else children[slotOf[p]].push_back(slot);
+    }
+    for(uint i = 0; i < order.size(); i++)
+        for(uint child: children[order[i]]) order.push_back(child);
+
+    vector<Handle> newHandles(order.size());
+    vector<Transform> newLocals(order.size()), newWorlds(order.size());
+    vector<uint8_t> newDirty(order.size());
+    vector<Handle> newRoots(order.size());
+    for(auto [i, slot]: enumerate(order)){
+        newHandles[i] = handles[slot];
+        newLocals[i] = locals[slot];
+        newWorlds[i] = worlds[slot];
+        newDirty[i] = dirty[slot];
+        newRoots[i] = roots[slot];
+    }
+    handles = std::move(newHandles);
+    locals = std::move(newLocals);
+    worlds = std::move(newWorlds);
+    dirty = std::move(newDirty);
+    roots = std::move(newRoots);
+    changed.assign(handles.size(), 0);
+    fresh.resize(handles.size());
+    resolvedEpoch.resize(handles.size());
+    parentSlots.resize(handles.size());
+    for(auto [slot, h]: enumerate(handles)) slotOf[h] = slot;
+    for(auto [slot, h]: enumerate(handles)){
+        Handle p = parentOf[h];
+        parentSlots[slot] = p == invalidHandle ? -1u : slotOf[p];
+    }
+    freeHandles.insert(freeHandles.end(), pendingFree.begin(), pendingFree.end());
+    pendingFree.clear();
+    orderDirty = false;
+}
+
+void TransformHierarchy::update(){
+    if(orderDirty) rebuildOrder();
+    uint n = handles.size();
+    for(uint slot = 0; slot < n; slot++){
+        uint p = parentSlots[slot];
+        bool parentChanged = p != -1u && changed[p];
+        changed[slot] = dirty[slot] || parentChanged;
+        dirty[slot] = 0;
+        if(!changed[slot]) continue;
+        if(p == -1u){
+            worlds[slot] = Transform();
+            roots[slot] = handles[slot];
+        }else{
+            worlds[slot] = locals[slot] * worlds[p];
+            roots[slot] = roots[p];
+        }
+    }
+    dirtyCount = 0;
+    fresh.assign(n, 0);
+}
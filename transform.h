@@ -2,6 +2,8 @@
 #define TRANSFORM_H
 
 #include "mathbase.h"
+#include <vector>
+#include <cstdint>
 
 
 
@@ -39,4 +41,64 @@ struct LocalFrame{
     }
 };
 
+// 扁平的变换层级。节点按“父节点在前”的顺序连续存放，每帧 update 一次线性扫描算出世界变换，
+// 只有自己或祖先被改过的节点才重算。外部用 Handle 引用节点，重排之后 Handle 不变。
+// 没有父节点的节点世界变换是单位变换（和 Stage3D 的根对象一样，自身的局部变换不起作用）
+class TransformHierarchy{
+public:
+    using Handle = uint;
+    static constexpr Handle invalidHandle = -1u;
+
+    Handle create(Handle parent = invalidHandle);
+    // 子节点不会跟着销毁，它们在下次 update 时变成没有父节点
+    void destroy(Handle h);
+    void setParent(Handle h, Handle parent);
+    Handle parent(Handle h) const;
+    // 所在那棵树的根节点，有没更新的改动时沿父链现找
+    Handle root(Handle h) const;
+
+    void setLocal(Handle h, const Transform &t);
+    const Transform &local(Handle h) const;
+    // 局部变换没变但需要重新通知（比如缩放变了），下次 update 时算作改动
+    void markDirty(Handle h);
+    // 上次 update 之后没有任何改动时直接返回缓存，否则只重算这个节点改动过的祖先，结果留在缓存里
+    Transform world(Handle h) const;
+
+    void update();
+
+    // 下面这些按存放顺序访问，只在 update 之后有意义。已销毁的位置 handleAt 返回 invalidHandle
+    uint slotCount() const{ return handles.size(); }
+    Handle handleAt(uint slot) const{ return handles[slot]; }
+    bool changedAt(uint slot) const{ return changed[slot]; }
+    const Transform &worldAt(uint slot) const{ return worlds[slot]; }
+    // 所在那棵树的根节点
+    Handle rootAt(uint slot) const{ return roots[slot]; }
+
+private:
+    // 按槽位存放的数据
+    std::vector<Handle> handles;
+    std::vector<uint> parentSlots;      // 父节点的槽位，没有父节点是 -1u
+    std::vector<Transform> locals;
+    std::vector<uint8_t> dirty, changed;
+    // world/root 在两次 update 之间也会顺手更新这几项：fresh 表示上次 update 之后重算过，
+    // resolvedEpoch 等于 epoch 说明这次改动之后已经验证过。任何改动都让 epoch 加一
+    mutable std::vector<Transform> worlds;
+    mutable std::vector<Handle> roots;
+    mutable std::vector<uint8_t> fresh;
+    mutable std::vector<uint> resolvedEpoch;
+    uint epoch = 1;
+    // 按 Handle 索引
+    std::vector<uint> slotOf;
+    std::vector<Handle> parentOf;
+    std::vector<Handle> freeHandles;
+    std::vector<Handle> pendingFree;    // 已销毁、下次整理顺序之后才能复用
+    bool orderDirty = false;
+    uint dirtyCount = 0;
+
+    void rebuildOrder();
+    void resolve(uint slot) const;
+};
+
+extern TransformHierarchy transformHierarchy;
+
 #endif // TRANSFORM_H
@@ -8,6 +8,15 @@
 #include <atomic>
 #include <latch>
 #include <thread>
+#include <memory>
+#include <map>
+#include <string>
+#include <fstream>
+#include <cstdlib>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 template <typename Container>
 concept is_forward_iterable = requires(Container c) {
@@ -98,26 +107,131 @@ auto enumerate(T &&container){
     return enumerate_container<T>(std::forward<T>(container));
 }
 
+// 取默认的 worker 数量，环境变量 PIG3_RENDER_THREADS 优先，其次 hardware_concurrency
+inline int defaultThreadCount(){
+    if(const char *env = std::getenv("PIG3_RENDER_THREADS")){
+        int n = std::atoi(env);
+        if(n > 0) return n;
+    }
+    int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 4;
+}
+
+// 绑核时用的逻辑核顺序：先把每个物理核的第一个超线程排完，再排剩下的 SMT 兄弟，
+// 这样 worker 数不超过物理核数时不会有两个 worker 挤在同一个物理核上
+inline std::vector<int> cpuPlacementOrder(){
+    std::vector<int> ret;
+#ifdef __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return ret;
+
+    // (package, core) -> 这个物理核上允许使用的逻辑核
+    std::map<std::pair<int, int>, std::vector<int>> cores;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(!CPU_ISSET(cpu, &allowed)) continue;
+        std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        int package = 0, core = cpu;
+        std::ifstream(base + "physical_package_id") >> package;
+        std::ifstream(base + "core_id") >> core;
+        cores[{package, core}].push_back(cpu);
+    }
+    for(size_t rank = 0; ; rank++){
+        bool found = false;
+        for(const auto &[_, siblings]: cores){
+            if(rank < siblings.size()){
+                ret.push_back(siblings[rank]);
+                found = true;
+            }
+        }
+        if(!found) break;
+    }
+#endif
+    return ret;
+}
+
 template<std::semiregular TaskType> requires std::invocable<TaskType>
 class TaskDispatcher{
 
-    struct WorkerControl {
+    // 每个 worker 独占一条 cache line，避免互相 false sharing
+    struct alignas(64) WorkerControl {
         std::atomic<int> state{0}; // 0: 等待, 1: 执行, 2: 退出
         std::vector<TaskType> bucket;
-        std::atomic<int> head;
-        int tail;
+        std::atomic<int> head{0};
+        int tail = -1;
+        uint steals = 0;           // 只由本 worker 写
     };
 public:
-    TaskDispatcher(int _threadCount):finishedCount(0), threadCount(_threadCount){
+    TaskDispatcher(int _threadCount, bool _pinned = false):threadCount(0), finishedCount(0), pinned(_pinned){
+        spawnWorkers(std::max(1, _threadCount));
+    }
+    ~TaskDispatcher(){
+        stopWorkers();
+    }
+
+    int size() const{
+        return threadCount;
+    }
+
+    // 只能在两次 runBatch 之间调用
+    void resize(int n){
+        n = std::max(1, n);
+        if(n == threadCount) return;
+        stopWorkers();
+        spawnWorkers(n);
+    }
+
+    // 把 worker 绑到 cpuPlacementOrder() 给出的逻辑核上；关掉时恢复成进程原本的 mask
+    void setPinned(bool pin){
+        pinned = pin;
+        applyAffinity();
+    }
+    bool isPinned() const{
+        return pinned;
+    }
+
+    // 当前线程在池里的编号，不是 worker 线程时返回 -1
+    static int currentWorker(){
+        return workerIndex;
+    }
+    // 上一次 runBatch 里 worker i 偷到的任务数
+    uint stealCount(int i) const{
+        return controls[i]->steals;
+    }
+
+    void runBatch(std::vector<std::vector<TaskType>> &&buckets){
+        finishedCount.store(0, std::memory_order_relaxed);
+        int taskCount = 0;
+
+        workDone = std::make_unique<std::latch>(threadCount);
+
+        for (int i = 0; i < threadCount; ++i) {
+            taskCount += buckets[i].size();
+            controls[i]->bucket = std::move(buckets[i]);
+            // head/tail 要在唤醒之前设好，否则别的 worker 可能拿着旧的 tail 来偷
+            controls[i]->tail = controls[i]->bucket.size()-1;
+            controls[i]->head = 0;
+            controls[i]->steals = 0;
+        }
+        for (int i = 0; i < threadCount; ++i) {
+            controls[i]->state.store(1);
+            controls[i]->state.notify_one();
+        }
+        workDone->wait();
+    }
+
+private:
+
+    void spawnWorkers(int n){
+        threadCount = n;
         for(int i=0;i<threadCount;i++){
             controls.push_back(new WorkerControl());
             workers.emplace_back([this, i] {
+                workerIndex = i;
                 auto* ctrl = controls[i];
                 while (true) {
                     ctrl->state.wait(0);
                     if (ctrl->state.load() == 2) break;
-                    ctrl->head = 0;
-                    ctrl->tail = ctrl->bucket.size()-1;
 
                     while(ctrl->head <= ctrl->tail) {
                         int chead = ctrl->head;
@@ -147,48 +261,74 @@ public:
                         int tmp = chead + 1;
                         if(controls[id]->head.compare_exchange_strong(chead, tmp)){
                             // if(controls[id]->head > ctail) continue;
+                            ctrl->steals++;
                             controls[id]->bucket[chead]();
                         }
                     }
                     workDone->count_down();
                 }
             });
-
         }
+        applyAffinity();
     }
-    ~TaskDispatcher(){
+    void stopWorkers(){
         for (auto* ctrl : controls) {
             ctrl->state.store(2);
             ctrl->state.notify_one();
         }
         for (auto& t : workers) t.join();
         for (auto* ctrl : controls) delete ctrl;
+        workers.clear();
+        controls.clear();
     }
-
-    void runBatch(std::vector<std::vector<TaskType>> &&buckets){
-        finishedCount.store(0, std::memory_order_relaxed);
-        int taskCount = 0;
-
-        workDone = std::make_unique<std::latch>(threadCount);
-
-        for (int i = 0; i < threadCount; ++i) {
-            taskCount += buckets[i].size();
-            controls[i]->bucket = std::move(buckets[i]);
-            controls[i]->state.store(1);
-            controls[i]->state.notify_one();
+    void applyAffinity(){
+#ifdef __linux__
+        std::vector<int> order = cpuPlacementOrder();
+        if(order.empty()) return;
+        for(auto [id, worker]: enumerate(workers)){
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            if(pinned) CPU_SET(order[id % order.size()], &mask);
+            else for(int cpu: order) CPU_SET(cpu, &mask);
+            pthread_setaffinity_np(worker.native_handle(), sizeof(mask), &mask);
         }
-        workDone->wait();
+#endif
     }
 
-private:
-
     int threadCount;
     std::vector<std::thread> workers;
     std::vector<WorkerControl*> controls;
     std::atomic<int> finishedCount;
+    bool pinned;
 
     std::unique_ptr<std::latch> workDone;
 
+    static inline thread_local int workerIndex = -1;
+
+};
+
+// 单生产者单消费者的三缓冲。生产者只写 back，写完 publish 把它和中间那份交换；
+// 消费者 acquire 时如果中间那份是新的就换到 front。两边都不加锁，也不会等对方
+template<typename T>
+class TripleBuffer{
+public:
+    T &back(){ return buffers[backIndex]; }
+    void publish(){
+        backIndex = middle.exchange(backIndex | freshBit, std::memory_order_acq_rel) & indexMask;
+    }
+    // 换到了新的一份返回 true，没有的话 front 保持不变
+    bool acquire(){
+        if(!(middle.load(std::memory_order_relaxed) & freshBit)) return false;
+        frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & indexMask;
+        return true;
+    }
+    const T &front() const{ return buffers[frontIndex]; }
+
+private:
+    static constexpr int indexMask = 3, freshBit = 4;
+    T buffers[3];
+    int backIndex = 0, frontIndex = 1;
+    std::atomic<int> middle{2};
 };
 
 #endif // UTILS_H